@@ -103,6 +103,16 @@ int myshortcmp(const void *s1, const void *s2)
     }
 }
 
+/** hist_key_index()
+ * Position of a key among the 768 keys, blue, then green, then red
+ */
+int hist_key_index(void *key)
+{
+    short val = *((short *)key);
+
+    return (val / 1000) * 256 + val % 1000;
+}
+
 /** hist_map()
  * Map function that computes the histogram values for the portion
  * of the image assigned to the map task
@@ -110,11 +120,14 @@ int myshortcmp(const void *s1, const void *s2)
 void hist_map(map_args_t *args) 
 {
     int i;
-    short *key;
     unsigned char *val;
     intptr_t red[256];
     intptr_t green[256];
     intptr_t blue[256];
+    void *keys[3 * 256];
+    void *vals[3 * 256];
+    int key_sizes[3 * 256];
+    int num_keys = 0;
 
     assert(args);
     unsigned char *data = (unsigned char *)args->data;
@@ -139,20 +152,25 @@ void hist_map(map_args_t *args)
     for (i = 0; i < 256; i++) 
     {
         if (blue[i] > 0) {
-            key = &(blue_keys[i]);
-            emit_intermediate((void *)key, (void *)blue[i], (int)sizeof(short));
+            keys[num_keys] = &(blue_keys[i]);
+            vals[num_keys] = (void *)blue[i];
+            key_sizes[num_keys++] = (int)sizeof(short);
         }
         
         if (green[i] > 0) {
-            key = &(green_keys[i]);
-            emit_intermediate((void *)key, (void *)green[i], (int)sizeof(short));
+            keys[num_keys] = &(green_keys[i]);
+            vals[num_keys] = (void *)green[i];
+            key_sizes[num_keys++] = (int)sizeof(short);
         }
         
         if (red[i] > 0) {
-            key = &(red_keys[i]);
-            emit_intermediate((void *)key, (void *)red[i], (int)sizeof(short));
+            keys[num_keys] = &(red_keys[i]);
+            vals[num_keys] = (void *)red[i];
+            key_sizes[num_keys++] = (int)sizeof(short);
         }
     }
+
+    emit_intermediate_batch(keys, vals, key_sizes, num_keys);
 }
 
 /** hist_reduce()
@@ -280,6 +298,8 @@ int main(int argc, char *argv[]) {
     map_reduce_args.combiner = hist_combiner;
     map_reduce_args.splitter = NULL; //hist_splitter;
     map_reduce_args.key_cmp = myshortcmp;
+    map_reduce_args.num_dense_keys = 3 * 256;
+    map_reduce_args.key_index = hist_key_index;
     
     map_reduce_args.unit_size = 3;  // 3 bytes per pixel
     map_reduce_args.partition = NULL; // use default
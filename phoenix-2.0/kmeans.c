@@ -222,6 +222,14 @@ int mykeycmp(const void *s1, const void *s2)
     else return 0;
 }
 
+/** mykeyindex()
+ *  Dense position of a key, the cluster id
+ */
+int mykeyindex(void *key)
+{
+    return *((int *)key);
+}
+
 /** find_clusters()
  *  Find the cluster that is most suitable for a given set of points
  */
@@ -357,6 +365,7 @@ int main(int argc, char **argv)
 {
     final_data_t kmeans_vals;
     map_reduce_args_t map_reduce_args;
+    map_reduce_job_t *job;
     int i;
     int *means;
     bool first_run;
@@ -402,6 +411,8 @@ int main(int argc, char **argv)
     map_reduce_args.splitter = kmeans_splitter;
     map_reduce_args.locator = kmeans_locator;
     map_reduce_args.key_cmp = mykeycmp;
+    map_reduce_args.num_dense_keys = num_means;
+    map_reduce_args.key_index = mykeyindex;
     map_reduce_args.unit_size = kmeans_data.unit_size;
     map_reduce_args.partition = NULL; // use default
     map_reduce_args.result = &kmeans_vals;
@@ -413,9 +424,15 @@ int main(int argc, char **argv)
     map_reduce_args.num_procs = atoi(GETENV("MR_NUMPROCS"));//16;
     map_reduce_args.key_match_factor = (float)atof(GETENV("MR_KEYMATCHFACTOR"));//2;
     map_reduce_args.use_one_queue_per_task = true;
+    map_reduce_args.pipeline = atoi(GETENV("MR_PIPELINE")) ? true : false;
+    map_reduce_args.split = atoi(GETENV("MR_SPLIT"));
     
     printf("KMeans: Calling MapReduce Scheduler\n");
 
+    // Set up once, every iteration reuses the runtime state
+    job = map_reduce_job_create (&map_reduce_args);
+    CHECK_ERROR (job == NULL);
+
     get_time (&end);
 
 #ifdef TIMING
@@ -430,7 +447,7 @@ int main(int argc, char **argv)
         //dprintf(".");
 
         get_time (&begin);
-        CHECK_ERROR (map_reduce (&map_reduce_args) < 0);
+        CHECK_ERROR (map_reduce_job_run (job) < 0);
         get_time (&end);
 
 #ifdef TIMING
@@ -461,6 +478,7 @@ int main(int argc, char **argv)
 
     get_time (&begin);
 
+    map_reduce_job_destroy (job);
     CHECK_ERROR (map_reduce_finalize ());
     
     dprintf("\n");
@@ -55,6 +55,39 @@ enum {
     KEY_SXY,
 };
 
+// The sums are inline values where a long long fits in a pointer,
+// otherwise each one is allocated
+#define INLINE_SUMS (sizeof(long long) <= sizeof(void*))
+
+/** sum_val()
+ *  Value to emit for SUM: SUM itself, copied by the emit, or a copy
+ */
+static void *sum_val(long long *sum)
+{
+    long long *boxed;
+
+    if (INLINE_SUMS)
+        return (void *)sum;
+
+    boxed = CALLOC(sizeof(long long), 1);
+    *boxed = *sum;
+    return (void *)boxed;
+}
+
+/** sum_of()
+ *  Sum held by a final key/value pair
+ */
+static long long sum_of(keyval_t *kv)
+{
+    long long sum;
+
+    if (INLINE_SUMS)
+        memcpy(&sum, &kv->val, sizeof(sum));
+    else
+        sum = *(long long *)kv->val;
+    return sum;
+}
+
 static int intkeycmp(const void *v1, const void *v2)
 {
     intptr_t i1 = (intptr_t)v1;
@@ -68,6 +101,14 @@ static int intkeycmp(const void *v1, const void *v2)
          return 0;
 }
 
+/** intkeyindex()
+ *  Dense position of a key, in intkeycmp() order
+ */
+static int intkeyindex(void *key)
+{
+    return KEY_SXY - (intptr_t)key;
+}
+
 /** sort_map()
  *  Sorts based on the val output of wordcount
  */
@@ -80,11 +121,7 @@ static void linear_regression_map(map_args_t *args)
 
     assert(data);
 
-    long long * SX  = CALLOC(sizeof(long long), 1);
-    long long * SXX = CALLOC(sizeof(long long), 1);
-    long long * SY  = CALLOC(sizeof(long long), 1);
-    long long * SYY = CALLOC(sizeof(long long), 1);
-    long long * SXY = CALLOC(sizeof(long long), 1);
+    long long SX, SXX, SY, SYY, SXY;
 
     register long long x, y;
     register long long sx = 0, sxx = 0, sy = 0, syy = 0, sxy = 0;
@@ -102,17 +139,17 @@ static void linear_regression_map(map_args_t *args)
         sxy += x * y;
     }
 
-    *SX = sx;
-    *SXX = sxx;
-    *SY = sy;
-    *SYY = syy;
-    *SXY = sxy;
-
-    emit_intermediate((void*)KEY_SX,  (void*)SX,  sizeof(void*)); 
-    emit_intermediate((void*)KEY_SXX, (void*)SXX, sizeof(void*)); 
-    emit_intermediate((void*)KEY_SY,  (void*)SY,  sizeof(void*)); 
-    emit_intermediate((void*)KEY_SYY, (void*)SYY, sizeof(void*)); 
-    emit_intermediate((void*)KEY_SXY, (void*)SXY, sizeof(void*)); 
+    SX = sx;
+    SXX = sxx;
+    SY = sy;
+    SYY = syy;
+    SXY = sxy;
+
+    emit_intermediate((void*)KEY_SX,  sum_val(&SX),  sizeof(void*)); 
+    emit_intermediate((void*)KEY_SXX, sum_val(&SXX), sizeof(void*)); 
+    emit_intermediate((void*)KEY_SY,  sum_val(&SY),  sizeof(void*)); 
+    emit_intermediate((void*)KEY_SYY, sum_val(&SYY), sizeof(void*)); 
+    emit_intermediate((void*)KEY_SXY, sum_val(&SXY), sizeof(void*)); 
 }
 
 static int linear_regression_partition(int reduce_tasks, void* key, int key_size)
@@ -125,8 +162,7 @@ static int linear_regression_partition(int reduce_tasks, void* key, int key_size
  */
 static void linear_regression_reduce(void *key_in, iterator_t *itr)
 {
-    long long *sumptr = CALLOC(sizeof(long long), 1);
-    register long long sum = 0;
+    long long sum = 0;
     long long *val;
 
     assert (itr);
@@ -134,29 +170,35 @@ static void linear_regression_reduce(void *key_in, iterator_t *itr)
     while (iter_next (itr, (void **)&val))
     {
         sum += *val;
-        free (val);
+        if (!INLINE_SUMS)
+            free (val);
     }
 
-    *sumptr = sum;
-    emit(key_in, (void *)sumptr);
+    emit(key_in, sum_val(&sum));
 }
 
+/** linear_regression_combiner()
+ *  Adds up the values into the first one, which the runtime copies if
+ *  inline
+ */
 static void *linear_regression_combiner (iterator_t *itr)
 {
-    long long *sumptr = CALLOC(sizeof(long long), 1);
-    register long long sum = 0;
-    long long *val;
+    long long sum = 0;
+    long long *val, *first = NULL;
 
     assert(itr);
 
     while (iter_next (itr, (void **)&val))
     {
         sum += *val;
-        free (val);
+        if (first == NULL)
+            first = val;
+        else if (!INLINE_SUMS)
+            free (val);
     }
 
-    *sumptr = sum;
-    return (void *)sumptr;
+    *first = sum;
+    return (void *)first;
 }
 
 int main(int argc, char *argv[]) {
@@ -213,6 +255,10 @@ int main(int argc, char *argv[]) {
     map_reduce_args.combiner = linear_regression_combiner;
     map_reduce_args.splitter = NULL; // Array splitter;
     map_reduce_args.key_cmp = intkeycmp;
+    map_reduce_args.num_dense_keys = KEY_SXY + 1;
+    map_reduce_args.key_index = intkeyindex;
+    if (INLINE_SUMS)
+        map_reduce_args.inline_val_size = sizeof(long long);
     map_reduce_args.unit_size = sizeof(POINT_T);
     map_reduce_args.partition = linear_regression_partition; 
     map_reduce_args.result = &final_vals;
@@ -256,25 +302,26 @@ int main(int argc, char *argv[]) {
         switch ((intptr_t)curr->key)
         {
         case KEY_SX:
-             SX_ll = (*(long long*)curr->val);
+             SX_ll = sum_of(curr);
              break;
         case KEY_SY:
-             SY_ll = (*(long long*)curr->val);
+             SY_ll = sum_of(curr);
              break;
         case KEY_SXX:
-             SXX_ll = (*(long long*)curr->val);
+             SXX_ll = sum_of(curr);
              break;
         case KEY_SYY:
-             SYY_ll = (*(long long*)curr->val);
+             SYY_ll = sum_of(curr);
              break;
         case KEY_SXY:
-             SXY_ll = (*(long long*)curr->val);
+             SXY_ll = sum_of(curr);
              break;
         default:
              // INVALID KEY
              CHECK_ERROR(1);
         }
-        free(curr->val);
+        if (!INLINE_SUMS)
+            free(curr->val);
     }
 
     double SX = (double)SX_ll;
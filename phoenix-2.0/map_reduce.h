@@ -76,6 +76,14 @@ typedef struct iterator_t iterator_t;
 int iter_next (iterator_t *itr, void **);
 int iter_size (iterator_t *itr);
 
+/* Size of the key the values belong to, as passed to emit_intermediate().
+ * Lets reduce and combiner functions work on keys that are not 
+ * terminated, see key_len_cmp below. The APPEND store keeps no key sizes
+ * and returns 0 here, so a job that needs them sets key_len_cmp, which
+ * picks another store.
+ */
+int iter_key_size (iterator_t *itr);
+
 /* Reduce function takes in a key pointer, a list of value pointers, and a 
  * length of the list. emit() should be called on any key value pairs 
  * in the result set.
@@ -115,6 +123,91 @@ typedef int (*partition_t)(int, void *, int);
  */
 typedef int (*key_cmp_t)(const void *, const void*);
 
+/* key_len_cmp(key1, key1_size, key2, key2_size) is key_cmp for keys that
+ * are only known along with their size in bytes, as passed to 
+ * emit_intermediate(). It lets keys be slices of a read-only input, with
+ * no terminator written after them.
+ */
+typedef int (*key_len_cmp_t)(const void *, int, const void *, int);
+
+/* Hash function takes in a pointer to a key and the length of the key in
+ * bytes, as passed to emit_intermediate(). Keys that are equal must hash
+ * to the same value.
+ */
+typedef unsigned int (*hash_t)(void *, int);
+
+/* Key index function takes in a pointer to a key, as passed to 
+ * emit_intermediate(), and returns its position in a dense key space of
+ * num_dense_keys keys. Positions must follow the order of key_cmp.
+ */
+typedef int (*key_index_t)(void *);
+
+/* Containers for the intermediate key/value pairs of each map thread.
+ * SORTED  - every partition is kept sorted, a new key is found by binary
+ *           search and inserted in place. Best for few distinct keys.
+ * HASH    - keys are found through an open addressing hash table and each
+ *           partition is sorted once at the end of the map phase. Best for
+ *           many distinct keys. Needs a hash function, see hash below,
+ *           and is APPEND without one.
+ * APPEND  - every pair is appended as is, then sorted and grouped by key
+ *           at the end of the map phase. Best when most keys are emitted
+ *           only once.
+ */
+typedef enum {
+    INTERMEDIATE_STORE_SORTED = 0,
+    INTERMEDIATE_STORE_HASH,
+    INTERMEDIATE_STORE_APPEND
+} intermediate_store_t;
+
+/* Placement of the worker threads of a phase on the processors.
+ * STRAND - fill every hardware thread of a core, then the next core,
+ *          then the next chip. Keeps the workers close together.
+ * CORE   - one worker per core first, chip by chip, then the remaining
+ *          hardware threads. Workers do not share a core.
+ * CHIP   - one worker per chip first, then per core, then per hardware
+ *          thread. Spreads workers over all the memory controllers.
+ */
+typedef enum {
+    PLACEMENT_DEFAULT = 0,
+    PLACEMENT_STRAND_FILL,
+    PLACEMENT_CORE_FILL,
+    PLACEMENT_CHIP_FILL
+} placement_t;
+
+/* When the combiner runs on the values of a map thread.
+ * OFF        - never, reduce sees every value.
+ * AT_EMIT    - on every emit, a key holds at most one value.
+ * CHUNK_FULL - whenever the value chunk of a key fills up, instead of
+ *              allocating a bigger one.
+ * END_OF_MAP - once, when the map thread runs out of map tasks.
+ * ADAPTIVE   - at the end of the map phase, and also on any key that
+ *              gathers combine_threshold values before then. Keeps hot
+ *              keys small at no cost for the others.
+ * With the APPEND store, which groups the pairs by key only at the end of
+ * the map phase, every policy but OFF combines at END_OF_MAP.
+ */
+typedef enum {
+    COMBINE_DEFAULT = 0,
+    COMBINE_OFF,
+    COMBINE_AT_EMIT,
+    COMBINE_CHUNK_FULL,
+    COMBINE_END_OF_MAP,
+    COMBINE_ADAPTIVE
+} combine_t;
+
+/* Sizes of the map tasks.
+ * GUIDED - guided self-scheduling: the first tasks are as big as the L2
+ *          cache, later ones take a share of the input left and shrink
+ *          towards the L1 cache size, or towards the size that takes a
+ *          fixed time to map, as measured by earlier runs of the job.
+ * FIXED  - every task is L1_cache_size bytes, 64 KiB if not set.
+ */
+typedef enum {
+    SPLIT_DEFAULT = 0,
+    SPLIT_GUIDED,
+    SPLIT_FIXED
+} split_t;
+
 /* The arguments to operate the runtime. */
 typedef struct
 {
@@ -147,7 +240,8 @@ typedef struct
     * but can increase merge time. */
     bool use_one_queue_per_task;    
 
-    int L1_cache_size;     /* Size of L1 cache in bytes */
+    int L1_cache_size;     /* Size of L1 cache in bytes, 
+                                 * detected if not set */
     int num_map_threads;   /* # of threads to run map tasks on.
                                  * Default is one per processor */
     int num_reduce_threads;     /* # of threads to run reduce tasks on.
@@ -164,6 +258,98 @@ typedef struct
     float key_match_factor;     /* Magic number that describes the ratio of 
     * the input data size to the output data size.
     * This is used as a hint. */
+
+    intermediate_store_t intermediate_store;
+                                /* Container for intermediate pairs.
+                                 * Default is INTERMEDIATE_STORE_SORTED. */
+    hash_t hash;                /* Key hash for INTERMEDIATE_STORE_HASH.
+                                 * If NULL, default_hash is used when the
+                                 * partition function is the default one,
+                                 * otherwise the append store is used. */
+
+    placement_t map_placement;      /* Thread placement of each phase.   */
+    placement_t reduce_placement;   /* Default is PLACEMENT_CORE_FILL for */
+    placement_t merge_placement;    /* map and reduce, and                */
+                                    /* PLACEMENT_STRAND_FILL for merge.   */
+
+    bool pipeline;              /* Reduce from the map threads without a
+                                 * barrier between the phases: once the
+                                 * last map task is done, each thread
+                                 * claims partitions, combines and reduces
+                                 * them. Hides stragglers on skewed input.
+                                 * The reduce thread count is ignored. */
+
+    int num_dense_keys;         /* If > 0, every key maps to a position in
+                                 * [0, num_dense_keys) through key_index.
+                                 * Each map thread then keeps one flat value
+                                 * array indexed by key, the arrays are
+                                 * combined in a tree across threads and
+                                 * reduced in key order. No partitioning,
+                                 * reduce tasks or merge phase. Meant for
+                                 * small key spaces. */
+    key_index_t key_index;      /* Must be set along with num_dense_keys. */
+
+    bool map_only;              /* No reduce or merge phase, nor any
+                                 * intermediate pairs. The map function 
+                                 * writes its results itself, or passes
+                                 * them to emit(), which collects them per
+                                 * map thread. The result then holds them
+                                 * in no particular order. Not with
+                                 * num_dense_keys, pipeline is ignored. */
+
+    combine_t combine;          /* When to run the combiner. Default is
+                                 * COMBINE_END_OF_MAP. */
+    int combine_threshold;      /* # of values that makes COMBINE_ADAPTIVE
+                                 * combine a key early. */
+
+    split_t split;              /* Map task sizes. Default is 
+                                 * SPLIT_GUIDED. */
+
+    key_len_cmp_t key_len_cmp;  /* If set, compares the intermediate keys
+                                 * in place of key_cmp, which then only
+                                 * orders the final output, as emitted by
+                                 * reduce. The append store is replaced by
+                                 * the hash store, as it keeps no sizes. */
+
+    size_t intermediate_budget; /* If > 0, bytes of intermediate pairs the
+                                 * map threads may hold in memory, roughly.
+                                 * A map thread over its share sorts what 
+                                 * it holds into one run per partition and
+                                 * spills them to a temp file, which reduce
+                                 * then merges from a read-only mapping.
+                                 * Keys and values must outlive the job, as
+                                 * only their pointers are spilled. Ignored
+                                 * with num_dense_keys. */
+    const char *spill_dir;      /* Where spills go. Default is $TMPDIR,
+                                 * or /tmp. */
+
+    int hot_task_split;         /* A reduce task holding more than 1/this
+                                 * of the data share of a reduce thread is
+                                 * split into key ranges, reduced by
+                                 * several workers, so that a few hot 
+                                 * partitions do not hold up the phase. 
+                                 * Values of a key are never split up.
+                                 * Default is 4, < 0 never splits. Not
+                                 * done once the job has spilled, nor with
+                                 * use_one_queue_per_task. */
+
+    int inline_key_size;        /* If > 0, keys are this many bytes, at */
+    int inline_val_size;        /* most sizeof (void *), and so are the
+                                 * values. emit_intermediate() and emit()
+                                 * then take a pointer to the bytes and
+                                 * copy them into the slot of the key or
+                                 * value pointer, so the map function 
+                                 * allocates nothing per pair and compares
+                                 * touch no other memory. Callbacks get a 
+                                 * pointer to the slot, valid for the 
+                                 * call, and a combiner returns a pointer
+                                 * to the combined bytes, such as one of
+                                 * its values overwritten. In the result,
+                                 * the key and val fields hold the bytes.
+                                 * Inline pairs may also be spilled. A job
+                                 * whose keys or values are larger than a
+                                 * pointer on some targets must leave this
+                                 * 0 there and pass pointers instead. */
 } map_reduce_args_t;
 
 /* Runtime defined functions. */
@@ -183,15 +369,44 @@ int map_reduce_finalize ();
  */   
 int map_reduce (map_reduce_args_t * args);
 
+/* A job that is run more than once, as by iterative applications. The
+ * environment, task queue, worker state and intermediate buffers are set
+ * up once by map_reduce_job_create() and only reset between runs, so a
+ * run costs what its data costs. Of the arguments, only task_data, 
+ * data_size, result and what the callbacks read may change between runs;
+ * the rest is read once at creation. Like map_reduce(), not thread safe.
+ */
+typedef struct map_reduce_job_t map_reduce_job_t;
+
+/* Returns NULL if the job could not be set up. */
+map_reduce_job_t *map_reduce_job_create (map_reduce_args_t * args);
+
+/* Same as map_reduce() on the arguments of the job. */
+int map_reduce_job_run (map_reduce_job_t *job);
+
+void map_reduce_job_destroy (map_reduce_job_t *job);
+
 /* This should be called from the map function. It stores a key with key_size
  * bytes and a value in the intermediate queues for processing by the reduce 
  * task. The runtime will call partiton function to assign the key to a 
- * reduce task.
+ * reduce task. Inline keys and values are copied by the call, see 
+ * inline_key_size.
  */
 void emit_intermediate(void *key, void *val, int key_size);
 
-/* This should be called from the reduce function. It stores a key and a value 
- * in the reduce queue. This will be in the final result array.
+/* Same as calling emit_intermediate() on each of the N keys, values and 
+ * key sizes, for map functions that emit many pairs in a row. The pairs 
+ * are staged per thread and stored by reduce task, at the latest when 
+ * the map task returns, so the keys and values must stay valid until 
+ * then, unless they are inline. Values of a key keep their order among 
+ * batched pairs only.
+ */
+void emit_intermediate_batch(void **keys, void **vals, int *key_sizes, 
+    int n);
+
+/* This should be called from the reduce function, or from the map function
+ * of a map_only job. It stores a key and a value in the reduce queue. This 
+ * will be in the final result array.
  */
 void emit(void *key, void *val);
 
@@ -200,4 +415,9 @@ void emit(void *key, void *val);
  */
 int default_partition(int reduce_tasks, void* key, int key_size);
 
+/* This is the built in hash function, over the key_size bytes of the key.
+ * default_partition() is this hash modulo the number of reduce tasks.
+ */
+unsigned int default_hash(void* key, int key_size);
+
 #endif // MAP_REDUCE_H_
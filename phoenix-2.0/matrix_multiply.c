@@ -336,6 +336,7 @@ int main(int argc, char *argv[]) {
     map_reduce_args.num_merge_threads = atoi(GETENV("MR_NUMTHREADS"));//8;
     map_reduce_args.num_procs = atoi(GETENV("MR_NUMPROCS"));//16;
     map_reduce_args.key_match_factor = (float)atof(GETENV("MR_KEYMATCHFACTOR"));//2;
+    map_reduce_args.map_only = true;
 
     fprintf(stderr, "***** data size is %" PRIdPTR "\n", (intptr_t)map_reduce_args.data_size);
     printf("MatrixMult: Calling MapReduce Scheduler Matrix Multiplication\n");
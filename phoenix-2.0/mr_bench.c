@@ -0,0 +1,810 @@
+/* Copyright (c) 2007-2009, Stanford University
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*      * Redistributions of source code must retain the above copyright
+*         notice, this list of conditions and the following disclaimer.
+*      * Redistributions in binary form must reproduce the above copyright
+*         notice, this list of conditions and the following disclaimer in the
+*         documentation and/or other materials provided with the distribution.
+*      * Neither the name of Stanford University nor the names of its 
+*         contributors may be used to endorse or promote products derived from 
+*         this software without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY STANFORD UNIVERSITY ``AS IS'' AND ANY
+* EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL STANFORD UNIVERSITY BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/ 
+
+#include <stdio.h>
+#include <strings.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <assert.h>
+#include <sys/time.h>
+#include "stddefines.h"
+#include "map_reduce.h"
+#include "phoenix/tpool.h"
+
+#define DEF_NUM_EMITS   (1 << 22)
+#define DEF_MAX_KEYS    (1 << 20)
+#define DEF_THREAD_KEYS 1024
+#define DEF_SPILL_KEYS  (1 << 16)
+#define DEF_SKEW_KEYS   (1 << 16)
+#define SKEW_RANGES     64
+#define MIN_KEYS        16
+#define LATENCY_ROUNDS  10000
+#define KEY_LEN         16
+#define BATCH_LEN       64
+
+/* Multiplier used to scatter consecutive emits over the key space. */
+#define KEY_STRIDE      2654435761u
+
+typedef struct {
+    int next_emit;
+    int num_emits;
+    int unit_size;
+} bench_data_t;
+
+typedef struct {
+    int start;
+    int length;
+} bench_map_data_t;
+
+static char *mode = "emit";
+static int num_emits;           /* Emits per job */
+static int max_keys;            /* Largest key cardinality of the sweep */
+static int store = -1;          /* Intermediate store, -1 for all */
+static int num_threads;         /* Workers per phase, 0 for default */
+static int max_threads;         /* Largest thread count of the sweep */
+static int skew = 1;            /* Work factor of the first map task */
+static bool pipeline;           /* Run the jobs pipelined */
+static combine_t combine;       /* When to combine, 0 for default */
+static split_t split;           /* Map task sizes, 0 for default */
+static int work;                /* Busy loop iterations per emit */
+static int extra_emits;         /* Emits added by the skewed map task */
+static size_t budget;           /* Intermediate memory budget, 0 for none */
+static double zipf;             /* Zipf exponent of the key picks, a 
+                                   multiple of 1/2, 0 for even picks */
+static int hot_split;           /* Reduce task split factor, 0 for default */
+static int range_parts;         /* Partition keys by range, not by hash */
+static bool one_queue;          /* One output queue per reduce task */
+static int batch;               /* Emit BATCH_LEN pairs at a time */
+
+static char *keys;              /* num_keys keys of KEY_LEN bytes */
+static int num_keys;
+static double *zipf_cdf;        /* Odds of picking a key up to each rank */
+
+static const char *store_names[] = {"sorted", "hash", "append"};
+static const char *combine_names[] = 
+    {"default", "off", "emit", "chunk", "map", "adaptive"};
+
+/** parse_args()
+ *  Parse the user arguments
+ */
+static void parse_args (int argc, char **argv)
+{
+    int c;
+    extern char *optarg;
+
+    num_emits = DEF_NUM_EMITS;
+    max_keys = 0;
+    num_threads = atoi (GETENV ("MR_NUMTHREADS"));
+    max_threads = sysconf (_SC_NPROCESSORS_ONLN);
+
+    while ((c = getopt (argc, argv, "m:n:k:s:t:z:w:")) != EOF)
+    {
+        switch (c) {
+            case 'm':
+                mode = optarg;
+                break;
+            case 'n':
+                num_emits = atoi (optarg);
+                break;
+            case 'k':
+                max_keys = atoi (optarg);
+                break;
+            case 's':
+                store = atoi (optarg);
+                break;
+            case 't':
+                max_threads = atoi (optarg);
+                break;
+            case 'z':
+                skew = atoi (optarg);
+                break;
+            case 'w':
+                work = atoi (optarg);
+                break;
+            case '?':
+                printf ("Usage: %s -m <mode> -n <num emits> -k <max keys> "
+                    "-s <store> -t <max threads> -z <skew> -w <work>\n", argv[0]);
+                printf ("  modes: emit (keys vs store), "
+                    "threads (threads vs store, -k keys),\n"
+                    "         pipeline (strict vs pipelined phases, "
+                    "first map task -z times the work),\n"
+                    "         combine (keys vs combine policy),\n"
+                    "         split (threads vs map task sizes, "
+                    "-w work per emit),\n"
+                    "         spill (intermediate memory budget, "
+                    "-k keys),\n"
+                    "         latency (threads vs empty phase round trip),\n"
+                    "         skew (Zipf key skew vs hot reduce task "
+                    "splits, -k keys),\n"
+                    "         batch (keys vs store, single vs batched "
+                    "emits)\n");
+                printf ("  stores: 0 sorted, 1 hash, 2 append, -1 all\n");
+                exit (1);
+        }
+    }
+
+    if (max_keys == 0)
+    {
+        if (strcmp (mode, "threads") == 0)
+            max_keys = DEF_THREAD_KEYS;
+        else if (strcmp (mode, "spill") == 0)
+            max_keys = DEF_SPILL_KEYS;
+        else if (strcmp (mode, "skew") == 0)
+            max_keys = DEF_SKEW_KEYS;
+        else
+            max_keys = DEF_MAX_KEYS;
+    }
+
+    if (num_emits <= 0 || max_keys < MIN_KEYS || store < -1 || 
+        store > INTERMEDIATE_STORE_APPEND || max_threads <= 0 || skew < 1 ||
+        work < 0) {
+        printf ("Illegal argument value\n");
+        exit (1);
+    }
+}
+
+/** bench_splitter()
+ *  Hands out ranges of emit indices
+ */
+static int bench_splitter (void *data_in, int req_units, map_args_t *out)
+{
+    bench_data_t *data = (bench_data_t *)data_in;
+    bench_map_data_t *map_data;
+
+    assert (data);
+    assert (out);
+
+    if (data->next_emit >= data->num_emits)
+        return 0;
+
+    if (req_units > data->num_emits - data->next_emit)
+        req_units = data->num_emits - data->next_emit;
+
+    map_data = (bench_map_data_t *)MALLOC (sizeof (bench_map_data_t));
+    map_data->start = data->next_emit;
+    map_data->length = req_units;
+    data->next_emit += req_units;
+
+    out->data = map_data;
+    out->length = req_units;
+
+    return 1;
+}
+
+/** zipf_key()
+ *  Key picked for emit index i, by inverting the Zipf distribution at a
+ *  point scattered over [0, 1)
+ */
+static unsigned int zipf_key (int i)
+{
+    double u = ((unsigned int)i * KEY_STRIDE) / 4294967296.0;
+    int low = 0, high = num_keys - 1, mid;
+
+    while (low < high)
+    {
+        mid = (low + high) / 2;
+        if (zipf_cdf[mid] <= u)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    return low;
+}
+
+/** bench_map()
+ *  Emits one count per index, keys scattered over the key space, or
+ *  picked with Zipf skew
+ */
+static void bench_map (map_args_t *args)
+{
+    bench_map_data_t *map_data = (bench_map_data_t *)args->data;
+    unsigned int key;
+    volatile unsigned int spin;
+    int rounds = 1;
+    int i, j;
+    void *batch_keys[BATCH_LEN];
+    void *batch_vals[BATCH_LEN];
+    int batch_sizes[BATCH_LEN];
+    int num_batched = 0;
+
+    assert (map_data);
+
+    /* The first task straggles, the others have to wait for it. */
+    if (map_data->start == 0 && skew > 1)
+    {
+        rounds = skew;
+        extra_emits = (skew - 1) * map_data->length;
+    }
+
+    for (j = 0; j < rounds; j++)
+    {
+        for (i = map_data->start; i < map_data->start + map_data->length; i++)
+        {
+            if (zipf > 0)
+                key = zipf_key (i);
+            else
+                key = ((unsigned int)i * KEY_STRIDE) % num_keys;
+            if (batch)
+            {
+                batch_keys[num_batched] = &keys[key * KEY_LEN];
+                batch_vals[num_batched] = (void *)1;
+                batch_sizes[num_batched++] = KEY_LEN;
+                if (num_batched == BATCH_LEN)
+                {
+                    emit_intermediate_batch (
+                        batch_keys, batch_vals, batch_sizes, num_batched);
+                    num_batched = 0;
+                }
+            }
+            else
+                emit_intermediate (&keys[key * KEY_LEN], (void *)1, KEY_LEN);
+
+            /* Uneven work, one to four times the base amount. */
+            for (spin = work * (1 + ((unsigned int)i * KEY_STRIDE >> 30)); 
+                 spin > 0; spin--)
+                ;
+        }
+    }
+
+    if (num_batched > 0)
+        emit_intermediate_batch (
+            batch_keys, batch_vals, batch_sizes, num_batched);
+
+    free (map_data);
+}
+
+/** bench_range_partition()
+ *  Partitions the keys in SKEW_RANGES ranges of their index, as a sort 
+ *  would, so the ranges of popular keys are hot when the picks are skewed
+ */
+static int bench_range_partition (int reduce_tasks, void *key, int key_size)
+{
+    int64_t range = (int64_t)atoi ((char *)key + 3) * SKEW_RANGES / num_keys;
+
+    return (int)(range % reduce_tasks);
+}
+
+static void *bench_combiner (iterator_t *itr)
+{
+    void *val;
+    intptr_t sum = 0;
+
+    while (iter_next (itr, &val))
+        sum += (intptr_t)val;
+
+    return (void *)sum;
+}
+
+static void bench_reduce (void *key, iterator_t *itr)
+{
+    emit (key, bench_combiner (itr));
+}
+
+static int bench_cmp (const void *v1, const void *v2)
+{
+    return memcmp (v1, v2, KEY_LEN);
+}
+
+/** run_emit()
+ *  Runs one job and returns the emit throughput in emits/sec
+ */
+static double run_emit (intermediate_store_t which)
+{
+    map_reduce_args_t map_reduce_args;
+    final_data_t bench_vals;
+    bench_data_t bench_data;
+    struct timeval begin, end;
+    intptr_t total = 0;
+    double secs;
+    int i;
+
+    extra_emits = 0;
+    bench_data.next_emit = 0;
+    bench_data.num_emits = num_emits;
+    bench_data.unit_size = sizeof (int);
+
+    memset (&map_reduce_args, 0, sizeof (map_reduce_args_t));
+    map_reduce_args.task_data = &bench_data;
+    map_reduce_args.map = bench_map;
+    map_reduce_args.reduce = bench_reduce;
+    map_reduce_args.combiner = bench_combiner;
+    map_reduce_args.splitter = bench_splitter;
+    map_reduce_args.key_cmp = bench_cmp;
+    map_reduce_args.unit_size = bench_data.unit_size;
+    map_reduce_args.partition = range_parts ? bench_range_partition : NULL;
+    map_reduce_args.result = &bench_vals;
+    map_reduce_args.data_size = num_emits * bench_data.unit_size;
+    map_reduce_args.L1_cache_size = atoi (GETENV ("MR_L1CACHESIZE"));
+    map_reduce_args.num_map_threads = num_threads;
+    map_reduce_args.num_reduce_threads = num_threads;
+    map_reduce_args.num_merge_threads = num_threads;
+    map_reduce_args.num_procs = atoi (GETENV ("MR_NUMPROCS"));
+    map_reduce_args.key_match_factor = (float)atof (GETENV ("MR_KEYMATCHFACTOR"));
+    map_reduce_args.intermediate_store = which;
+    map_reduce_args.pipeline = pipeline;
+    map_reduce_args.combine = combine;
+    map_reduce_args.split = split;
+    map_reduce_args.intermediate_budget = budget;
+    map_reduce_args.hot_task_split = hot_split;
+    map_reduce_args.use_one_queue_per_task = one_queue;
+
+    gettimeofday (&begin, NULL);
+    CHECK_ERROR (map_reduce (&map_reduce_args) < 0);
+    gettimeofday (&end, NULL);
+
+    /* Sanity check the job before trusting its timing. */
+    for (i = 0; i < bench_vals.length; i++)
+        total += (intptr_t)((keyval_t *)bench_vals.data)[i].val;
+    CHECK_ERROR (total != num_emits + extra_emits);
+    for (i = 1; i < bench_vals.length; i++)
+        CHECK_ERROR (bench_cmp (bench_vals.data[i - 1].key, 
+            bench_vals.data[i].key) >= 0);
+    if (zipf > 0)
+    {
+        CHECK_ERROR (bench_vals.length > num_keys);
+    }
+    else
+    {
+        CHECK_ERROR (bench_vals.length != 
+            (num_keys < num_emits ? num_keys : num_emits));
+    }
+    free (bench_vals.data);
+
+    secs = (end.tv_sec - begin.tv_sec) + 
+        (end.tv_usec - begin.tv_usec) / 1000000.0;
+
+    return num_emits / secs;
+}
+
+/** pow_half()
+ *  x to the power of s, a multiple of 1/2, without libm
+ */
+static double pow_half (double x, double s)
+{
+    double r = 1.0, root = x;
+    int i;
+
+    for (; s >= 1.0; s -= 1.0)
+        r *= x;
+
+    if (s > 0)
+    {
+        /* Newton's method for the square root. */
+        for (i = 0; i < 64; i++)
+            root = 0.5 * (root + x / root);
+        r *= root;
+    }
+
+    return r;
+}
+
+/** make_keys()
+ *  Sets up num_keys distinct keys, and the Zipf odds of picking them if
+ *  the picks are skewed
+ */
+static void make_keys (void)
+{
+    double sum = 0;
+    int i;
+
+    keys = (char *)MALLOC (num_keys * KEY_LEN);
+    for (i = 0; i < num_keys; i++)
+        snprintf (&keys[i * KEY_LEN], KEY_LEN, "key%012d", i);
+
+    if (zipf > 0)
+    {
+        zipf_cdf = (double *)MALLOC (num_keys * sizeof (double));
+        for (i = 0; i < num_keys; i++)
+        {
+            sum += 1.0 / pow_half (i + 1, zipf);
+            zipf_cdf[i] = sum;
+        }
+        for (i = 0; i < num_keys; i++)
+            zipf_cdf[i] /= sum;
+    }
+}
+
+/** bench_emit()
+ *  Sweeps key cardinality against the intermediate stores
+ */
+static void bench_emit (void)
+{
+    intermediate_store_t which;
+
+    printf ("%-10s %-8s %14s\n", "keys", "store", "emits/sec");
+
+    for (num_keys = MIN_KEYS; num_keys <= max_keys; num_keys *= 16)
+    {
+        make_keys ();
+
+        for (which = INTERMEDIATE_STORE_SORTED; 
+             which <= INTERMEDIATE_STORE_APPEND; which++)
+        {
+            if (store >= 0 && store != which)
+                continue;
+
+            printf ("%-10d %-8s %14.0f\n", 
+                num_keys, store_names[which], run_emit (which));
+        }
+
+        free (keys);
+    }
+}
+
+/** bench_batch()
+ *  Sweeps key cardinality against the intermediate stores, emitting one
+ *  pair at a time or BATCH_LEN at a time
+ */
+static void bench_batch (void)
+{
+    intermediate_store_t which;
+    double single, batched;
+
+    printf ("%-10s %-8s %14s %14s %8s\n", 
+        "keys", "store", "single/sec", "batched/sec", "gain");
+
+    for (num_keys = MIN_KEYS; num_keys <= max_keys; num_keys *= 16)
+    {
+        make_keys ();
+
+        for (which = INTERMEDIATE_STORE_SORTED; 
+             which <= INTERMEDIATE_STORE_APPEND; which++)
+        {
+            if (store >= 0 && store != which)
+                continue;
+
+            batch = 0;
+            single = run_emit (which);
+            batch = 1;
+            batched = run_emit (which);
+
+            printf ("%-10d %-8s %14.0f %14.0f %7.1f%%\n", num_keys, 
+                store_names[which], single, batched, 
+                100.0 * (batched - single) / single);
+        }
+
+        free (keys);
+    }
+
+    batch = 0;
+}
+
+/** bench_threads()
+ *  Sweeps the number of workers against the intermediate stores, to 
+ *  show how emit cost scales with thread count
+ */
+static void bench_threads (void)
+{
+    intermediate_store_t which;
+    double rate;
+
+    num_keys = max_keys;
+    make_keys ();
+
+    printf ("keys = %d\n", num_keys);
+    printf ("%-8s %-8s %14s %14s\n", 
+        "threads", "store", "emits/sec", "per thread");
+
+    for (num_threads = 1; num_threads <= max_threads; 
+         num_threads = (num_threads * 2 > max_threads && 
+                        num_threads < max_threads) ? 
+                        max_threads : num_threads * 2)
+    {
+        for (which = INTERMEDIATE_STORE_SORTED; 
+             which <= INTERMEDIATE_STORE_APPEND; which++)
+        {
+            if (store >= 0 && store != which)
+                continue;
+
+            rate = run_emit (which);
+            printf ("%-8d %-8s %14.0f %14.0f\n", num_threads, 
+                store_names[which], rate, rate / num_threads);
+        }
+    }
+
+    free (keys);
+}
+
+/** bench_pipeline()
+ *  Sweeps key cardinality with a straggling map task, comparing the wall
+ *  time of strict phases against pipelined ones
+ */
+static void bench_pipeline (void)
+{
+    intermediate_store_t which;
+    double strict, pipelined;
+
+    which = (store >= 0) ? store : INTERMEDIATE_STORE_SORTED;
+
+    printf ("store = %s, skew = %d\n", store_names[which], skew);
+    printf ("%-10s %12s %12s %8s\n", 
+        "keys", "strict ms", "pipeline ms", "saved");
+
+    for (num_keys = MIN_KEYS; num_keys <= max_keys; num_keys *= 16)
+    {
+        make_keys ();
+
+        pipeline = false;
+        strict = 1000.0 * num_emits / run_emit (which);
+        pipeline = true;
+        pipelined = 1000.0 * num_emits / run_emit (which);
+
+        printf ("%-10d %12.1f %12.1f %7.1f%%\n", num_keys, strict, 
+            pipelined, 100.0 * (strict - pipelined) / strict);
+
+        free (keys);
+    }
+
+    pipeline = false;
+}
+
+/** bench_combine()
+ *  Sweeps key cardinality against the combine policies, few keys means
+ *  long value chains for each
+ */
+static void bench_combine (void)
+{
+    intermediate_store_t which;
+
+    which = (store >= 0) ? store : INTERMEDIATE_STORE_SORTED;
+
+    printf ("store = %s\n", store_names[which]);
+    printf ("%-10s %-9s %14s\n", "keys", "combine", "emits/sec");
+
+    for (num_keys = MIN_KEYS; num_keys <= max_keys; num_keys *= 16)
+    {
+        make_keys ();
+
+        for (combine = COMBINE_OFF; combine <= COMBINE_ADAPTIVE; combine++)
+        {
+            printf ("%-10d %-9s %14.0f\n", 
+                num_keys, combine_names[combine], run_emit (which));
+        }
+
+        free (keys);
+    }
+
+    combine = COMBINE_DEFAULT;
+}
+
+/** bench_split()
+ *  Sweeps the number of workers against the map task sizing, the job
+ *  is dominated by its map phase
+ */
+static void bench_split (void)
+{
+    intermediate_store_t which;
+    double ms[SPLIT_FIXED + 1];
+
+    which = (store >= 0) ? store : INTERMEDIATE_STORE_SORTED;
+    if (work == 0)
+        work = 200;
+
+    num_keys = MIN_KEYS;
+    make_keys ();
+
+    printf ("store = %s, keys = %d, work = %d\n", 
+        store_names[which], num_keys, work);
+    printf ("%-8s %12s %12s %8s\n", 
+        "threads", "fixed ms", "guided ms", "saved");
+
+    for (num_threads = 1; num_threads <= max_threads; 
+         num_threads = (num_threads * 2 > max_threads && 
+                        num_threads < max_threads) ? 
+                        max_threads : num_threads * 2)
+    {
+        for (split = SPLIT_GUIDED; split <= SPLIT_FIXED; split++)
+            ms[split] = 1000.0 * num_emits / run_emit (which);
+
+        printf ("%-8d %12.1f %12.1f %7.1f%%\n", num_threads, 
+            ms[SPLIT_FIXED], ms[SPLIT_GUIDED], 
+            100.0 * (ms[SPLIT_FIXED] - ms[SPLIT_GUIDED]) / ms[SPLIT_FIXED]);
+    }
+
+    split = SPLIT_DEFAULT;
+    free (keys);
+}
+
+/** bench_spill()
+ *  Shrinks the intermediate memory budget until most pairs go through
+ *  spill files, against the time of the job kept in memory
+ */
+static void bench_spill (void)
+{
+    intermediate_store_t which;
+    double in_memory, ms;
+    size_t budgets[] = {64 << 20, 16 << 20, 4 << 20, 1 << 20, 256 << 10};
+    int i;
+
+    which = (store >= 0) ? store : INTERMEDIATE_STORE_SORTED;
+
+    num_keys = max_keys;
+    make_keys ();
+
+    printf ("store = %s, keys = %d\n", store_names[which], num_keys);
+    printf ("%-12s %12s %8s\n", "budget KiB", "ms", "overhead");
+
+    budget = 0;
+    in_memory = 1000.0 * num_emits / run_emit (which);
+    printf ("%-12s %12.1f %7.1f%%\n", "none", in_memory, 0.0);
+
+    for (i = 0; i < sizeof (budgets) / sizeof (budgets[0]); i++)
+    {
+        budget = budgets[i];
+        ms = 1000.0 * num_emits / run_emit (which);
+        printf ("%-12lu %12.1f %7.1f%%\n", (unsigned long)(budget >> 10), 
+            ms, 100.0 * (ms - in_memory) / in_memory);
+    }
+
+    budget = 0;
+    free (keys);
+}
+
+/** empty_phase()
+ *  Worker function of a phase with nothing to do
+ */
+static void *empty_phase (void *arg)
+{
+    return arg;
+}
+
+/** bench_latency()
+ *  Sweeps thread count against the time the worker pool takes to start 
+ *  an empty phase on every thread and see all of them done
+ */
+static void bench_latency (void)
+{
+    tpool_t *tpool;
+    void **args;
+    struct timeval begin, end;
+    double usecs;
+    int i;
+
+    printf ("rounds = %d\n", LATENCY_ROUNDS);
+    printf ("%-8s %14s\n", "threads", "usec/phase");
+
+    for (num_threads = 1; num_threads <= max_threads; 
+         num_threads = (num_threads * 2 > max_threads && 
+                        num_threads < max_threads) ? 
+                        max_threads : num_threads * 2)
+    {
+        tpool = tpool_create (num_threads);
+        CHECK_ERROR (tpool == NULL);
+        args = (void **)calloc (num_threads, sizeof (void *));
+        CHECK_ERROR (args == NULL);
+        CHECK_ERROR (tpool_set (tpool, empty_phase, args, num_threads));
+
+        /* Let every thread run once before timing. */
+        CHECK_ERROR (tpool_begin (tpool));
+        CHECK_ERROR (tpool_wait (tpool));
+
+        gettimeofday (&begin, NULL);
+        for (i = 0; i < LATENCY_ROUNDS; i++)
+        {
+            CHECK_ERROR (tpool_begin (tpool));
+            CHECK_ERROR (tpool_wait (tpool));
+        }
+        gettimeofday (&end, NULL);
+
+        usecs = (end.tv_sec - begin.tv_sec) * 1000000.0 + 
+            (end.tv_usec - begin.tv_usec);
+        printf ("%-8d %14.2f\n", num_threads, usecs / LATENCY_ROUNDS);
+
+        free (args);
+        CHECK_ERROR (tpool_destroy (tpool));
+    }
+
+    num_threads = 0;
+}
+
+/** bench_skew()
+ *  Sweeps the Zipf skew of the keys, with hot reduce tasks split or 
+ *  never split. Combining is off and the keys are partitioned by range,
+ *  as a sort would, so that the partitions of popular keys are hot.
+ */
+static void bench_skew (void)
+{
+    intermediate_store_t which;
+    double exponents[] = {0, 0.5, 1.0, 1.5};
+    double whole, split_ms;
+    int i;
+
+    which = (store >= 0) ? store : INTERMEDIATE_STORE_SORTED;
+    combine = COMBINE_OFF;
+    range_parts = 1;
+    num_keys = max_keys;
+
+    printf ("store = %s, keys = %d\n", store_names[which], num_keys);
+    printf ("%-8s %12s %12s %8s\n", "zipf", "whole ms", "split ms", "saved");
+
+    for (i = 0; i < sizeof (exponents) / sizeof (exponents[0]); i++)
+    {
+        zipf = exponents[i];
+        make_keys ();
+
+        hot_split = -1;
+        whole = 1000.0 * num_emits / run_emit (which);
+        hot_split = 0;
+        split_ms = 1000.0 * num_emits / run_emit (which);
+
+        printf ("%-8.1f %12.1f %12.1f %7.1f%%\n", zipf, whole, split_ms, 
+            100.0 * (whole - split_ms) / whole);
+
+        /* Output queues per reduce task must still come out sorted. */
+        one_queue = true;
+        run_emit (which);
+        one_queue = false;
+
+        free (keys);
+        if (zipf_cdf != NULL)
+        {
+            free (zipf_cdf);
+            zipf_cdf = NULL;
+        }
+    }
+
+    zipf = 0;
+    range_parts = 0;
+    combine = COMBINE_DEFAULT;
+}
+
+int main (int argc, char **argv)
+{
+    parse_args (argc, argv);
+
+    CHECK_ERROR (map_reduce_init ());
+
+    if (strcmp (mode, "emit") == 0)
+        bench_emit ();
+    else if (strcmp (mode, "threads") == 0)
+        bench_threads ();
+    else if (strcmp (mode, "pipeline") == 0)
+        bench_pipeline ();
+    else if (strcmp (mode, "combine") == 0)
+        bench_combine ();
+    else if (strcmp (mode, "split") == 0)
+        bench_split ();
+    else if (strcmp (mode, "spill") == 0)
+        bench_spill ();
+    else if (strcmp (mode, "latency") == 0)
+        bench_latency ();
+    else if (strcmp (mode, "skew") == 0)
+        bench_skew ();
+    else if (strcmp (mode, "batch") == 0)
+        bench_batch ();
+    else
+    {
+        printf ("Unknown mode %s\n", mode);
+        exit (1);
+    }
+
+    CHECK_ERROR (map_reduce_finalize ());
+
+    return 0;
+}
@@ -55,6 +55,9 @@ typedef struct {
     int cov_row;    
 } pca_cov_loc_t;
 
+// Covariance locations are inline keys where they fit in a pointer
+#define INLINE_LOCS (sizeof(pca_cov_loc_t) <= sizeof(void*))
+
 typedef struct {
     int *matrix;
     keyval_t *mean;
@@ -65,6 +68,7 @@ typedef struct {
 #define DEF_GRID_SIZE 100  // all values in the matrix are from 0 to this value 
 #define DEF_NUM_ROWS 10
 #define DEF_NUM_COLS 10
+#define PCA_BATCH 64  // pairs emitted at a time
 
 pca_data_t pca_data;
 int num_rows;
@@ -213,6 +217,10 @@ void pca_mean_map(map_args_t *args)
     int i, j;
     pca_map_data_t *data = (pca_map_data_t *)args->data;
     int *matrix = data->matrix;
+    void *keys[PCA_BATCH];
+    void *vals[PCA_BATCH];
+    int key_sizes[PCA_BATCH];
+    int num_keys = 0;
     
     /* Compute the mean for the allocated rows to the map task */
     for (i=0; i<args->length; i++) 
@@ -223,8 +231,18 @@ void pca_mean_map(map_args_t *args)
             sum += matrix[i * num_cols + j]; 
         }
         mean = sum / num_cols;
-        emit_intermediate((void *)&matrix[i * num_cols], (void *)mean, sizeof(int *));
+        keys[num_keys] = (void *)&matrix[i * num_cols];
+        vals[num_keys] = (void *)mean;
+        key_sizes[num_keys++] = sizeof(int *);
+        if (num_keys == PCA_BATCH)
+        {
+            emit_intermediate_batch(keys, vals, key_sizes, num_keys);
+            num_keys = 0;
+        }
     }
+
+    if (num_keys > 0)
+        emit_intermediate_batch(keys, vals, key_sizes, num_keys);
     
     free(data);
 }
@@ -339,6 +357,10 @@ void pca_cov_map(map_args_t *args)
     pca_cov_data_t *cov_data = (pca_cov_data_t *)args->data;
     mean = cov_data->mean;
     pca_cov_loc_t *cov_loc;
+    void *keys[PCA_BATCH];
+    void *vals[PCA_BATCH];
+    int key_sizes[PCA_BATCH];
+    int num_keys = 0;
     
     /* compute the covariance for the allocated region */
     for (i=0; i<cov_data->size; i++) 
@@ -363,11 +385,27 @@ void pca_cov_map(map_args_t *args)
         
         //dprintf("Covariance for <%d, %d> is %d\n", start_idx, cov_idx, *covariance);
         
-        CHECK_ERROR((cov_loc = (pca_cov_loc_t *)malloc(sizeof(pca_cov_loc_t))) == NULL);
-        cov_loc->start_row = cov_data->cov_locs[i].start_row;
-        cov_loc->cov_row = cov_data->cov_locs[i].cov_row;
-        emit_intermediate((void *)cov_loc, (void *)covariance, sizeof(pca_cov_loc_t));
+        // The location is an inline key, copied by the emit, where it
+        // fits in a pointer
+        if (INLINE_LOCS)
+            keys[num_keys] = (void *)&cov_data->cov_locs[i];
+        else
+        {
+            CHECK_ERROR((cov_loc = (pca_cov_loc_t *)malloc(sizeof(pca_cov_loc_t))) == NULL);
+            *cov_loc = cov_data->cov_locs[i];
+            keys[num_keys] = (void *)cov_loc;
+        }
+        vals[num_keys] = (void *)covariance;
+        key_sizes[num_keys++] = sizeof(pca_cov_loc_t);
+        if (num_keys == PCA_BATCH)
+        {
+            emit_intermediate_batch(keys, vals, key_sizes, num_keys);
+            num_keys = 0;
+        }
     }
+
+    if (num_keys > 0)
+        emit_intermediate_batch(keys, vals, key_sizes, num_keys);
     
     free(cov_data->cov_locs);
     free(cov_data);
@@ -459,6 +497,8 @@ int main(int argc, char **argv)
     map_reduce_args.splitter = pca_cov_splitter;
     map_reduce_args.locator = pca_cov_locator;
     map_reduce_args.key_cmp = mycovcmp;
+    if (INLINE_LOCS)
+        map_reduce_args.inline_key_size = sizeof(pca_cov_loc_t);
     map_reduce_args.unit_size = pca_data.unit_size;
     map_reduce_args.partition = NULL; // use default
     map_reduce_args.result = &pca_cov_vals;
@@ -471,6 +511,7 @@ int main(int argc, char **argv)
     map_reduce_args.num_merge_threads = atoi(GETENV("MR_NUMTHREADS"));//8;
     map_reduce_args.num_procs = atoi(GETENV("MR_NUMPROCS"));//16;
     map_reduce_args.key_match_factor = atoi(GETENV("MR_KEYMATCHFACTOR"));//2;
+    map_reduce_args.intermediate_store = atoi(GETENV("MR_STORE"));
     map_reduce_args.use_one_queue_per_task = true;
     
     printf("PCA Cov: Calling MapReduce Scheduler\n");
@@ -513,7 +554,8 @@ int main(int argc, char **argv)
             num_rows--;
             cnt = 0;
         }
-        free(pca_cov_vals.data[i].key);
+        if (!INLINE_LOCS)
+            free(pca_cov_vals.data[i].key);
     }
     dprintf ("%" PRIdPTR "\n", sum);
     
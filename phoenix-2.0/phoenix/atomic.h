@@ -39,6 +39,16 @@ static inline void spin_wait(int n)
 	while(tmp > 0) { tmp--; asm("" ::: "memory", "cc"); }
 }
 
+/* hint to the CPU that we are busy waiting */
+static inline void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	asm volatile("pause" ::: "memory");
+#else
+	asm volatile("" ::: "memory");
+#endif
+}
+
 #define set_and_flush(x,y)	\
 	do {				\
 		void*	p;		\
@@ -53,6 +63,9 @@ static inline void spin_wait(int n)
 
 static inline void flush(void* addr) {asm("":::"memory");}
 
+/* full fence, orders earlier stores against later loads */
+static inline void mem_barrier(void) {asm volatile("mfence":::"memory");}
+
 static inline uintptr_t atomic_read(void* addr) { return *((uintptr_t*)addr); }
 
 /* returns zero if already set, returns nonzero if not set */
@@ -180,6 +193,13 @@ static inline void flush(void* addr)
 	__asm__ __volatile__("" ::: "memory");
 }
 
+static inline void mem_barrier(void)
+{
+	__asm__ __volatile__(
+		"membar #StoreLoad | #LoadLoad | #StoreStore | #LoadStore\n"
+	::: "memory");
+}
+
 static inline uintptr_t atomic_read(void* addr)
 {
 	uintptr_t	v;
@@ -0,0 +1,116 @@
+/* Copyright (c) 2007-2009, Stanford University
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*     * Redistributions of source code must retain the above copyright
+*       notice, this list of conditions and the following disclaimer.
+*     * Redistributions in binary form must reproduce the above copyright
+*       notice, this list of conditions and the following disclaimer in the
+*       documentation and/or other materials provided with the distribution.
+*     * Neither the name of Stanford University nor the names of its 
+*       contributors may be used to endorse or promote products derived from 
+*       this software without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY STANFORD UNIVERSITY ``AS IS'' AND ANY
+* EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL STANFORD UNIVERSITY BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/ 
+
+#ifndef HLL_H_
+#define HLL_H_
+
+#include <stdint.h>
+
+/* HyperLogLog counter of distinct keys, fed with the 32 bit hashes the
+   runtime already has for them. HLL_REGS one byte registers, each holding
+   the longest run of leading zeros seen among the hashes routed to it,
+   give the count within about 1.04 / sqrt (HLL_REGS), 3% here. Counters
+   of several threads merge by taking the larger of each register. */
+#define HLL_BITS    10
+#define HLL_REGS    (1 << HLL_BITS)
+
+/* Spreads the bits of a user hash, which may be weak, over the word. */
+static inline uint32_t hll_mix (uint32_t h)
+{
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+
+static inline void hll_add (unsigned char *regs, uint32_t hash)
+{
+    uint32_t h = hll_mix (hash);
+    uint32_t rest = h << HLL_BITS;
+    unsigned char rank;
+
+    rank = (rest != 0) ? __builtin_clz (rest) + 1 : 32 - HLL_BITS + 1;
+    if (regs[h >> (32 - HLL_BITS)] < rank)
+        regs[h >> (32 - HLL_BITS)] = rank;
+}
+
+static inline void hll_merge (unsigned char *regs, const unsigned char *other)
+{
+    int i;
+
+    for (i = 0; i < HLL_REGS; i++)
+    {
+        if (regs[i] < other[i])
+            regs[i] = other[i];
+    }
+}
+
+/* Natural log of X >= 1, without libm. */
+static inline double hll_log (double x)
+{
+    double y, y2, term, sum = 0;
+    int k = 0, i;
+
+    for (; x >= 2.0; x /= 2.0)
+        k++;
+
+    /* ln x = 2 atanh ((x - 1) / (x + 1)), |y| <= 1/3 */
+    y = (x - 1) / (x + 1);
+    y2 = y * y;
+    term = y;
+    for (i = 1; i < 40; i += 2)
+    {
+        sum += term / i;
+        term *= y2;
+    }
+
+    return k * 0.6931471805599453 + 2 * sum;
+}
+
+/* Estimated # of distinct hashes added to REGS. */
+static inline uint64_t hll_estimate (const unsigned char *regs)
+{
+    double sum = 0, est, m = HLL_REGS;
+    int zeros = 0, i;
+
+    for (i = 0; i < HLL_REGS; i++)
+    {
+        sum += 1.0 / (double)(1ULL << regs[i]);
+        zeros += (regs[i] == 0);
+    }
+
+    est = (0.7213 / (1 + 1.079 / m)) * m * m / sum;
+
+    /* Few keys leave registers empty, count those instead. */
+    if (est <= 2.5 * m && zeros > 0)
+        est = m * hll_log (m / zeros);
+
+    return (uint64_t)(est + 0.5);
+}
+
+#endif /* HLL_H_ */
@@ -35,7 +35,7 @@
 
 typedef struct iterator_t iterator_t;
 
-int iter_init (iterator_t *itr, int num_lists)
+int iter_init (iterator_t *itr, int num_lists, int inline_vals)
 {
     assert (itr);
     assert (num_lists > 0);
@@ -53,6 +53,7 @@ int iter_init (iterator_t *itr, int num_lists)
     itr->current_index = 0;
     itr->val = NULL;
     itr->size = 0;
+    itr->inline_vals = inline_vals;
 
     return 0;
 }
@@ -148,7 +149,11 @@ int iter_next (iterator_t *itr, void **addr)
         }
     }
 
-    *addr = itr->val->array[itr->current_index++];
+    /* Inline values are the slots themselves. */
+    if (itr->inline_vals)
+        *addr = &itr->val->array[itr->current_index++];
+    else
+        *addr = itr->val->array[itr->current_index++];
 
     return 1;
 }
@@ -173,3 +178,11 @@ int iter_size (iterator_t *itr)
 
     return itr->size;
 }
+
+int iter_key_size (iterator_t *itr)
+{
+    assert (itr);
+    assert (itr->next_insert_pos > 0);
+
+    return itr->list_array[0]->key_len;
+}
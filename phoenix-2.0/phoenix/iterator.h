@@ -38,9 +38,10 @@ struct iterator_t
     int                 current_index;
     val_t               *val;
     int                 size;
+    int                 inline_vals;    /* Hand out the value slots? */
 };
 
-inline int iter_init (struct iterator_t *, int);
+inline int iter_init (struct iterator_t *, int, int);
 inline void iter_reset (struct iterator_t *);
 inline void iter_rewind (struct iterator_t *);
 inline int iter_next_list (struct iterator_t *, keyvals_t **);
@@ -32,6 +32,158 @@
 #include "processor.h"
 
 #ifdef _LINUX_
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/syscall.h>
+
+#include "memory.h"
+#include "sysfs.h"
+
+/* Flags of get_mempolicy(2), from <numaif.h>. */
+#define MPOL_F_NODE     (1 << 0)
+#define MPOL_F_ADDR     (1 << 1)
+
+/* NUMA nodes that have CPUs become the locality groups, numbered 
+   densely in node order. Read once from sysfs. */
+typedef struct
+{
+    int     num_lgrps;
+    int     *lgrp_size;     /* Number of CPUs in each lgrp. */
+    int     num_cpus;
+    int     *cpu_to_lgrp;   /* Indexed by CPU id, -1 if unknown. */
+    int     num_nodes;
+    int     *node_to_lgrp;  /* Indexed by node id, -1 if no CPUs. */
+} loc_topology_t;
+
+static loc_topology_t   topo;
+static pthread_once_t   topo_once = PTHREAD_ONCE_INIT;
+
+static int loc_int_cmp (const void *a, const void *b)
+{
+    return *(const int *)a - *(const int *)b;
+}
+
+/* Grow MAP to hold index IDX, new entries set to -1. */
+static int *loc_grow_map (int *map, int *len, int idx)
+{
+    int new_len = *len;
+    int i;
+
+    if (idx < *len)
+        return map;
+
+    while (new_len <= idx)
+        new_len = (new_len == 0) ? 64 : new_len * 2;
+
+    map = (int *)mem_realloc (map, new_len * sizeof (int));
+    for (i = *len; i < new_len; i++)
+        map[i] = -1;
+    *len = new_len;
+
+    return map;
+}
+
+/* Add the CPUs in the cpulist of NODE to a new lgrp. 
+   Returns the number of CPUs added. */
+static int loc_add_node (int node)
+{
+    char list[4096];
+    const char *p = list;
+    int first, last, cpu, count = 0;
+
+    if (sysfs_read_str (list, sizeof (list), 
+            "devices/system/node/node%d/cpulist", node) < 0)
+        return 0;
+
+    while (sysfs_next_range (&p, &first, &last))
+    {
+        for (cpu = first; cpu <= last; cpu++)
+        {
+            topo.cpu_to_lgrp = loc_grow_map (
+                topo.cpu_to_lgrp, &topo.num_cpus, cpu);
+            if (topo.cpu_to_lgrp[cpu] >= 0)
+                continue;
+            topo.cpu_to_lgrp[cpu] = topo.num_lgrps;
+            count++;
+        }
+    }
+
+    if (count == 0)
+        return 0;
+
+    topo.node_to_lgrp = loc_grow_map (
+        topo.node_to_lgrp, &topo.num_nodes, node);
+    topo.node_to_lgrp[node] = topo.num_lgrps;
+
+    topo.lgrp_size = (int *)mem_realloc (
+        topo.lgrp_size, (topo.num_lgrps + 1) * sizeof (int));
+    topo.lgrp_size[topo.num_lgrps++] = count;
+
+    return count;
+}
+
+static void loc_init_topology (void)
+{
+    char path[512];
+    DIR *dir;
+    struct dirent *ent;
+    int *nodes = NULL;
+    int num_nodes = 0, i;
+
+    if (sysfs_path (path, sizeof (path), "devices/system/node") == 0 &&
+        (dir = opendir (path)) != NULL)
+    {
+        while ((ent = readdir (dir)) != NULL)
+        {
+            char *end;
+            int node;
+
+            if (strncmp (ent->d_name, "node", 4) != 0)
+                continue;
+            node = (int)strtol (ent->d_name + 4, &end, 10);
+            if (end == ent->d_name + 4 || *end != '\0' || node < 0)
+                continue;
+
+            nodes = (int *)mem_realloc (nodes, (num_nodes + 1) * sizeof (int));
+            nodes[num_nodes++] = node;
+        }
+        closedir (dir);
+    }
+
+    /* readdir() order is arbitrary, number lgrps by node id. */
+    if (num_nodes > 0)
+        qsort (nodes, num_nodes, sizeof (int), loc_int_cmp);
+
+    for (i = 0; i < num_nodes; i++)
+        loc_add_node (nodes[i]);
+
+    if (nodes != NULL)
+        mem_free (nodes);
+
+    if (topo.num_lgrps == 0)
+    {
+        /* No NUMA information, all online CPUs in one lgrp. */
+        int num_cpus = sysconf (_SC_NPROCESSORS_ONLN);
+
+        topo.cpu_to_lgrp = loc_grow_map (
+            topo.cpu_to_lgrp, &topo.num_cpus, num_cpus - 1);
+        for (i = 0; i < num_cpus; i++)
+            topo.cpu_to_lgrp[i] = 0;
+
+        topo.lgrp_size = (int *)mem_malloc (sizeof (int));
+        topo.lgrp_size[0] = num_cpus;
+        topo.num_lgrps = 1;
+    }
+}
+
+static inline loc_topology_t *loc_get_topology (void)
+{
+    CHECK_ERROR (pthread_once (&topo_once, loc_init_topology));
+    return &topo;
+}
 
 #elif defined (_SOLARIS_)
 #include <sys/lgrp_user.h>
@@ -46,8 +198,15 @@
 int loc_get_lgrp_size ()
 {
 #ifdef _LINUX_
-    /* XXX smarter implementation? have all cpus local to this thread */
-    return proc_get_num_cpus ();
+    loc_topology_t *t = loc_get_topology ();
+    int num_cpus = t->lgrp_size[loc_get_lgrp ()];
+    int max_cpus = proc_get_num_cpus ();
+
+    /* Respect a smaller MAPRED_NPROCESSORS. */
+    if (max_cpus > 0 && max_cpus < num_cpus)
+        num_cpus = max_cpus;
+
+    return num_cpus;
 #elif defined (_SOLARIS_)
     int ret, num_cpus;
     lgrp_id_t lgrp;
@@ -70,8 +229,7 @@ int loc_get_lgrp_size ()
 int loc_get_num_lgrps ()
 {
 #ifdef _LINUX_
-    /* XXX only one locality group, all processors */
-    return 1;
+    return loc_get_topology ()->num_lgrps;
 #elif defined (_SOLARIS_)
     int ret;
     lgrp_cookie_t cookie;
@@ -97,7 +255,12 @@ int loc_get_num_lgrps ()
 int loc_get_lgrp ()
 {
 #ifdef _LINUX_
-    return 0;
+    unsigned int cpu;
+
+    if (syscall (SYS_getcpu, &cpu, NULL, NULL) != 0)
+        return 0;
+
+    return loc_cpu_to_lgrp (cpu);
 #elif defined (_SOLARIS_)
     int lgrp = lgrp_home (P_LWPID, P_MYID);
 
@@ -117,8 +280,34 @@ int loc_get_lgrp ()
 int loc_mem_to_lgrp (void *addr)
 {
 #ifdef _LINUX_
-    /* XXX just one for now */
-    return 0;
+    loc_topology_t *t = loc_get_topology ();
+    void *page;
+    int status, node;
+
+    if (t->num_lgrps == 1)
+        return 0;
+
+    /* Query without touching the page. */
+    page = (void *)((uintptr_t)addr & ~((uintptr_t)getpagesize () - 1));
+    if (syscall (SYS_move_pages, 0, 1UL, &page, NULL, &status, 0) == 0)
+    {
+        if (status < 0)
+        {
+            /* Not backed yet, first touch will be by the caller. */
+            return loc_get_lgrp ();
+        }
+        node = status;
+    }
+    else if (syscall (SYS_get_mempolicy, &node, NULL, 0UL, 
+                addr, MPOL_F_NODE | MPOL_F_ADDR) != 0)
+    {
+        return loc_get_lgrp ();
+    }
+
+    if (node < 0 || node >= t->num_nodes || t->node_to_lgrp[node] < 0)
+        return 0;
+
+    return t->node_to_lgrp[node];
 #elif defined (_SOLARIS_)
     uint_t info = MEMINFO_VLGRP;
     uint64_t inaddr;
@@ -153,3 +342,47 @@ int loc_mem_to_lgrp (void *addr)
     return lgrp;
 #endif
 }
+
+/* Retrieve the locality group of processor CPU. */
+int loc_cpu_to_lgrp (int cpu)
+{
+#ifdef _LINUX_
+    loc_topology_t *t = loc_get_topology ();
+
+    if (cpu < 0 || cpu >= t->num_cpus || t->cpu_to_lgrp[cpu] < 0)
+        return 0;
+
+    return t->cpu_to_lgrp[cpu];
+#elif defined (_SOLARIS_)
+    int lgrp, ret;
+    lgrp_cookie_t cookie;
+    int num_lgrps, i, j, num_cpus;
+    processorid_t *cpus;
+
+    cookie = lgrp_init (LGRP_VIEW_CALLER);
+    num_lgrps = lgrp_nlgrps (cookie);
+    lgrp = 0;
+
+    /* Leaf lgrps are numbered from 1, see loc_get_lgrp(). */
+    for (i = 1; i < num_lgrps; i++)
+    {
+        num_cpus = lgrp_cpus (cookie, i, NULL, 0, LGRP_CONTENT_DIRECT);
+        if (num_cpus <= 0)
+            continue;
+
+        cpus = (processorid_t *)mem_malloc (num_cpus * sizeof (processorid_t));
+        lgrp_cpus (cookie, i, cpus, num_cpus, LGRP_CONTENT_DIRECT);
+        for (j = 0; j < num_cpus; j++)
+        {
+            if (cpus[j] == cpu)
+                lgrp = i - 1;
+        }
+        mem_free (cpus);
+    }
+
+    ret = lgrp_fini (cookie);
+    assert (!ret);
+
+    return lgrp;
+#endif
+}
@@ -34,12 +34,15 @@
 #include <stdio.h>
 #include <errno.h>
 #include <string.h>
+#include <stddef.h>
 #include <strings.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <inttypes.h>
 #include <sys/mman.h>
 #include <sys/time.h>
+#include <sched.h>
+#include <time.h>
 
 #include "map_reduce.h"
 #include "memory.h"
@@ -54,20 +57,39 @@
 #include "locality.h"
 #include "struct.h"
 #include "tpool.h"
+#include "atomic.h"
+#include "trace.h"
+#include "perfctr.h"
+#include "spill.h"
+#include "hll.h"
 
 #if !defined(_LINUX_) && !defined(_SOLARIS_)
 #error OS not supported
 #endif
 
 /* Begin tunables. */
-//#define INCREMENTAL_COMBINER
-
 #define DEFAULT_NUM_REDUCE_TASKS    256
 #define EXTENDED_NUM_REDUCE_TASKS   (DEFAULT_NUM_REDUCE_TASKS * 128)
 #define DEFAULT_CACHE_SIZE          (64 * 1024)
 //#define DEFAULT_CACHE_SIZE        (8 * 1024)
 #define DEFAULT_KEYVAL_ARR_LEN      10
 #define DEFAULT_VALS_ARR_LEN        10
+#define DEFAULT_HASH_SLOTS          16
+#define DEFAULT_COMBINE_THRESHOLD   1024
+#define GUIDED_SPLIT_FACTOR         2   /* Tasks take 1/(this * threads) 
+                                           of the input left. */
+#define GUIDED_TAIL_NSEC            100000  /* Time of the smallest task. */
+#define DEFAULT_HOT_TASK_SPLIT      4
+#define PART_PAGE_SHIFT             6   /* Partitions are allocated 64 at
+                                           a time, on first use. */
+#define PART_PAGE_SIZE              (1 << PART_PAGE_SHIFT)
+#define REDUCE_TASKS_PER_THREAD     16
+#define MIN_REDUCE_TASK_KEYS        4096
+#define MERGE_OVERSAMPLE            32  /* Samples per merge thread. */
+#define EMIT_STAGE_LEN              1024    /* Batched pairs staged per 
+                                               map thread. */
+#define EMIT_STAGE_BITS             8   /* Staged pairs are grouped by the
+                                           top bits of their reduce task. */
 #define L2_CACHE_LINE_SIZE          64
 /* End tunables. */
 
@@ -96,13 +118,36 @@ typedef struct
     };
 } keyval_arr_t;
 
-/* Array of keyvals_t. */
+/* Hash table slot, refers to keyvals_arr_t.arr[idx - 1]. 
+   An idx of 0 marks an empty slot. */
+typedef struct
+{
+    unsigned int hash;
+    int idx;
+} kv_slot_t;
+
+/* Array of keyvals_t. 
+   Sorted by key once the map phase is over, whatever the store. */
 typedef struct 
 {
     int len;
     int alloc_len;
     int pos;
     keyvals_t *arr;
+    union {
+        /* INTERMEDIATE_STORE_HASH: open addressing table over arr. */
+        struct {
+            kv_slot_t   *slots;
+            int         num_slots;
+        };
+        /* INTERMEDIATE_STORE_APPEND: pairs not grouped into arr yet. */
+        struct {
+            keyval_t    *pairs;
+            int         pairs_len;
+            int         pairs_alloc_len;
+        };
+    };
+    size_t bytes;                   /* Emitted to it this run. */
 } keyvals_arr_t;
 
 /* Thread information.
@@ -113,11 +158,36 @@ typedef struct
         struct {
             pthread_t tid;
             int curr_task;
+            volatile int tree_done;     /* Done with the dense key tree? */
+            uint64_t map_nsec;          /* Time spent in map(). */
+            size_t num_entries;         /* Keys or pairs stored since the
+                                           last spill. */
+            uint64_t reduce_bytes;      /* Intermediate bytes reduced, */
+            uint64_t remote_bytes;      /* and those of other lgrps. */
         };
         char pad[L2_CACHE_LINE_SIZE];
     };
 } thread_info_t;
 
+/* A pair staged by emit_intermediate_batch(). */
+typedef struct
+{
+    void            *key;
+    void            *val;
+    int             key_size;
+    int             reduce_pos;
+    unsigned int    hash;
+} emit_pair_t;
+
+/* Pairs of a map thread waiting to be stored, see emit_flush(). */
+typedef struct
+{
+    emit_pair_t     *pairs;         /* In emit order. */
+    int             *order;         /* Their indices, grouped by reduce 
+                                       task. */
+    int             len;
+} emit_stage_t;
+
 typedef struct
 {
     uintptr_t work_time;
@@ -137,17 +207,40 @@ typedef struct
     int num_map_tasks;              /* # of map tasks. */
     int num_reduce_tasks;           /* # of reduce tasks. */
     int chunk_size;                 /* # of units of data for each map task. */
+    split_t split;                  /* How map tasks are sized. */
+    int min_chunk_size;             /* Guided splits, the smallest and */
+    int max_chunk_size;             /* largest task. */
+    uint64_t split_units;           /* # of units asked from the splitter. */
     int num_procs;                  /* # of processors to run on. */
     int num_map_threads;            /* # of threads for map tasks. */
     int num_reduce_threads;         /* # of threads for reduce tasks. */
     int num_merge_threads;          /* # of threads for merge tasks. */
+    int max_map_threads;            /* # of map threads asked for, a run 
+                                       with fewer map tasks uses less. */
+    int num_workers;                /* Most threads used by any phase. */
     float key_match_factor;         /* # of values likely to be matched 
                                        to the same key. */
 
     bool oneOutputQueuePerMapTask;      /* One output queue per map task? */
     bool oneOutputQueuePerReduceTask;   /* One output queue per reduce task? */
+    bool persistent;                    /* Keep buffers between runs? */
 
     int intermediate_task_alloc_len;
+    intermediate_store_t intermediate_store;
+    bool key_hashes;                /* Do the intermediate keys carry 
+                                       their hash? */
+    int inline_key_size;            /* Bytes of the keys and values held */
+    int inline_val_size;            /* in place of pointers, or 0. */
+
+    bool pipeline;                  /* Reduce from the map workers? */
+    bool map_only;                  /* No reduce or merge phase? */
+    int num_dense_keys;             /* Size of a dense key space, or 0. */
+    combine_t combine;              /* When to run the combiner. */
+    int combine_threshold;          /* Values per key for early combining. */
+    unsigned int maps_done;         /* # of map threads out of map tasks. */
+    unsigned int next_reduce_task;  /* Next partition to claim. */
+    size_t spill_budget;            /* Bytes a map thread may hold before
+                                       spilling, or 0. */
 
     /* Callbacks. */
     map_t map;                      /* Map function. */
@@ -157,78 +250,283 @@ typedef struct
     splitter_t splitter;            /* Splitter function. */
     locator_t locator;              /* Locator function. */
     key_cmp_t key_cmp;              /* Key comparator function. */
+    key_len_cmp_t key_len_cmp;      /* Intermediate key comparator, by 
+                                       size, or NULL. */
+    hash_t hash;                    /* Key hash function. */
+    key_index_t key_index;          /* Dense key index function. */
 
     /* Structures. */
     map_reduce_args_t * args;       /* Args passed in by the user. */
     thread_info_t * tinfo;          /* Thread information array. */
-
-    keyvals_arr_t **intermediate_vals;
-                                    /* Array to send to reduce task. */
+    struct thread_arg_t *th_args;   /* Worker arguments of a phase. */
+    struct thread_arg_t **th_arg_array;
+
+    keyvals_arr_t ***intermediate_vals;
+                                    /* Partitions of each map thread, in
+                                       pages of PART_PAGE_SIZE, NULL until
+                                       one of them is emitted to. */
+    iterator_t *combine_itrs;       /* Scratch iterator of each worker, for
+                                       combining while mapping. */
+    mem_arena_t **arenas;           /* Value chunks of each map thread, 
+                                       released after the reduce phase. */
+    int num_arenas;
+    spill_t **spills;               /* Spills of each map thread, oldest
+                                       first, released after the reduce 
+                                       phase. */
+    unsigned char *key_regs;        /* HyperLogLog registers counting the 
+                                       keys of each map thread, if they 
+                                       can be hashed, or NULL. */
+    int *map_lgrps;                 /* Lgrp each map thread ran on, with
+                                       more than one lgrp, or NULL. */
+    int hot_task_split;             /* Split reduce tasks over 1/this of 
+                                       the share of a thread, if > 0. */
+    unsigned int *parts_done;       /* # of key ranges of each split reduce
+                                       task done, the last frees it. */
+    emit_stage_t *stages;           /* Batched pairs of each map thread. */
+    int stage_shift;                /* Reduce task to staging group. */
 
     keyval_arr_t *final_vals;       /* Array to send to merge task. */
+    int num_final_vals;
     keyval_arr_t *merge_vals;       /* Array to send to user. */
+    int *merge_bounds;              /* Run positions bounding the slice 
+                                       of each merge worker. */
 
-    uintptr_t splitter_pos;         /* Tracks position in array_splitter(). */
+    uintptr_t splitter_pos;         /* Tracks position in array_splitter(),
+                                       or in the array being split lazily. */
+    bool lazy_split;                /* Do map workers split on demand? */
+    unsigned int num_splits;        /* # of map tasks split on demand. */
+    pthread_mutex_t splitter_lock;  /* Held by map workers calling the
+                                       user's splitter. */
 
     /* Policy for mapping threads to cpus. */
     sched_policy    *schedPolicies[TASK_TYPE_TOTAL];
+    int             *worker_lgrps;  /* Lgrp of the CPU of each worker, for
+                                       the phase being queued. */
 
 
     taskQ_t         *taskQueue;     /* Queues of tasks. */
     tpool_t         *tpool;         /* Thread pool. */
 } mr_env_t;
 
+/** num_part_pages()
+ *  # of pages the partitions of a map thread span
+ */
+static inline int num_part_pages (mr_env_t *env)
+{
+    return (env->num_reduce_tasks + PART_PAGE_SIZE - 1) >> PART_PAGE_SHIFT;
+}
+
+/** part_peek()
+ *  Partition PART of map thread THREAD, or NULL if nothing was ever 
+ *  emitted to its page
+ */
+static inline keyvals_arr_t *
+part_peek (mr_env_t *env, int thread, int part)
+{
+    keyvals_arr_t *page;
+
+    page = env->intermediate_vals[thread][part >> PART_PAGE_SHIFT];
+    return (page != NULL) ? &page[part & (PART_PAGE_SIZE - 1)] : NULL;
+}
+
+/** part_touch()
+ *  Same as part_peek(), allocating the page on first use. Only map 
+ *  thread THREAD allocates its pages, and only while mapping.
+ */
+static inline keyvals_arr_t *
+part_touch (mr_env_t *env, int thread, int part)
+{
+    keyvals_arr_t **page;
+
+    page = &env->intermediate_vals[thread][part >> PART_PAGE_SHIFT];
+    if (*page == NULL)
+        *page = (keyvals_arr_t *)mem_calloc (
+            PART_PAGE_SIZE, sizeof (keyvals_arr_t));
+    return &(*page)[part & (PART_PAGE_SIZE - 1)];
+}
+
+/** page_used()
+ *  Has any map thread emitted to partition page PAGE?
+ */
+static inline bool page_used (mr_env_t *env, int page)
+{
+    int i;
+
+    for (i = 0; i < env->intermediate_task_alloc_len; i++)
+    {
+        if (env->intermediate_vals[i][page] != NULL)
+            return true;
+    }
+
+    return false;
+}
+
+/** inline_slot()
+ *  The SIZE bytes at P, held in a pointer slot, the rest zeroed
+ */
+static inline void *inline_slot (void *p, int size)
+{
+    void *slot = NULL;
+
+    memcpy (&slot, p, size);
+    return slot;
+}
+
+/** key_ref()
+ *  What callbacks are given for the key in SLOT
+ */
+static inline void *key_ref (mr_env_t *env, void **slot)
+{
+    return (env->inline_key_size > 0) ? (void *)slot : *slot;
+}
+
 #ifdef TIMING
 static pthread_key_t emit_time_key;
 #endif
 static pthread_key_t env_key;       /* Environment for current thread. */
+static __thread int curr_worker = -1;
+                                    /* Index of the current thread among
+                                       the workers of its phase. */
 static pthread_key_t tpool_key;
 
+/* Handle of a job, see map_reduce_job_create(). */
+struct map_reduce_job_t
+{
+    mr_env_t        *env;
+};
+
 /* Data passed on to each worker thread. */
-typedef struct
+typedef struct thread_arg_t
 {
     int             cpu_id;             /* CPU this thread is to run. */
     int             thread_id;          /* Thread index. */
     TASK_TYPE_T     task_type;          /* Assigned task type. */
     int             merge_len;
     keyval_arr_t    *merge_input;
-    int             merge_round;
     mr_env_t        *env;
 } thread_arg_t;
 
+/* Loser tree over k sorted runs, finds the smallest current key in
+   O(log k) comparisons. Ties go to the lower run, which keeps merges 
+   stable. */
+typedef struct
+{
+    int             num_runs;
+    int             *tree;              /* tree[0] is the winner. */
+    int             *win;               /* Scratch space for building. */
+    void            **keys;             /* Current key of each run. */
+    int             *lens;              /* and its size, if compared by 
+                                           size, */
+    unsigned int    *hashes;            /* and its hash, if the runs have
+                                           them. */
+    char            *done;              /* Whether each run is exhausted. */
+} loser_tree_t;
+
+/* One sorted run of a reduce task: a partition of a map thread that is
+   still in memory, or one of its spills. */
+typedef struct
+{
+    keyvals_arr_t   *arr;               /* In memory, or NULL. */
+    int             next;               /* In memory, the keys left. */
+    int             last;
+    char            *pos;               /* Spilled, the records left. */
+    char            *end;
+} run_cursor_t;
+
+/* Sampled key used to pick the merge splitters. */
+typedef struct
+{
+    void            *key;
+    double          weight;             /* Number of keys it stands for. */
+} merge_sample_t;
+
 static inline mr_env_t* env_init (map_reduce_args_t *);
 static void env_fini(mr_env_t* env);
+static map_reduce_job_t *job_create (map_reduce_args_t *, bool);
+static void free_intermediate (mr_env_t* env);
+static size_t intermediate_size (mr_env_t* env, int thread_index);
+static void spill_intermediate (mr_env_t* env, int thread_index);
+static int count_runs (mr_env_t* env);
+static void free_spills (mr_env_t* env);
+static void reset_intermediate (mr_env_t* env);
 static inline void env_print (mr_env_t* env);
 static inline void start_workers (mr_env_t* env, thread_arg_t *);
+static inline int worker_cpu (mr_env_t* env, TASK_TYPE_T, int);
+static void reset_task_queue (mr_env_t* env, TASK_TYPE_T, int);
 static inline void *start_my_work (thread_arg_t *);
 static inline void emit_inline (mr_env_t* env, void *, void *);
+static void emit_flush (mr_env_t* env, int);
 static inline mr_env_t* get_env(void);
-static inline int getCurrThreadIndex (TASK_TYPE_T);
+static inline int getCurrThreadIndex (void);
 static inline int getNumTaskThreads (mr_env_t* env, TASK_TYPE_T);
 static inline void insert_keyval (
     mr_env_t* env, keyval_arr_t *, void *, void *);
 static inline void insert_keyval_merged (
+    mr_env_t* env, mem_arena_t *, keyvals_arr_t *, void *, int, void *, 
+    unsigned int);
+static inline void insert_keyval_hashed (
+    mr_env_t* env, mem_arena_t *, keyvals_arr_t *, void *, int, void *, 
+    unsigned int);
+static inline int key_compare (mr_env_t* env, void *, int, void *, int);
+static inline int out_key_compare (mr_env_t* env, void *, void *);
+static inline void insert_keyval_appended (
     mr_env_t* env, keyvals_arr_t *, void *, void *);
+static inline void insert_val (
+    mr_env_t* env, mem_arena_t *, keyvals_t *, void *);
+static void ltree_init (loser_tree_t *, int, bool, bool);
+static void ltree_finalize (loser_tree_t *);
+static void ltree_build (mr_env_t* env, loser_tree_t *);
+static inline void ltree_replay (mr_env_t* env, loser_tree_t *);
+static int *merge_partition (
+    mr_env_t* env, keyval_arr_t *, int, int, int);
+static void seal_keyvals (mr_env_t* env, int thread_idx);
+static void seal_partition (mr_env_t* env, mem_arena_t *, keyvals_arr_t *);
+static void sort_by_key (mr_env_t* env, void *base, int num, size_t width, 
+    size_t key_offset, int len_offset);
 
 static int array_splitter (void *, int, map_args_t *);
 static void identity_reduce (void *, iterator_t *itr);
-static inline void merge_results (mr_env_t* env, keyval_arr_t*, int);
+static inline void merge_results (mr_env_t* env, keyval_arr_t*, int, int);
 
 static void *map_worker (void *);
 static void *reduce_worker (void *);
 static void *merge_worker (void *);
+static uintptr_t pipeline_reduce (mr_env_t *env, int thread_index);
+static uintptr_t dense_reduce (mr_env_t *env, int thread_index);
+static void dense_absorb (
+    mr_env_t *env, iterator_t *, keyvals_t *, keyvals_t *);
 
 static int gen_map_tasks (mr_env_t* env);
 static int gen_map_tasks_split(mr_env_t* env, queue_t* q);
 static int gen_reduce_tasks (mr_env_t* env);
+static int reduce_task_lgrp (
+    mr_env_t* env, int first, int num_parts, size_t *lgrp_bytes);
+static inline uint64_t reduce_part_keys (mr_env_t* env, int part);
+static inline uint64_t reduce_task_load (mr_env_t* env, int task);
+static uint64_t reduce_group_keys (mr_env_t* env);
+static int reduce_group_len (
+    mr_env_t* env, int first, uint64_t group_keys, uint64_t share);
+static uint64_t reduce_split_share (mr_env_t* env);
+static int reduce_task_parts (
+    mr_env_t* env, int task, uint64_t share, int *src_thread, int *bounds);
+#ifdef TIMING
+static uint64_t reduce_part_load (mr_env_t* env, int task, uint64_t load,
+    int src_thread, int *bounds, int num_parts);
+#endif
+static inline int split_size (mr_env_t* env, uint64_t split_units);
+static bool split_next (mr_env_t* env, task_t *task);
+static void split_feedback (mr_env_t* env);
+static inline uint64_t get_nsec (void);
 
 static void map(mr_env_t* mr);
 static void reduce(mr_env_t* mr);
 static void merge(mr_env_t* mr);
+static void merge_concat (mr_env_t* env, keyval_arr_t *, int);
 
-#ifndef INCREMENTAL_COMBINER
 static void run_combiner (mr_env_t* env, int thread_idx);
-#endif
+static void combine_partition (mr_env_t* env, iterator_t *, keyvals_arr_t *);
+static inline void combine_vals (mr_env_t* env, iterator_t *, keyvals_t *);
+static inline bool combine_after_map (mr_env_t* env);
 
 int 
 map_reduce_init ()
@@ -237,13 +535,52 @@ map_reduce_init ()
 
     CHECK_ERROR (pthread_setspecific (tpool_key, NULL));
 
+#ifdef TIMING
+    CHECK_ERROR (pthread_key_create (&emit_time_key, NULL));
+#endif
+    CHECK_ERROR (pthread_key_create (&env_key, NULL));
+
+    trace_init ();
+    perfctr_init ();
+
     return 0;
 }
 
 int
 map_reduce (map_reduce_args_t * args)
+{
+    map_reduce_job_t *job;
+    int ret;
+
+    job = job_create (args, false);
+    if (job == NULL) {
+       /* could not allocate environment */
+       return -1;
+    }
+
+    ret = map_reduce_job_run (job);
+
+    map_reduce_job_destroy (job);
+
+    return ret;
+}
+
+map_reduce_job_t *
+map_reduce_job_create (map_reduce_args_t * args)
+{
+    return job_create (args, true);
+}
+
+/** job_create()
+ *  Sets up the environment of a job. A persistent job keeps its buffers
+ *  from one run to the next, otherwise they are released as soon as 
+ *  each phase is done with them.
+ */
+static map_reduce_job_t *
+job_create (map_reduce_args_t * args, bool persistent)
 {
     struct timeval begin, end;
+    map_reduce_job_t *job;
     mr_env_t* env;
 
     assert (args != NULL);
@@ -257,52 +594,90 @@ map_reduce (map_reduce_args_t * args)
     /* Initialize environment. */
     env = env_init (args);
     if (env == NULL) {
-       /* could not allocate environment */
-       return -1;
+       return NULL;
     }
+    env->persistent = persistent;
     //env_print (env);
     env->taskQueue = tq_init (env->num_map_threads);
     assert (env->taskQueue != NULL);
 
-    /* Reuse thread pool. */
-    env->tpool = pthread_getspecific (tpool_key);
-    if (env->tpool == NULL) {
-        tpool_t *tpool;
-
-        tpool = tpool_create (env->num_map_threads);
-        CHECK_ERROR (tpool == NULL);
+    job = (map_reduce_job_t *)mem_malloc (sizeof (map_reduce_job_t));
+    job->env = env;
 
-        env->tpool = tpool;
-        CHECK_ERROR (pthread_setspecific (tpool_key, tpool));
-    }
+    get_time (&end);
 
 #ifdef TIMING
-    CHECK_ERROR (pthread_key_create (&emit_time_key, NULL));
+    fprintf (stderr, "library init: %u\n", time_diff (&end, &begin));
 #endif
-    CHECK_ERROR (pthread_key_create (&env_key, NULL));
 
-    pthread_setspecific (env_key, env);
+    return job;
+}
 
-    get_time (&end);
+int
+map_reduce_job_run (map_reduce_job_t *job)
+{
+    struct timeval begin, end;
+    mr_env_t* env;
+    tpool_t *tpool;
 
-#ifdef TIMING
-    fprintf (stderr, "library init: %u\n", time_diff (&end, &begin));
-#endif
+    assert (job != NULL);
+    env = job->env;
+
+    /* Undo what the last run changed. */
+    env->num_map_tasks = 0;
+    env->num_map_threads = env->max_map_threads;
+    if (env->pipeline || env->num_dense_keys > 0)
+        env->num_reduce_threads = env->num_map_threads;
+    env->splitter_pos = 0;
+    env->maps_done = 0;
+    env->next_reduce_task = 0;
+
+    /* Reuse thread pool, unless it is too small for this job. */
+    tpool = pthread_getspecific (tpool_key);
+    if (tpool != NULL && tpool_get_num_threads (tpool) < env->num_workers) {
+        CHECK_ERROR (tpool_destroy (tpool));
+        tpool = NULL;
+    }
+    if (tpool == NULL) {
+        tpool = tpool_create (env->num_workers);
+        CHECK_ERROR (tpool == NULL);
+
+        CHECK_ERROR (pthread_setspecific (tpool_key, tpool));
+    }
+    env->tpool = tpool;
+
+    pthread_setspecific (env_key, env);
 
     /* Run map tasks and get intermediate values. */
     get_time (&begin);
+    TRACE_BEGIN (TRACE_PHASE_MAP, 0);
     map (env);
+    TRACE_END (TRACE_PHASE_MAP, 0);
     get_time (&end);
 
 #ifdef TIMING
     fprintf (stderr, "map phase: %u\n", time_diff (&end, &begin));
 #endif
 
+    if (env->map_only)
+    {
+        /* What the map threads emitted is the result, as is. */
+        merge_concat (env, env->final_vals, env->num_final_vals);
+        if (!env->persistent)
+            free_intermediate (env);
+
+        CHECK_ERROR (proc_unbind_thread () != 0);
+
+        return 0;
+    }
+
     dprintf("In scheduler, all map tasks are done, now scheduling reduce tasks\n");
     
     /* Run reduce tasks and get final values. */
     get_time (&begin);
+    TRACE_BEGIN (TRACE_PHASE_REDUCE, 0);
     reduce (env);
+    TRACE_END (TRACE_PHASE_REDUCE, 0);
     get_time (&end);
 
 #ifdef TIMING
@@ -312,35 +687,58 @@ map_reduce (map_reduce_args_t * args)
     dprintf("In scheduler, all reduce tasks are done, now scheduling merge tasks\n");
 
     get_time (&begin);
+    TRACE_BEGIN (TRACE_PHASE_MERGE, 0);
     merge (env);
+    TRACE_END (TRACE_PHASE_MERGE, 0);
     get_time (&end);
 
 #ifdef TIMING
     fprintf (stderr, "merge phase: %u\n", time_diff (&end, &begin));
 #endif
 
+    /* Pool threads stay bound from one phase and job to the next, 
+       only the calling thread is let go. */
+    CHECK_ERROR (proc_unbind_thread () != 0);
+
+    return 0;
+}
+
+void
+map_reduce_job_destroy (map_reduce_job_t *job)
+{
+    struct timeval begin, end;
+
+    assert (job != NULL);
+
     /* Cleanup. */
     get_time (&begin);
-    env_fini(env);
-    CHECK_ERROR (pthread_key_delete (env_key));
+    env_fini (job->env);
+    mem_free (job);
+    pthread_setspecific (env_key, NULL);
     get_time (&end);
 
 #ifdef TIMING
     fprintf (stderr, "library finalize: %u\n", time_diff (&end, &begin));
-    CHECK_ERROR (pthread_key_delete (emit_time_key));
 #endif
-
-    return 0;
 }
 
 int map_reduce_finalize ()
 {
     tpool_t *tpool;
 
+    /* No pool if no job ran. */
     tpool = pthread_getspecific (tpool_key);
-    CHECK_ERROR (tpool_destroy (tpool));
+    if (tpool != NULL)
+        CHECK_ERROR (tpool_destroy (tpool));
+
+    trace_finalize ();
+    perfctr_finalize ();
 
     pthread_key_delete (tpool_key);
+    pthread_key_delete (env_key);
+#ifdef TIMING
+    pthread_key_delete (emit_time_key);
+#endif
 
     return 0;
 }
@@ -354,6 +752,48 @@ static void env_fini (mr_env_t* env)
     int i;
 
     tq_finalize (env->taskQueue);
+    pthread_mutex_destroy (&env->splitter_lock);
+
+    if (env->persistent)
+    {
+        free_intermediate (env);
+
+        for (i = 0; i < env->num_final_vals; i++)
+        {
+            if (env->final_vals[i].arr != NULL)
+                mem_free (env->final_vals[i].arr);
+        }
+        mem_free (env->final_vals);
+    }
+
+    if (env->map_lgrps != NULL)
+        mem_free (env->map_lgrps);
+    if (env->parts_done != NULL)
+        mem_free (env->parts_done);
+    if (env->key_regs != NULL)
+        mem_free (env->key_regs);
+
+    for (i = 0; i < env->num_arenas; i++)
+    {
+        if (env->stages[i].pairs != NULL)
+        {
+            mem_free (env->stages[i].pairs);
+            mem_free (env->stages[i].order);
+        }
+    }
+    mem_free (env->stages);
+
+    mem_free (env->tinfo);
+    mem_free (env->worker_lgrps);
+    mem_free (env->th_args);
+    mem_free (env->th_arg_array);
+
+    if (env->combine_itrs != NULL)
+    {
+        for (i = 0; i < env->num_workers; i++)
+            iter_finalize (&env->combine_itrs[i]);
+        mem_free (env->combine_itrs);
+    }
 
     for (i = 0; i < TASK_TYPE_TOTAL; i++)
         sched_policy_put(env->schedPolicies[i]);
@@ -361,6 +801,19 @@ static void env_fini (mr_env_t* env)
     mem_free (env);
 }
 
+/* Map a placement_t to a scheduler policy, DEF if not set. */
+static inline unsigned int 
+placement_to_policy (placement_t placement, unsigned int def)
+{
+    switch (placement)
+    {
+        case PLACEMENT_STRAND_FILL: return SCHED_POLICY_STRAND_FILL;
+        case PLACEMENT_CORE_FILL:   return SCHED_POLICY_CORE_FILL;
+        case PLACEMENT_CHIP_FILL:   return SCHED_POLICY_CHIP_FILL;
+        default:                    return def;
+    }
+}
+
 /* Setup global state. */
 static mr_env_t* 
 env_init (map_reduce_args_t *args) 
@@ -400,6 +853,31 @@ env_init (map_reduce_args_t *args)
     env->num_reduce_threads = (args->num_reduce_threads > 0) ? 
         args->num_reduce_threads : num_procs;
 
+    /* Pipelined, the map threads go on to reduce and emit the output. */
+    env->pipeline = args->pipeline;
+    if (env->pipeline)
+        env->num_reduce_threads = env->num_map_threads;
+
+    /* So are dense keys, into one output queue per thread. */
+    env->num_dense_keys = args->num_dense_keys;
+    if (env->num_dense_keys > 0)
+    {
+        CHECK_ERROR (args->key_index == NULL);
+        env->pipeline = false;
+        env->oneOutputQueuePerReduceTask = false;
+        env->num_reduce_threads = env->num_map_threads;
+    }
+
+    /* And map-only, unsorted, as there is nothing to reduce. */
+    env->map_only = args->map_only;
+    if (env->map_only)
+    {
+        CHECK_ERROR (env->num_dense_keys > 0);
+        env->pipeline = false;
+        env->oneOutputQueuePerReduceTask = false;
+        env->num_reduce_threads = env->num_map_threads;
+    }
+
     env->num_merge_threads = (args->num_merge_threads > 0) ? 
         args->num_merge_threads : env->num_reduce_threads;
 
@@ -410,6 +888,8 @@ env_init (map_reduce_args_t *args)
     /* Assign at least one merge thread. */
     env->num_merge_threads = MAX(env->num_merge_threads, 1);
 
+    env->max_map_threads = env->num_map_threads;
+
     env->key_match_factor = (args->key_match_factor > 0) ? 
         args->key_match_factor : 2;
 
@@ -436,6 +916,22 @@ env_init (map_reduce_args_t *args)
     if (env->num_reduce_tasks <= 0) env->num_reduce_tasks = 1;
     if (env->chunk_size <= 0) env->chunk_size = 1;
 
+    /* Guided splits go from the L2 cache size down to the L1 one. */
+    env->split = (args->split != SPLIT_DEFAULT) ? args->split : SPLIT_GUIDED;
+    if (env->split == SPLIT_GUIDED)
+    {
+        int l1_size, l2_size;
+
+        l1_size = (args->L1_cache_size > 0) ? 
+            args->L1_cache_size : proc_get_cache_size (1);
+        if (l1_size <= 0) l1_size = DEFAULT_CACHE_SIZE;
+        l2_size = proc_get_cache_size (2);
+
+        env->min_chunk_size = MAX (l1_size / args->unit_size, 1);
+        env->max_chunk_size = MAX (
+            l2_size / args->unit_size, env->min_chunk_size);
+    }
+
     if (env->oneOutputQueuePerReduceTask == false) 
     {
         env->num_reduce_tasks = EXTENDED_NUM_REDUCE_TASKS;
@@ -447,12 +943,23 @@ env_init (map_reduce_args_t *args)
     env->num_merge_threads = MIN (
         env->num_merge_threads, env->num_reduce_tasks / 2);
 
+    /* One flat key array per map thread, see map_worker(). */
+    if (env->num_dense_keys > 0)
+        env->num_reduce_tasks = 1;
+
     if (env->oneOutputQueuePerMapTask) 
         env->intermediate_task_alloc_len = 
             args->data_size / env->chunk_size + 1;
     else
         env->intermediate_task_alloc_len = env->num_map_threads;
 
+    /* Each map thread creates its own arena, see map_worker(). */
+    env->num_arenas = env->num_map_threads;
+    env->arenas = (mem_arena_t **)mem_calloc (
+        env->num_arenas, sizeof (mem_arena_t *));
+    env->spills = (spill_t **)mem_calloc (
+        env->num_arenas, sizeof (spill_t *));
+
     /* Register callbacks. */
     env->map = args->map;
     env->reduce = (args->reduce) ? args->reduce : identity_reduce;
@@ -462,34 +969,144 @@ env_init (map_reduce_args_t *args)
     env->locator = args->locator;
     env->key_cmp = args->key_cmp;
 
-    /* 2. Initialize structures. */
+    /* Split as the map workers ask for tasks, unless the tasks have to 
+       be placed according to the locator, or counted up front. */
+    env->lazy_split = (env->locator == NULL) && 
+        !env->oneOutputQueuePerMapTask;
+    CHECK_ERROR (pthread_mutex_init (&env->splitter_lock, NULL));
+    env->key_len_cmp = args->key_len_cmp;
+    env->key_index = args->key_index;
+
+    /* Inline keys and values take the place of the pointers. */
+    CHECK_ERROR (args->inline_key_size < 0 || 
+        args->inline_key_size > sizeof (void *));
+    CHECK_ERROR (args->inline_val_size < 0 || 
+        args->inline_val_size > sizeof (void *));
+    env->inline_key_size = args->inline_key_size;
+    env->inline_val_size = args->inline_val_size;
+
+    /* Pick when to combine. Never without a combiner. */
+    env->combine = (args->combine != COMBINE_DEFAULT) ? 
+        args->combine : COMBINE_END_OF_MAP;
+    if (env->combiner == NULL || env->combine == COMBINE_OFF || 
+        env->map_only)
+    {
+        env->combine = COMBINE_OFF;
+        env->combiner = NULL;
+    }
+    env->combine_threshold = (args->combine_threshold > 0) ? 
+        args->combine_threshold : DEFAULT_COMBINE_THRESHOLD;
+
+    /* Pick the intermediate store. The hash store needs a hash function. */
+    env->intermediate_store = args->intermediate_store;
+    env->hash = args->hash;
+    if (env->hash == NULL && env->partition == default_partition)
+        env->hash = default_hash;
+    if (env->intermediate_store == INTERMEDIATE_STORE_HASH && env->hash == NULL)
+        env->intermediate_store = INTERMEDIATE_STORE_APPEND;
+
+    /* Appended pairs have no room for the key sizes. */
+    if (env->key_len_cmp != NULL && 
+        env->intermediate_store == INTERMEDIATE_STORE_APPEND)
+    {
+        env->intermediate_store = (env->hash != NULL) ? 
+            INTERMEDIATE_STORE_HASH : INTERMEDIATE_STORE_SORTED;
+    }
 
-    env->intermediate_vals = (keyvals_arr_t **)mem_malloc (
-        env->intermediate_task_alloc_len * sizeof (keyvals_arr_t*));
+    /* Appended pairs are only grouped by key once the map phase is over,
+       nothing can be combined before then. */
+    if (env->intermediate_store == INTERMEDIATE_STORE_APPEND && 
+        env->combine != COMBINE_OFF)
+        env->combine = COMBINE_END_OF_MAP;
 
-    for (i = 0; i < env->intermediate_task_alloc_len; i++)
+    /* Emits hash the key anyway with a hash store, or the default 
+       partition. Appended keys are only grouped once the map phase is
+       over. */
+    env->key_hashes = (env->hash != NULL && env->num_dense_keys == 0 &&
+        env->intermediate_store != INTERMEDIATE_STORE_APPEND);
+
+    /* 2. Initialize structures. */
+
+    /* Map-only, there are no intermediate pairs, nor anything to size,
+       place or split the reduce tasks by. */
+    if (!env->map_only)
     {
-        env->intermediate_vals[i] = (keyvals_arr_t *)mem_calloc (
-            env->num_reduce_tasks, sizeof (keyvals_arr_t));
+        env->intermediate_vals = (keyvals_arr_t ***)mem_malloc (
+            env->intermediate_task_alloc_len * sizeof (keyvals_arr_t **));
+
+        for (i = 0; i < env->intermediate_task_alloc_len; i++)
+        {
+            env->intermediate_vals[i] = (keyvals_arr_t **)mem_calloc (
+                num_part_pages (env), sizeof (keyvals_arr_t *));
+        }
     }
 
-    if (env->oneOutputQueuePerReduceTask)
+    /* Distinct keys, to size the reduce tasks by. */
+    if (env->key_hashes && !env->pipeline && !env->map_only)
+        env->key_regs = (unsigned char *)mem_calloc (
+            env->num_arenas, HLL_REGS);
+
+    env->hot_task_split = (args->hot_task_split != 0) ? 
+        args->hot_task_split : DEFAULT_HOT_TASK_SPLIT;
+
+    /* Only reduce tasks are placed by where their data is, or split by
+       how much of it they hold. */
+    if (!env->pipeline && env->num_dense_keys == 0 && !env->map_only)
     {
-        env->final_vals = 
-            (keyval_arr_t *)mem_calloc (
-                env->num_reduce_tasks, sizeof (keyval_arr_t));
+        if (loc_get_num_lgrps () > 1)
+            env->map_lgrps = (int *)mem_calloc (
+                env->num_arenas, sizeof (int));
+        /* Key ranges of one task would share its output queue. */
+        if (env->hot_task_split > 0 && !env->oneOutputQueuePerReduceTask)
+            env->parts_done = (unsigned int *)mem_calloc (
+                env->num_reduce_tasks, sizeof (unsigned int));
     }
+
+    /* Staging buffers are allocated by the map threads on first use. */
+    env->stages = (emit_stage_t *)mem_calloc (
+        env->num_arenas, sizeof (emit_stage_t));
+    env->stage_shift = 0;
+    while (((env->num_reduce_tasks - 1) >> env->stage_shift) >= 
+        (1 << EMIT_STAGE_BITS))
+        env->stage_shift++;
+
+    if (env->oneOutputQueuePerReduceTask)
+        env->num_final_vals = env->num_reduce_tasks;
     else
+        env->num_final_vals = env->num_reduce_threads;
+    env->final_vals = (keyval_arr_t *)mem_calloc (
+        env->num_final_vals, sizeof (keyval_arr_t));
+
+    /* Worker state, sized for the largest phase. */
+    env->num_workers = MAX (env->num_map_threads, 
+        MAX (env->num_reduce_threads, env->num_merge_threads));
+    if (env->map_only)
+        env->num_workers = env->num_map_threads;
+    env->tinfo = (thread_info_t *)mem_calloc (
+        env->num_workers, sizeof (thread_info_t));
+    env->worker_lgrps = (int *)mem_calloc (env->num_workers, sizeof (int));
+    env->th_args = (thread_arg_t *)mem_calloc (
+        env->num_workers, sizeof (thread_arg_t));
+    env->th_arg_array = (thread_arg_t **)mem_malloc (
+        env->num_workers * sizeof (thread_arg_t *));
+    for (i = 0; i < env->num_workers; i++)
+        env->th_arg_array[i] = &env->th_args[i];
+
+    if (env->combine != COMBINE_OFF)
     {
-        env->final_vals =
-            (keyval_arr_t *)mem_calloc (
-                env->num_reduce_threads, sizeof (keyval_arr_t));
+        env->combine_itrs = (iterator_t *)mem_malloc (
+            env->num_workers * sizeof (iterator_t));
+        for (i = 0; i < env->num_workers; i++)
+            CHECK_ERROR (iter_init (&env->combine_itrs[i], 1, 
+                env->inline_val_size > 0));
     }
 
-    for (i = 0; i < TASK_TYPE_TOTAL; i++) {
-        /* TODO: Make this tunable */
-        env->schedPolicies[i] = sched_policy_get(SCHED_POLICY_STRAND_FILL);
-    }
+    env->schedPolicies[TASK_TYPE_MAP] = sched_policy_get (
+        placement_to_policy (args->map_placement, SCHED_POLICY_CORE_FILL));
+    env->schedPolicies[TASK_TYPE_REDUCE] = sched_policy_get (
+        placement_to_policy (args->reduce_placement, SCHED_POLICY_CORE_FILL));
+    env->schedPolicies[TASK_TYPE_MERGE] = sched_policy_get (
+        placement_to_policy (args->merge_placement, SCHED_POLICY_STRAND_FILL));
 
     return env;
 }
@@ -550,6 +1167,34 @@ static void start_thread_pool (
     CHECK_ERROR (tpool_begin (tpool));
 }
 
+/** worker_cpu()
+ *  CPU that worker THREAD_INDEX of a TASK_TYPE phase is bound to
+ */
+static inline int
+worker_cpu (mr_env_t* env, TASK_TYPE_T task_type, int thread_index)
+{
+    return sched_thr_to_cpu (env->schedPolicies[task_type], 
+        thread_index + env->args->proc_offset);
+}
+
+/** reset_task_queue()
+ *  Readies the task queue for NUM_THREADS workers of a TASK_TYPE phase,
+ *  each deque in the locality group of the CPU its worker will run on
+ */
+static void
+reset_task_queue (mr_env_t* env, TASK_TYPE_T task_type, int num_threads)
+{
+    int i;
+
+    assert (num_threads <= env->num_workers);
+
+    for (i = 0; i < num_threads; ++i)
+        env->worker_lgrps[i] = loc_cpu_to_lgrp (
+            worker_cpu (env, task_type, i));
+
+    tq_reset (env->taskQueue, num_threads, env->worker_lgrps);
+}
+
 /** start_workers()
  *  thread_func - function pointer to process splitter data
  *  splitter_func - splitter function pointer
@@ -566,8 +1211,8 @@ start_workers (mr_env_t* env, thread_arg_t *th_arg)
     int             cpu;
     intptr_t        ret_val;
     thread_arg_t    **th_arg_array;
-    void            **rets;
 #ifdef TIMING
+    void            **rets;
     uint64_t        work_time = 0;
     uint64_t        user_time = 0;
     uint64_t        combiner_time = 0;
@@ -578,27 +1223,25 @@ start_workers (mr_env_t* env, thread_arg_t *th_arg)
     task_type = th_arg->task_type;
     num_threads = getNumTaskThreads (env, task_type);
 
-    env->tinfo = (thread_info_t *)mem_calloc (
-        num_threads, sizeof (thread_info_t));
+    assert (num_threads <= env->num_workers);
+    mem_memset (env->tinfo, 0, num_threads * sizeof (thread_info_t));
     th_arg->env = env;
 
-    th_arg_array = (thread_arg_t **)mem_malloc (
-        sizeof (thread_arg_t *) * num_threads);
-    CHECK_ERROR (th_arg_array == NULL);
+    th_arg_array = env->th_arg_array;
 
     for (thread_index = 0; thread_index < num_threads; ++thread_index) {
 
-        cpu = sched_thr_to_cpu (env->schedPolicies[task_type], thread_index + env->args->proc_offset);
+        cpu = worker_cpu (env, task_type, thread_index);
         th_arg->cpu_id = cpu;
         th_arg->thread_id = thread_index;
 
-        th_arg_array[thread_index] = mem_malloc (sizeof (thread_arg_t));
-        CHECK_ERROR (th_arg_array[thread_index] == NULL);
         mem_memcpy (th_arg_array[thread_index], th_arg, sizeof (thread_arg_t));
     }
 
+    TRACE_BEGIN (TRACE_DISPATCH, num_threads);
     start_thread_pool (
         env->tpool, task_type, &th_arg_array[1], num_threads - 1);
+    TRACE_END (TRACE_DISPATCH, 0);
 
     dprintf("Status: All %d threads have been created\n", num_threads);
 
@@ -610,27 +1253,25 @@ start_workers (mr_env_t* env, thread_arg_t *th_arg)
     combiner_time += timing->combiner_time;
     mem_free (timing);
 #endif
-    mem_free (th_arg_array[0]);
 
     /* Barrier, wait for all threads to finish. */
+    TRACE_BEGIN (TRACE_BARRIER, 0);
     CHECK_ERROR (tpool_wait (env->tpool));
+    TRACE_END (TRACE_BARRIER, 0);
+
+#ifdef TIMING
     rets = tpool_get_results (env->tpool);
 
     for (thread_index = 1; thread_index < num_threads; ++thread_index)
     {
-#ifdef TIMING
         ret_val = (intptr_t)rets[thread_index - 1];
         thread_timing_t *timing = (thread_timing_t *)ret_val;
         work_time += timing->work_time;
         user_time += timing->user_time;
         combiner_time += timing->combiner_time;
         mem_free (timing);
-#endif
-        mem_free (th_arg_array[thread_index]);
     }
-
-    mem_free (th_arg_array);
-    mem_free (rets);
+#endif
 
 #ifdef TIMING
     switch (task_type)
@@ -660,7 +1301,6 @@ start_workers (mr_env_t* env, thread_arg_t *th_arg)
     }
 #endif
 
-    mem_free(env->tinfo);
     dprintf("Status: All tasks have completed\n"); 
 }
 
@@ -683,18 +1323,25 @@ static bool map_worker_do_next_task (
     map_args_t      thread_func_arg;
     bool            oneOutputQueuePerMapTask;
     int             lgrp = args->lgrp;
+    uint64_t        start_nsec = 0;
 
     oneOutputQueuePerMapTask = env->oneOutputQueuePerMapTask;
 
     alloc_len = env->intermediate_task_alloc_len;
 
     /* Get new map task. */
-    if (tq_dequeue (env->taskQueue, &map_task, lgrp, thread_index) == 0) {
+    if (env->lazy_split) {
+        if (!split_next (env, &map_task)) {
+            /* no more data to split */
+            return false;
+        }
+    }
+    else if (tq_dequeue (env->taskQueue, &map_task, lgrp, thread_index) == 0) {
         /* no more map tasks */
         return false;
     }
 
-    curr_task = env->num_map_tasks++;
+    curr_task = map_task.id;
     env->tinfo[thread_index].curr_task = curr_task;
 
     thread_func_arg.length = map_task.len;
@@ -703,10 +1350,20 @@ static bool map_worker_do_next_task (
     dprintf("Task %d: cpu_id -> %d - Started\n", curr_task, th_arg->cpu_id);
 
     /* Perform map task. */
+    if (env->split == SPLIT_GUIDED)
+        start_nsec = get_nsec ();
     get_time (&begin);
+    TRACE_BEGIN (TRACE_MAP_TASK, curr_task);
     env->map (&thread_func_arg);
+    TRACE_END (TRACE_MAP_TASK, 0);
     get_time (&end);
 
+    /* Store what the task batched, timed as emits are, outside of it. */
+    if (env->stages[thread_index].len > 0)
+        emit_flush (env, thread_index);
+    if (env->split == SPLIT_GUIDED)
+        env->tinfo[thread_index].map_nsec += get_nsec () - start_nsec;
+
 #ifdef TIMING
     args->run_time = time_diff (&end, &begin);
 #endif
@@ -742,6 +1399,7 @@ map_worker (void *args)
 #endif
 
     env->tinfo[thread_index].tid = pthread_self();
+    curr_worker = thread_index;
 
     /* Bind thread. */
     CHECK_ERROR (proc_bind_thread (th_arg->cpu_id) != 0);
@@ -753,10 +1411,37 @@ map_worker (void *args)
 
     mwta.lgrp = loc_get_lgrp();
 
+    /* Created by the thread itself so its blocks are node local. */
+    if (env->arenas[thread_index] == NULL && !env->map_only)
+        env->arenas[thread_index] = mem_arena_create (0);
+
+    if (env->map_lgrps != NULL)
+        env->map_lgrps[thread_index] = mwta.lgrp;
+    if (env->key_regs != NULL)
+        mem_memset (&env->key_regs[thread_index * HLL_REGS], 0, HLL_REGS);
+
+    if (env->num_dense_keys > 0)
+    {
+        keyvals_arr_t *arr = part_touch (env, thread_index, 0);
+
+        if (arr->arr == NULL)
+        {
+            arr->alloc_len = arr->len = env->num_dense_keys;
+            arr->arr = (keyvals_t *)mem_malloc (
+                arr->alloc_len * sizeof (keyvals_t));
+        }
+        mem_memset (arr->arr, 0, arr->alloc_len * sizeof (keyvals_t));
+    }
+
+    PERFCTR_BEGIN ();
     get_time (&work_begin);
     while (map_worker_do_next_task (env, thread_index, &mwta)) {
         user_time += mwta.run_time;
         num_assigned++;
+
+        if (env->spill_budget > 0 && 
+            intermediate_size (env, thread_index) > env->spill_budget)
+            spill_intermediate (env, thread_index);
     }
     get_time (&work_end);
 
@@ -766,13 +1451,28 @@ map_worker (void *args)
 
     get_time (&begin);
 
-    /* Apply combiner to local map results. */
-#ifndef INCREMENTAL_COMBINER
-    if (env->combiner != NULL)
-        run_combiner (env, thread_index);
-#endif
+    if (env->num_dense_keys > 0)
+    {
+        /* Combine across threads and reduce right here. */
+        user_time += dense_reduce (env, thread_index);
+    }
+    else if (env->pipeline)
+    {
+        /* Seal, combine and reduce the partitions right here. */
+        user_time += pipeline_reduce (env, thread_index);
+    }
+    else if (!env->map_only)
+    {
+        /* Get local map results in sorted order. */
+        seal_keyvals (env, thread_index);
+
+        /* Apply combiner to local map results. */
+        if (combine_after_map (env))
+            run_combiner (env, thread_index);
+    }
 
     get_time (&end);
+    PERFCTR_END (PERFCTR_PHASE_MAP, thread_index);
 
 #ifdef TIMING
     combiner_time = time_diff (&end, &begin);
@@ -781,9 +1481,6 @@ map_worker (void *args)
     dprintf("Status: Total of %d tasks were assigned to cpu_id %d\n", 
         num_assigned, th_arg->cpu_id);
 
-    /* Unbind thread. */
-    CHECK_ERROR (proc_unbind_thread () != 0);
-
 #ifdef TIMING
     thread_timing_t *timing = calloc (1, sizeof (thread_timing_t));
     uintptr_t emit_time = (uintptr_t)pthread_getspecific (emit_time_key);
@@ -798,25 +1495,27 @@ map_worker (void *args)
 
 typedef struct {
     struct iterator_t   itr;
+    loser_tree_t        lt;
     uint64_t            run_time;
     int                 num_map_threads;
+    int                 num_runs;
+    run_cursor_t        *runs;
+    keyvals_t           *spilled;       /* Current records of spilled runs,
+                                           as handed to reduce. */
     int                 lgrp;
 } reduce_worker_task_args_t;
 
+static void reduce_task_run (
+    mr_env_t *, int, task_t *, reduce_worker_task_args_t *);
+
 /**
  * Dequeue next reduce task and do it
- * TODO Refactor this even more. It is still gross.
  * @return true if did work, false otherwise
  */
 static bool reduce_worker_do_next_task (
     mr_env_t *env, int thread_index, reduce_worker_task_args_t *args)
 {
-    struct timeval  begin, end;
-    intptr_t        curr_reduce_task = 0;
-    keyvals_t       *min_key_val, *next_min;
     task_t          reduce_task;
-    int             num_map_threads;
-    int             curr_thread;
     int             lgrp = args->lgrp;
 
     /* Get the next reduce task. */
@@ -825,101 +1524,241 @@ static bool reduce_worker_do_next_task (
         return false;
     }
 
-    curr_reduce_task = (intptr_t)reduce_task.id;
+    reduce_task_run (env, thread_index, &reduce_task, args);
 
-    env->tinfo[thread_index].curr_task = curr_reduce_task;
-
-    num_map_threads =  args->num_map_threads;
+    return true;
+}
 
-    args->run_time = 0;
-    min_key_val = NULL;
-    next_min = NULL;
+/** run_peek()
+ *  Loads the key at the head of run r into the loser tree
+ */
+static inline void
+run_peek (loser_tree_t *lt, run_cursor_t *run, int r)
+{
+    if (run->arr != NULL) {
+        lt->done[r] = (run->next >= run->last);
+        if (!lt->done[r]) {
+            lt->keys[r] = run->arr->arr[run->next].key;
+            if (lt->lens != NULL)
+                lt->lens[r] = run->arr->arr[run->next].key_len;
+            if (lt->hashes != NULL)
+                lt->hashes[r] = run->arr->arr[run->next].hash;
+        }
+    } else {
+        lt->done[r] = (run->pos >= run->end);
+        if (!lt->done[r]) {
+            lt->keys[r] = spill_key (run->pos);
+            if (lt->lens != NULL)
+                lt->lens[r] = spill_key_len (run->pos);
+            if (lt->hashes != NULL)
+                lt->hashes[r] = spill_key_hash (run->pos);
+        }
+    }
+}
 
-    do {
-        for (curr_thread = 0; curr_thread < num_map_threads; curr_thread++) {
-            keyvals_t       *curr_key_val;
-            keyvals_arr_t   *thread_array;
+/** run_lower_bound()
+ *  First position of ARR whose key is not below the key of KV
+ */
+static int run_lower_bound (mr_env_t *env, keyvals_arr_t *arr, keyvals_t *kv)
+{
+    int low = 0, high = arr->len, mid;
 
-            /* Find the next array to search. */
-            thread_array = 
-                &env->intermediate_vals[curr_thread][curr_reduce_task];
+    while (low < high) {
+        mid = low + (high - low) / 2;
+        if (key_compare (env, arr->arr[mid].key, arr->arr[mid].key_len, 
+                kv->key, kv->key_len) < 0)
+            low = mid + 1;
+        else
+            high = mid;
+    }
 
-            /* Check if the current processor array has been 
-               completely searched. */
-            if (thread_array->pos >= thread_array->len) {
-                continue;
-            }
+    return low;
+}
 
-            /* Get the next key in the processor array. */
-            curr_key_val = &thread_array->arr[thread_array->pos];
+/* Stands in for the partitions of a page no key was emitted to. */
+static keyvals_arr_t empty_part;
 
-            /* If the key matches the minimum value, 
-               add the value to the list of values for that key. */
-            if (min_key_val != NULL &&
-                !env->key_cmp(curr_key_val->key, min_key_val->key)) {
-                CHECK_ERROR (iter_add (&args->itr, curr_key_val));
-                thread_array->pos += 1;
-                --curr_thread;
-            }
-            /* Find the location of the next min. */
-            else if (next_min == NULL || 
-                env->key_cmp(curr_key_val->key, next_min->key) < 0)
-            {
-                next_min = curr_key_val;
-            }
+/**
+ * Reduce partition PART of every map thread, then free it. If TASK is 
+ * split in task->len parts, only reduces one key range, from key 
+ * (uint32_t)task->data of map thread task->v[3] up to its key 
+ * task->data >> 32. The last part to finish frees the partition.
+ */
+static void reduce_part_run (mr_env_t *env, int thread_index, int part,
+    task_t *task, reduce_worker_task_args_t *args)
+{
+    struct timeval  begin, end;
+    keyvals_t       *min_key_val, *curr_key_val;
+    keyvals_t       *lo_key = NULL, *hi_key = NULL;
+    keyvals_arr_t   *src;
+    loser_tree_t    *lt = &args->lt;
+    run_cursor_t    *run;
+    spill_t         *spill;
+    intptr_t        curr_reduce_task = (intptr_t)part;
+    int             num_parts = (int)MAX (task->len, 1);
+    int             lo = 0, hi = 0;
+    int             num_map_threads;
+    int             num_runs, num_spilled;
+    int             curr_thread;
+    int             r;
+
+    env->tinfo[thread_index].curr_task = curr_reduce_task;
+    TRACE_BEGIN (TRACE_REDUCE_TASK, curr_reduce_task);
+
+    num_map_threads =  args->num_map_threads;
+
+    if (num_parts > 1) {
+        lo = (int)(uint32_t)task->data;
+        hi = (int)(task->data >> 32);
+        src = part_peek (env, task->v[3], curr_reduce_task);
+        if (lo > 0)
+            lo_key = &src->arr[lo];
+        if (hi < src->len)
+            hi_key = &src->arr[hi];
+    }
+
+    /* Each run holds sorted, unique keys. The spills of a map thread come
+       before its memory, as they hold its older values, and ties go to 
+       the lower run, so reduce sees values in the order they were 
+       emitted. */
+    num_runs = 0;
+    for (curr_thread = 0; curr_thread < num_map_threads; curr_thread++) {
+        for (spill = env->spills[curr_thread]; spill != NULL; 
+             spill = spill->next) {
+            run = &args->runs[num_runs++];
+            run->arr = NULL;
+            spill_run (spill, curr_reduce_task, &run->pos, &run->end);
         }
+        run = &args->runs[num_runs++];
+        run->arr = part_peek (env, curr_thread, curr_reduce_task);
+        if (run->arr == NULL)
+            run->arr = &empty_part;
+        run->next = (lo_key != NULL) ? 
+            run_lower_bound (env, run->arr, lo_key) : 0;
+        run->last = (hi_key != NULL) ? 
+            run_lower_bound (env, run->arr, hi_key) : run->arr->len;
+    }
+    assert (num_runs == args->num_runs);
 
-        if (min_key_val != NULL) {
-            keyvals_t       *curr_key_val;
+    for (r = 0; r < num_runs; r++)
+        run_peek (lt, &args->runs[r], r);
+    ltree_build (env, lt);
 
-            if (env->reduce != identity_reduce) {
-                get_time (&begin);
-                env->reduce (min_key_val->key, &args->itr);
-                get_time (&end);
-#ifdef TIMING
-                args->run_time += time_diff (&end, &begin);
-#endif
-            } else {
-                env->reduce (min_key_val->key, &args->itr);
-            }
+    if (env->map_lgrps != NULL && lo == 0) {
+        for (curr_thread = 0; curr_thread < num_map_threads; curr_thread++) {
+            src = part_peek (env, curr_thread, curr_reduce_task);
+            if (src == NULL)
+                continue;
 
-            /* Free up memory */
-            iter_rewind (&args->itr);
-            while (iter_next_list (&args->itr, &curr_key_val)) {
-                val_t   *vals, *next;
+            env->tinfo[thread_index].reduce_bytes += src->bytes;
+            if (env->map_lgrps[curr_thread] != args->lgrp)
+                env->tinfo[thread_index].remote_bytes += src->bytes;
+        }
+    }
 
-                vals = curr_key_val->vals;
-                while (vals != NULL) {
-                    next = vals->next_val;
-                    mem_free (vals);
-                    vals = next;
-                }
+    while (!lt->done[lt->tree[0]]) {
+        min_key_val = NULL;
+        num_spilled = 0;
+
+        /* Gather the smallest key from every run that has it. */
+        do {
+            r = lt->tree[0];
+            run = &args->runs[r];
+            if (run->arr != NULL) {
+                curr_key_val = &run->arr->arr[run->next++];
+            } else {
+                curr_key_val = &args->spilled[num_spilled++];
+                run->pos = spill_read (run->pos, curr_key_val);
             }
 
-            iter_reset(&args->itr);
+            if (min_key_val == NULL)
+                min_key_val = curr_key_val;
+            CHECK_ERROR (iter_add (&args->itr, curr_key_val));
+
+            run_peek (lt, run, r);
+            ltree_replay (env, lt);
+        } while (!lt->done[lt->tree[0]] && 
+            (lt->hashes == NULL || 
+                lt->hashes[lt->tree[0]] == min_key_val->hash) &&
+            !key_compare (env, lt->keys[lt->tree[0]], 
+                lt->lens ? lt->lens[lt->tree[0]] : 0, 
+                min_key_val->key, min_key_val->key_len));
+
+        if (env->reduce != identity_reduce) {
+            get_time (&begin);
+            env->reduce (key_ref (env, &min_key_val->key), &args->itr);
+            get_time (&end);
+#ifdef TIMING
+            args->run_time += time_diff (&end, &begin);
+#endif
+        } else {
+            env->reduce (key_ref (env, &min_key_val->key), &args->itr);
         }
 
-        min_key_val = next_min;
-        next_min = NULL;
+        /* Value chunks live in the map thread arenas, 
+           released in one go by reduce(). */
+        iter_reset(&args->itr);
+    }
 
-        /* See if there are any elements left. */
-        for(curr_thread = 0;
-            curr_thread < num_map_threads &&
-            env->intermediate_vals[curr_thread][curr_reduce_task].pos >=
-            env->intermediate_vals[curr_thread][curr_reduce_task].len;
-            curr_thread++);
-    } while (curr_thread != num_map_threads);
+    /* Free up the memory, or keep it around for the next run. */
+    if (num_parts > 1 && 
+        fetch_and_inc (&env->parts_done[curr_reduce_task]) + 1 < num_parts) {
+        TRACE_END (TRACE_REDUCE_TASK, 0);
+        return;
+    }
 
-    /* Free up the memory. */
     for (curr_thread = 0; curr_thread < num_map_threads; curr_thread++) {
         keyvals_arr_t   *arr;
 
-        arr = &env->intermediate_vals[curr_thread][curr_reduce_task];
-        if (arr->alloc_len != 0)
+        for (spill = env->spills[curr_thread]; spill != NULL; 
+             spill = spill->next)
+            spill_drop_run (spill, curr_reduce_task);
+
+        arr = part_peek (env, curr_thread, curr_reduce_task);
+        if (arr == NULL)
+            continue;
+
+        arr->bytes = 0;
+        if (env->persistent) {
+            arr->len = 0;
+            arr->pos = 0;
+        } else if (arr->alloc_len != 0) {
             mem_free(arr->arr);
+            arr->arr = NULL;
+            arr->alloc_len = 0;
+        }
     }
 
-    return true;
+    TRACE_END (TRACE_REDUCE_TASK, 0);
+}
+
+/**
+ * Reduce the partitions of TASK: the key range of partition task->id it
+ * stands for if split in task->len parts, otherwise the task->data 
+ * partitions from task->id on, or just that one if task->data is 0. 
+ * Partitions of pages no map thread emitted to are skipped.
+ */
+static void reduce_task_run (mr_env_t *env, int thread_index, 
+    task_t *task, reduce_worker_task_args_t *args)
+{
+    int part, last;
+
+    args->run_time = 0;
+
+    part = (int)task->id;
+    last = part + 1;
+    if (task->len <= 1 && task->data > 1)
+        last = part + (int)task->data;
+
+    while (part < last) {
+        if (!page_used (env, part >> PART_PAGE_SHIFT)) {
+            part = (part | (PART_PAGE_SIZE - 1)) + 1;
+            continue;
+        }
+
+        reduce_part_run (env, thread_index, part, task, args);
+        part++;
+    }
 }
 
 static void *
@@ -939,6 +1778,7 @@ reduce_worker (void *args)
 #endif
 
     env->tinfo[thread_index].tid = pthread_self();
+    curr_worker = thread_index;
 
     /* Bind thread. */
     CHECK_ERROR (proc_bind_thread (th_arg->cpu_id) != 0);
@@ -954,10 +1794,19 @@ reduce_worker (void *args)
         num_map_threads = env->num_map_threads;
 
     /* Assuming !oneOutputQueuePerMapTask */
-    CHECK_ERROR (iter_init (&rwta.itr, env->num_map_threads));
     rwta.num_map_threads = num_map_threads;
+    rwta.num_runs = count_runs (env);
+    CHECK_ERROR (iter_init (&rwta.itr, rwta.num_runs, 
+        env->inline_val_size > 0));
+    ltree_init (&rwta.lt, rwta.num_runs, env->key_len_cmp != NULL, 
+        env->key_hashes);
+    rwta.runs = (run_cursor_t *)mem_malloc (
+        rwta.num_runs * sizeof (run_cursor_t));
+    rwta.spilled = (keyvals_t *)mem_malloc (
+        rwta.num_runs * sizeof (keyvals_t));
     rwta.lgrp = loc_get_lgrp();
 
+    PERFCTR_BEGIN ();
     get_time (&work_begin);
 
     while (reduce_worker_do_next_task (env, thread_index, &rwta)) {
@@ -965,15 +1814,16 @@ reduce_worker (void *args)
     }
 
     get_time (&work_end);
+    PERFCTR_END (PERFCTR_PHASE_REDUCE, thread_index);
 
 #ifdef TIMING
     work_time = time_diff (&work_end, &work_begin);
 #endif
 
     iter_finalize (&rwta.itr);
-
-    /* Unbind thread. */
-    CHECK_ERROR (proc_unbind_thread () != 0);
+    ltree_finalize (&rwta.lt);
+    mem_free (rwta.runs);
+    mem_free (rwta.spilled);
 
 #ifdef TIMING
     thread_timing_t *timing = calloc (1, sizeof (thread_timing_t));
@@ -986,6 +1836,200 @@ reduce_worker (void *args)
 #endif
 }
 
+/** pipeline_reduce()
+ *  Reduce phase of a pipelined job, run by every map thread once it is
+ *  out of map tasks. Partitions are claimed one at a time as soon as the
+ *  last map task is done: the claimer seals and combines the runs of 
+ *  every map thread for that partition, then reduces it. Early partitions
+ *  are thus reduced while later ones are still being combined, without a
+ *  barrier between the phases. Returns the time spent in reduce().
+ */
+static uintptr_t
+pipeline_reduce (mr_env_t *env, int thread_index)
+{
+    reduce_worker_task_args_t   rwta;
+    unsigned int                task;
+    task_t                      reduce_task;
+    uintptr_t                   user_time = 0;
+    int                         num_map_threads = env->num_map_threads;
+    int                         i;
+    iterator_t                  itr;
+
+    /* Every map thread must be done emitting into the partitions. */
+    fetch_and_inc (&env->maps_done);
+    while (*(volatile unsigned int *)&env->maps_done < 
+        (unsigned int)num_map_threads)
+        sched_yield ();
+
+    rwta.num_map_threads = num_map_threads;
+    rwta.num_runs = count_runs (env);
+    CHECK_ERROR (iter_init (&rwta.itr, rwta.num_runs, 
+        env->inline_val_size > 0));
+    ltree_init (&rwta.lt, rwta.num_runs, env->key_len_cmp != NULL, 
+        env->key_hashes);
+    rwta.runs = (run_cursor_t *)mem_malloc (
+        rwta.num_runs * sizeof (run_cursor_t));
+    rwta.spilled = (keyvals_t *)mem_malloc (
+        rwta.num_runs * sizeof (keyvals_t));
+    rwta.lgrp = loc_get_lgrp ();
+    CHECK_ERROR (iter_init (&itr, 1, env->inline_val_size > 0));
+
+    while ((task = fetch_and_inc (&env->next_reduce_task)) < 
+        (unsigned int)env->num_reduce_tasks)
+    {
+        if (!page_used (env, task >> PART_PAGE_SHIFT))
+            continue;
+
+        for (i = 0; i < num_map_threads; i++)
+        {
+            keyvals_arr_t *arr = part_peek (env, i, task);
+
+            if (arr == NULL)
+                continue;
+            seal_partition (env, env->arenas[thread_index], arr);
+            if (combine_after_map (env))
+                combine_partition (env, &itr, arr);
+        }
+
+        mem_memset (&reduce_task, 0, sizeof (task_t));
+        reduce_task.id = task;
+        reduce_task_run (env, thread_index, &reduce_task, &rwta);
+        user_time += rwta.run_time;
+    }
+
+    iter_finalize (&itr);
+    iter_finalize (&rwta.itr);
+    ltree_finalize (&rwta.lt);
+    mem_free (rwta.runs);
+    mem_free (rwta.spilled);
+
+    return user_time;
+}
+
+/** dense_reduce()
+ *  Reduce phase of a dense key job, run by every map thread once it is
+ *  out of map tasks. The per thread key arrays are folded pairwise into 
+ *  the array of thread 0 in log2(num_map_threads) steps, then every 
+ *  thread reduces its own slice of the keys, in key order. Returns the 
+ *  time spent in reduce().
+ */
+static uintptr_t
+dense_reduce (mr_env_t *env, int thread_index)
+{
+    struct timeval  begin, end;
+    iterator_t      itr;
+    keyvals_t       *mine, *theirs;
+    uintptr_t       user_time = 0;
+    int             num_threads = env->num_map_threads;
+    int             num_keys = env->num_dense_keys;
+    int             step, partner;
+    int             i, first, last;
+
+    CHECK_ERROR (iter_init (&itr, 2, env->inline_val_size > 0));
+
+    /* A thread absorbs the one step above it for as long as the step
+       bit of its index is clear. That one is done with its own subtree 
+       by then. */
+    mine = part_peek (env, thread_index, 0)->arr;
+    for (step = 1; step < num_threads && !(thread_index & step); step <<= 1)
+    {
+        partner = thread_index + step;
+        if (partner >= num_threads)
+            continue;
+
+        while (!env->tinfo[partner].tree_done)
+            sched_yield ();
+        mem_barrier ();
+
+        theirs = part_peek (env, partner, 0)->arr;
+        for (i = 0; i < num_keys; i++)
+            dense_absorb (env, &itr, &mine[i], &theirs[i]);
+    }
+
+    mem_barrier ();
+    env->tinfo[thread_index].tree_done = 1;
+
+    /* Thread 0 holds every value now. */
+    while (!env->tinfo[0].tree_done)
+        sched_yield ();
+    mem_barrier ();
+
+    /* Emits go to the output queue of this thread, so the queues come
+       out in key order. */
+    env->tinfo[thread_index].curr_task = thread_index;
+    mine = part_peek (env, 0, 0)->arr;
+    first = (int)((int64_t)num_keys * thread_index / num_threads);
+    last = (int)((int64_t)num_keys * (thread_index + 1) / num_threads);
+    for (i = first; i < last; i++)
+    {
+        if (mine[i].len == 0)
+            continue;
+
+        CHECK_ERROR (iter_add (&itr, &mine[i]));
+
+        get_time (&begin);
+        env->reduce (key_ref (env, &mine[i].key), &itr);
+        get_time (&end);
+
+#ifdef TIMING
+        user_time += time_diff (&end, &begin);
+#endif
+
+        iter_reset (&itr);
+    }
+
+    iter_finalize (&itr);
+
+    return user_time;
+}
+
+/** dense_absorb()
+ *  Moves the values of theirs into mine, through the combiner if there
+ *  is one, itr is scratch space
+ */
+static void
+dense_absorb (mr_env_t *env, iterator_t *itr, 
+    keyvals_t *mine, keyvals_t *theirs)
+{
+    void    *reduced_val;
+    val_t   *tail;
+
+    if (theirs->len == 0)
+        return;
+
+    if (mine->len == 0)
+    {
+        *mine = *theirs;
+        return;
+    }
+
+    if (env->combiner != NULL)
+    {
+        CHECK_ERROR (iter_add (itr, mine));
+        CHECK_ERROR (iter_add (itr, theirs));
+
+        reduced_val = env->combiner (itr);
+        if (env->inline_val_size > 0)
+            reduced_val = inline_slot (reduced_val, env->inline_val_size);
+        iter_reset (itr);
+
+        /* Keep just the first chunk, the arena reclaims the rest. */
+        mine->vals->next_insert_pos = 0;
+        mine->vals->next_val = NULL;
+        mine->vals->array[mine->vals->next_insert_pos++] = reduced_val;
+        mine->len = 1;
+    }
+    else
+    {
+        /* Chunks double in size, so the chain is short. */
+        for (tail = theirs->vals; tail->next_val != NULL; tail = tail->next_val)
+            ;
+        tail->next_val = mine->vals;
+        mine->vals = theirs->vals;
+        mine->len += theirs->len;
+    }
+}
+
 /** merge_worker()
 * args - pointer to thread_arg_t
 * returns 0 on success
@@ -999,58 +2043,37 @@ merge_worker (void *args)
     thread_arg_t    *th_arg = (thread_arg_t *)args;
     int             thread_index = th_arg->thread_id;
     mr_env_t        *env = th_arg->env;
-    int             cpu;
 #ifdef TIMING
     uintptr_t       work_time = 0;
 #endif
 
     env->tinfo[thread_index].tid = pthread_self();
+    curr_worker = thread_index;
 
-    /* Bind thread.
-       Spread out the merge workers as much as possible. */
-    if (env->oneOutputQueuePerReduceTask)
-        cpu = th_arg->cpu_id * (1 << (th_arg->merge_round - 1));
-    else
-        cpu = th_arg->cpu_id * (1 << th_arg->merge_round);
-
-    CHECK_ERROR (proc_bind_thread (cpu) != 0);
+    /* Bind thread. */
+    CHECK_ERROR (proc_bind_thread (th_arg->cpu_id) != 0);
 
     CHECK_ERROR (pthread_setspecific (env_key, env));
 
-    /* Assumes num_merge_threads is modified before each call. */
-    int length = th_arg->merge_len / env->num_merge_threads;
-    int modlen = th_arg->merge_len % env->num_merge_threads;
-
-    /* Let's make some progress here. */
-    if (length <= 1) {
-        length = 2;
-        modlen = th_arg->merge_len % 2;
-    }
-
-    int pos = thread_index * length + 
-                ((thread_index < modlen) ? thread_index : modlen);
+    dprintf("Thread %d: cpu_id -> %d - Started\n", 
+                thread_index, th_arg->cpu_id);
 
-    if (pos < th_arg->merge_len) {
-
-        keyval_arr_t *vals = &th_arg->merge_input[pos];
-
-        dprintf("Thread %d: cpu_id -> %d - Started\n", 
-                    thread_index, th_arg->cpu_id);
-
-        get_time (&work_begin);
-        merge_results (th_arg->env, vals, length + (thread_index < modlen));
-        get_time (&work_end);
+    /* Every worker merges its own slice of all the runs. */
+    PERFCTR_BEGIN ();
+    get_time (&work_begin);
+    TRACE_BEGIN (TRACE_MERGE_TASK, thread_index);
+    merge_results (th_arg->env, th_arg->merge_input, th_arg->merge_len, 
+        thread_index);
+    TRACE_END (TRACE_MERGE_TASK, 0);
+    get_time (&work_end);
+    PERFCTR_END (PERFCTR_PHASE_MERGE, thread_index);
 
 #ifdef TIMING
-        work_time = time_diff (&work_end, &work_begin);
+    work_time = time_diff (&work_end, &work_begin);
 #endif
 
-        dprintf("Thread %d: cpu_id -> %d - Done\n", 
-                    thread_index, th_arg->cpu_id);
-    }
-
-    /* Unbind thread. */
-    CHECK_ERROR (proc_unbind_thread () != 0);
+    dprintf("Thread %d: cpu_id -> %d - Done\n", 
+                thread_index, th_arg->cpu_id);
 
 #ifdef TIMING
     thread_timing_t *timing = calloc (1, sizeof (thread_timing_t));
@@ -1071,13 +2094,18 @@ merge_worker (void *args)
 static int gen_map_tasks_split (mr_env_t* env, queue_t* q)
 {
     int                 cur_task_id;
+    int                 req_units;
     map_args_t          args;
     task_queued         *task = NULL;
 
     /* split until complete */
     cur_task_id = 0;
-    while (env->splitter (env->args->task_data, env->chunk_size, &args))
+    env->split_units = 0;
+    while (req_units = split_size (env, env->split_units),
+        env->splitter (env->args->task_data, req_units, &args))
     {
+        env->split_units += req_units;
+
         task = (task_queued *)mem_malloc (sizeof (task_queued));
         task->task.id = cur_task_id;
         task->task.len = (uint64_t)args.length;
@@ -1108,31 +2136,30 @@ static int gen_map_tasks_split (mr_env_t* env, queue_t* q)
 /**
  * User provided own splitter function but did not supply a locator function.
  * Nothing to do here about locality, so just try to put consecutive tasks
- * in the same task queue.
+ * in the same task queue. Each of the NUM_THREADS workers gets an equal run
+ * of them, queued on the locality group it runs on.
  */
 static int gen_map_tasks_distribute_lgrp (
-    mr_env_t* env, int num_map_tasks, queue_t* q)
+    mr_env_t* env, int num_map_tasks, int num_threads, queue_t* q)
 {
     queue_elem_t    *queue_elem;
-    int             tasks_per_lgrp;
+    int             tasks_per_worker;
     int             tasks_leftover;
-    int             num_lgrps;
+    int             worker;
     int             lgrp;
 
-    num_lgrps = env->num_map_threads / loc_get_lgrp_size();
-    if (num_lgrps == 0) num_lgrps = 1;
-
-    tasks_per_lgrp = num_map_tasks / num_lgrps;
-    tasks_leftover = num_map_tasks - tasks_per_lgrp * num_lgrps;
+    tasks_per_worker = num_map_tasks / num_threads;
+    tasks_leftover = num_map_tasks - tasks_per_worker * num_threads;
 
-    /* distribute tasks across locality groups */
-    for (lgrp = 0; lgrp < num_lgrps; ++lgrp)
+    /* distribute tasks across the workers' locality groups */
+    for (worker = 0; worker < num_threads; ++worker)
     {
-        int remaining_cur_lgrp_tasks;
+        int remaining_cur_worker_tasks;
 
-        remaining_cur_lgrp_tasks = tasks_per_lgrp;
+        lgrp = env->worker_lgrps[worker];
+        remaining_cur_worker_tasks = tasks_per_worker;
         if (tasks_leftover > 0) {
-            remaining_cur_lgrp_tasks++;
+            remaining_cur_worker_tasks++;
             tasks_leftover--;
         }
         do {
@@ -1152,10 +2179,10 @@ static int gen_map_tasks_distribute_lgrp (
             }
 
             mem_free (task);
-            remaining_cur_lgrp_tasks--;
-        } while (remaining_cur_lgrp_tasks);
+            remaining_cur_worker_tasks--;
+        } while (remaining_cur_worker_tasks);
 
-        if (remaining_cur_lgrp_tasks != 0) {
+        if (remaining_cur_worker_tasks != 0) {
             break;
         }
     }
@@ -1206,15 +2233,17 @@ static int gen_map_tasks_distribute_locator (
 /**
  * Distributes tasks to threads
  * @param num_map_tasks number of map tasks in queue
+ * @param num_threads number of map workers
  * @param q queue of tasks to distribute
  * @return 0 on success, less than 0 on failure
  */
 static int gen_map_tasks_distribute (
-    mr_env_t* env, int num_map_tasks, queue_t* q)
+    mr_env_t* env, int num_map_tasks, int num_threads, queue_t* q)
 {
     if ((env->splitter != array_splitter) && 
         (env->locator == NULL)) {
-        return gen_map_tasks_distribute_lgrp (env, num_map_tasks, q);
+        return gen_map_tasks_distribute_lgrp (
+            env, num_map_tasks, num_threads, q);
     } else {
         return gen_map_tasks_distribute_locator (env, num_map_tasks, q);
     }
@@ -1222,6 +2251,95 @@ static int gen_map_tasks_distribute (
     return 0;
 }
 
+/**
+ * Number of units to ask the splitter for next, SPLIT_UNITS having been
+ * split already
+ */
+static inline int split_size (mr_env_t* env, uint64_t split_units)
+{
+    int64_t left;
+    int64_t req;
+
+    if (env->split == SPLIT_FIXED)
+        return env->chunk_size;
+
+    /* Guided self-scheduling, a share of what is left. */
+    left = env->args->data_size / env->args->unit_size - split_units;
+    req = left / (GUIDED_SPLIT_FACTOR * env->num_map_threads);
+
+    req = MIN (req, env->max_chunk_size);
+    req = MAX (req, env->min_chunk_size);
+
+    return (int)req;
+}
+
+/**
+ * Splits the next map task off the input, called by the map workers when
+ * splitting lazily. Ranges of the default array are claimed without a 
+ * lock, a user splitter is called by one worker at a time.
+ * @return false once the input is used up
+ */
+static bool split_next (mr_env_t* env, task_t *task)
+{
+    map_args_t  args;
+    uintptr_t   pos, len, data_units;
+    int         req_units;
+
+    if (env->splitter == array_splitter)
+    {
+        data_units = env->args->data_size / env->args->unit_size;
+        do {
+            pos = env->splitter_pos;
+            if (pos >= data_units)
+                return false;
+            len = MIN ((uintptr_t)split_size (env, pos), data_units - pos);
+        } while (!cmp_and_swp (pos + len, &env->splitter_pos, pos));
+
+        task->len = len;
+        task->data = (uint64_t)((char *)env->args->task_data + 
+            pos * env->args->unit_size);
+    }
+    else
+    {
+        CHECK_ERROR (pthread_mutex_lock (&env->splitter_lock));
+        req_units = split_size (env, env->split_units);
+        if (!env->splitter (env->args->task_data, req_units, &args))
+        {
+            CHECK_ERROR (pthread_mutex_unlock (&env->splitter_lock));
+            return false;
+        }
+        env->split_units += req_units;
+        CHECK_ERROR (pthread_mutex_unlock (&env->splitter_lock));
+
+        task->len = (uint64_t)args.length;
+        task->data = (uint64_t)args.data;
+    }
+
+    task->id = fetch_and_inc (&env->num_splits);
+
+    return true;
+}
+
+/**
+ * Feeds the map time measured this run back into the size of the 
+ * smallest guided split, for the next run of the job
+ */
+static void split_feedback (mr_env_t* env)
+{
+    uint64_t nsec = 0;
+    int i;
+
+    for (i = 0; i < env->num_map_threads; i++)
+        nsec += env->tinfo[i].map_nsec;
+
+    if (nsec == 0 || env->split_units == 0)
+        return;
+
+    env->min_chunk_size = (int)MIN ((uint64_t)env->max_chunk_size,
+        (uint64_t)GUIDED_TAIL_NSEC * env->split_units / nsec);
+    env->min_chunk_size = MAX (env->min_chunk_size, 1);
+}
+
 /**
  * Generate all map tasks and queue them up
  * @return number of map tasks created if successful, negative value on error
@@ -1243,9 +2361,10 @@ static int gen_map_tasks (mr_env_t* env)
     num_map_threads = env->num_map_threads;
     if (num_map_tasks < num_map_threads)
         num_map_threads = num_map_tasks;
-    tq_reset (env->taskQueue, num_map_threads);
+    reset_task_queue (env, TASK_TYPE_MAP, num_map_threads);
 
-    ret = gen_map_tasks_distribute (env, num_map_tasks, &temp_queue);
+    ret = gen_map_tasks_distribute (
+        env, num_map_tasks, num_map_threads, &temp_queue);
     if (ret == 0) ret = num_map_tasks;
 
     return num_map_tasks;
@@ -1253,140 +2372,731 @@ static int gen_map_tasks (mr_env_t* env)
 
 static int gen_reduce_tasks (mr_env_t* env)
 {
-    int ret, tid;
-    int tasks_per_thread;
-    int tasks_leftover;
-    uint64_t task_id;
+    int ret;
+    int task_id;
+    int part, num_parts, num_group;
+    int src_thread = 0;
+    int *bounds = NULL;
+    uint64_t share, group_keys;
     task_t reduce_task;
+    size_t *lgrp_bytes = NULL;
+    int lgrp = -1;
+#ifdef TIMING
+    uint64_t load, total_load = 0, largest = 0;
+    int num_tasks = 0;
+#endif
 
-    tq_reset (env->taskQueue, env->num_reduce_threads);
+    reset_task_queue (env, TASK_TYPE_REDUCE, env->num_reduce_threads);
 
-    tasks_per_thread = env->num_reduce_tasks / env->num_reduce_threads;
-    tasks_leftover = env->num_reduce_tasks - 
-        tasks_per_thread * env->num_map_threads;
+    if (env->map_lgrps != NULL)
+        lgrp_bytes = (size_t *)mem_malloc (
+            loc_get_num_lgrps () * sizeof (size_t));
 
-    task_id = 0;
-    for (tid = 0; tid < env->num_reduce_threads; ++tid) {
-        int remaining_cur_thread_tasks;
+    share = reduce_split_share (env);
+    if (share > 0)
+        bounds = (int *)mem_malloc ((env->num_reduce_threads * 
+            env->hot_task_split + 1) * sizeof (int));
 
-        remaining_cur_thread_tasks = tasks_per_thread;
-        if (tasks_leftover > 0) {
-            remaining_cur_thread_tasks += 1;
-            --tasks_leftover;
+    group_keys = reduce_group_keys (env);
+
+    mem_memset (&reduce_task, 0, sizeof (task_t));
+    for (task_id = 0; task_id < env->num_reduce_tasks; task_id += num_group) {
+        /* Nothing was emitted to the rest of the page. */
+        if (!page_used (env, task_id >> PART_PAGE_SHIFT)) {
+            num_group = PART_PAGE_SIZE - (task_id & (PART_PAGE_SIZE - 1));
+            continue;
         }
-        do {
-            if (task_id == env->num_reduce_tasks) {
-                return 0;
-            }
 
-            /* New task. */
-            reduce_task.id = task_id;
+        /* Hot tasks go out in key ranges, to several workers. */
+        num_parts = 1;
+        if (share > 0)
+        {
+            num_parts = reduce_task_parts (
+                env, task_id, share, &src_thread, bounds);
+            env->parts_done[task_id] = 0;
+        }
+
+        /* Cold ones go out several partitions at a time. */
+        num_group = 1;
+        if (num_parts == 1 && group_keys > 0)
+            num_group = reduce_group_len (env, task_id, group_keys, share);
+
+        /* Queued where most of its data was emitted. */
+        if (lgrp_bytes != NULL)
+            lgrp = reduce_task_lgrp (env, task_id, num_group, lgrp_bytes);
+
+#ifdef TIMING
+        for (load = 0, part = task_id; part < task_id + num_group; part++)
+            load += reduce_task_load (env, part);
+        total_load += load;
+        if (num_parts > 1)
+            load = reduce_part_load (
+                env, task_id, load, src_thread, bounds, num_parts);
+        largest = MAX (largest, load);
+        num_tasks += num_parts;
+#endif
 
-            /* TODO: Implement locality optimization. */
-            ret = tq_enqueue_seq (env->taskQueue, &reduce_task,  -1);
+        for (part = 0; part < num_parts; ++part) {
+            reduce_task.id = task_id;
+            reduce_task.len = num_parts;
+            reduce_task.data = num_group;
+            if (num_parts > 1)
+                reduce_task.data = (uint64_t)(uint32_t)bounds[part] | 
+                    (uint64_t)bounds[part + 1] << 32;
+            reduce_task.v[3] = src_thread;
+
+            ret = tq_enqueue_seq (env->taskQueue, &reduce_task, lgrp);
             if (ret < 0) {
+                if (lgrp_bytes != NULL)
+                    mem_free (lgrp_bytes);
+                if (bounds != NULL)
+                    mem_free (bounds);
                 return -1;
             }
-            ++task_id;
-            --remaining_cur_thread_tasks;
-        } while (remaining_cur_thread_tasks);
+        }
     }
 
+#ifdef TIMING
+    if (total_load > 0)
+        fprintf (stderr, "reduce tasks: %d, largest %.1f%% of the data\n",
+            num_tasks, 100.0 * largest / total_load);
+#endif
+
+    if (lgrp_bytes != NULL)
+        mem_free (lgrp_bytes);
+    if (bounds != NULL)
+        mem_free (bounds);
+
     return 0;
 }
 
-#ifndef INCREMENTAL_COMBINER
-static void run_combiner (mr_env_t* env, int thread_index)
+/**
+ * # of keys the map threads hold for partition PART, a key held by 
+ * several of them counting once for each
+ */
+static inline uint64_t reduce_part_keys (mr_env_t* env, int part)
 {
-    assert (! env->oneOutputQueuePerMapTask);
-
-    int i, j;
-    keyvals_arr_t *my_output;
-    keyvals_t *reduce_pos;
-    void *reduced_val;
-    iterator_t itr;
-    val_t *val, *next;
-
-    CHECK_ERROR (iter_init (&itr, 1));
+    keyvals_arr_t *arr;
+    uint64_t keys = 0;
+    int i;
 
-    for (i = 0; i < env->num_reduce_tasks; ++i)
+    for (i = 0; i < env->num_map_threads; i++)
     {
-        my_output = &env->intermediate_vals[thread_index][i];
-        for (j = 0; j < my_output->len; ++j)
-        {
-            reduce_pos = &(my_output->arr[j]);
-            if (reduce_pos->len == 0) continue;
-
-            CHECK_ERROR (iter_add (&itr, reduce_pos));
+        arr = part_peek (env, i, part);
+        if (arr != NULL)
+            keys += arr->len;
+    }
 
-            reduced_val = env->combiner (&itr);
+    return keys;
+}
 
-            /* Shed off trailing chunks. */
-            assert (reduce_pos->vals);
-            val = reduce_pos->vals->next_val;
-            while (val)
-            {
-                next = val->next_val;
-                mem_free (val);
-                val = next;
-            }
+/**
+ * Amount of work in reduce task TASK: its keys if the map threads have
+ * combined them already, otherwise the bytes emitted to it
+ */
+static inline uint64_t reduce_task_load (mr_env_t* env, int task)
+{
+    keyvals_arr_t *arr;
+    uint64_t load = 0;
+    int i;
 
-            /* Update the entry. */
-            val = reduce_pos->vals;
-            val->next_insert_pos = 0;
-            val->next_val = NULL;
-            val->array[val->next_insert_pos++] = reduced_val;
-            reduce_pos->len = 1;
+    for (i = 0; i < env->num_map_threads; i++)
+    {
+        arr = part_peek (env, i, task);
+        if (arr == NULL)
+            continue;
 
-            iter_reset (&itr);
-        }
+        if (combine_after_map (env))
+            load += arr->len;
+        else
+            load += arr->bytes;
     }
 
-    iter_finalize (&itr);
+    return load;
 }
-#endif
 
-/** emit_intermediate()
- *  inserts the key, val pair into the intermediate array
+/**
+ * Keys, as counted by reduce_part_keys(), that each reduce task should 
+ * hold. Sized for the distinct keys the map threads counted to make up 
+ * REDUCE_TASKS_PER_THREAD tasks per reduce thread, of no fewer than 
+ * MIN_REDUCE_TASK_KEYS distinct keys each.
+ * @return the keys, or 0 if every partition makes a task of its own
  */
-void 
-emit_intermediate (void *key, void *val, int key_size)
+static uint64_t reduce_group_keys (mr_env_t* env)
 {
-    struct timeval  begin, end;
-    static __thread int curr_thread = -1;
-    int             curr_task;
-    bool            oneOutputQueuePerMapTask;
-    keyvals_arr_t   *arr;
-    mr_env_t        *env;
-
-    get_time (&begin);
-
-    env = get_env();
-    if (curr_thread < 0)
-        curr_thread = getCurrThreadIndex (TASK_TYPE_MAP);
-
-    oneOutputQueuePerMapTask = env->oneOutputQueuePerMapTask;
+    unsigned char regs[HLL_REGS];
+    uint64_t keys = 0, distinct, num_tasks;
+    int i;
 
-    if (oneOutputQueuePerMapTask)
-        curr_task = env->tinfo[curr_thread].curr_task;
-    else
-        curr_task = curr_thread;
-   
-    int reduce_pos = env->partition (env->num_reduce_tasks, key, key_size);
-    reduce_pos %= env->num_reduce_tasks;
+    /* Spilled keys are not counted. */
+    for (i = 0; i < env->num_map_threads; i++)
+    {
+        if (env->spills[i] != NULL)
+            return 0;
+    }
 
-    /* Insert sorted in global queue at pos curr_proc */
-    arr = &env->intermediate_vals[curr_task][reduce_pos];
+    for (i = 0; i < env->num_reduce_tasks; i++)
+    {
+        if (!page_used (env, i >> PART_PAGE_SHIFT))
+        {
+            /* On to the next page. */
+            i |= PART_PAGE_SIZE - 1;
+            continue;
+        }
+        keys += reduce_part_keys (env, i);
+    }
 
-    insert_keyval_merged (env, arr, key, val);
+    /* Without a hash, as if no key was held by two map threads. */
+    distinct = keys;
+    if (env->key_regs != NULL)
+    {
+        mem_memset (regs, 0, HLL_REGS);
+        for (i = 0; i < env->num_map_threads; i++)
+            hll_merge (regs, &env->key_regs[i * HLL_REGS]);
+        distinct = MIN (hll_estimate (regs), keys);
+    }
 
-    get_time (&end);
+    num_tasks = distinct / MIN_REDUCE_TASK_KEYS;
+    num_tasks = MIN (num_tasks, 
+        (uint64_t)env->num_reduce_threads * REDUCE_TASKS_PER_THREAD);
+    num_tasks = MAX (num_tasks, 1);
 
 #ifdef TIMING
-    uintptr_t total_emit_time = (uintptr_t)pthread_getspecific (emit_time_key);
-    uintptr_t emit_time = time_diff (&end, &begin);
-    total_emit_time += emit_time;
-    CHECK_ERROR (pthread_setspecific (emit_time_key, (void *)total_emit_time));
+    fprintf (stderr, "distinct keys: %" PRIu64 " estimated, %" PRIu64 
+        " held\n", distinct, keys);
+#endif
+
+    return MAX ((keys + num_tasks - 1) / num_tasks, 1);
+}
+
+/**
+ * # of partitions from FIRST on to reduce as one task, so it holds about
+ * GROUP_KEYS keys. Stops short of a partition over SHARE, if not 0, as
+ * that one gets split instead.
+ */
+static int reduce_group_len (
+    mr_env_t* env, int first, uint64_t group_keys, uint64_t share)
+{
+    uint64_t keys = 0;
+    int part = first;
+
+    while (part < env->num_reduce_tasks && keys < group_keys)
+    {
+        if (!page_used (env, part >> PART_PAGE_SHIFT))
+        {
+            part = (part | (PART_PAGE_SIZE - 1)) + 1;
+            continue;
+        }
+
+        if (part > first && share > 0 && reduce_task_load (env, part) > share)
+            break;
+
+        keys += reduce_part_keys (env, part);
+        part++;
+    }
+
+    return MIN (part, env->num_reduce_tasks) - first;
+}
+
+/**
+ * Load over which a reduce task gets split, 1/hot_task_split of the 
+ * share of a reduce thread
+ * @return the load, or 0 if no task may be split
+ */
+static uint64_t reduce_split_share (mr_env_t* env)
+{
+    uint64_t total = 0;
+    int i;
+
+    if (env->hot_task_split <= 0 || env->num_reduce_threads < 2 || 
+        env->parts_done == NULL)
+        return 0;
+
+    /* Key ranges of a spill cannot be told without reading it. */
+    for (i = 0; i < env->num_map_threads; i++)
+    {
+        if (env->spills[i] != NULL)
+            return 0;
+    }
+
+    for (i = 0; i < env->num_reduce_tasks; i++)
+    {
+        if (!page_used (env, i >> PART_PAGE_SHIFT))
+        {
+            /* On to the next page. */
+            i |= PART_PAGE_SIZE - 1;
+            continue;
+        }
+        total += reduce_task_load (env, i);
+    }
+
+    return MAX (total / ((uint64_t)env->num_reduce_threads * 
+        env->hot_task_split), 1);
+}
+
+/**
+ * Splits reduce task TASK in key ranges that each hold about SHARE of 
+ * the load. The ranges start at keys of the map thread with the most 
+ * keys for the task, returned in SRC_THREAD, and hold even counts of its
+ * values. A key with more values than that gets a range of its own. The
+ * first key of each range goes in BOUNDS, followed by the number of keys.
+ * @return the number of ranges
+ */
+static int reduce_task_parts (
+    mr_env_t* env, int task, uint64_t share, int *src_thread, int *bounds)
+{
+    keyvals_arr_t *src;
+    uint64_t load, num_parts, vals = 0, sum = 0;
+    int i, n, most = 0;
+
+    load = reduce_task_load (env, task);
+    if (load <= share)
+        return 1;
+
+    *src_thread = 0;
+    for (i = 0; i < env->num_map_threads; i++)
+    {
+        src = part_peek (env, i, task);
+        if (src != NULL && src->len > most)
+        {
+            most = src->len;
+            *src_thread = i;
+        }
+    }
+
+    num_parts = (load + share - 1) / share;
+    num_parts = MIN (num_parts, 
+        (uint64_t)env->num_reduce_threads * env->hot_task_split);
+    num_parts = MIN (num_parts, (uint64_t)most);
+    if (num_parts < 2)
+        return 1;
+
+    src = part_peek (env, *src_thread, task);
+    for (i = 0; i < src->len; i++)
+        vals += src->arr[i].len;
+
+    n = 0;
+    bounds[n++] = 0;
+    for (i = 0; i < src->len - 1 && n < num_parts; i++)
+    {
+        sum += src->arr[i].len;
+        if (sum * num_parts >= vals * n)
+            bounds[n++] = i + 1;
+    }
+    bounds[n] = src->len;
+
+    return n;
+}
+
+#ifdef TIMING
+/**
+ * Largest share of LOAD among the NUM_PARTS key ranges of reduce task 
+ * TASK, as split at BOUNDS over the keys of map thread SRC_THREAD
+ */
+static uint64_t reduce_part_load (mr_env_t* env, int task, uint64_t load,
+    int src_thread, int *bounds, int num_parts)
+{
+    keyvals_arr_t *src, *arr;
+    uint64_t *vals, total = 0, largest = 0;
+    int i, k, part, lo, hi;
+
+    src = part_peek (env, src_thread, task);
+    vals = (uint64_t *)mem_calloc (num_parts, sizeof (uint64_t));
+
+    for (i = 0; i < env->num_map_threads; i++)
+    {
+        arr = part_peek (env, i, task);
+        if (arr == NULL)
+            continue;
+
+        for (part = 0; part < num_parts; part++)
+        {
+            lo = (part > 0) ? 
+                run_lower_bound (env, arr, &src->arr[bounds[part]]) : 0;
+            hi = (part < num_parts - 1) ? 
+                run_lower_bound (env, arr, &src->arr[bounds[part + 1]]) : 
+                arr->len;
+            for (k = lo; k < hi; k++)
+                vals[part] += arr->arr[k].len;
+        }
+    }
+
+    for (part = 0; part < num_parts; part++)
+    {
+        total += vals[part];
+        largest = MAX (largest, vals[part]);
+    }
+    mem_free (vals);
+
+    return (total > 0) ? load * largest / total : load;
+}
+#endif
+
+/**
+ * Locality group whose map threads emitted the most bytes to the 
+ * NUM_PARTS partitions from FIRST on, using LGRP_BYTES as scratch space
+ * @return the lgrp, or -1 if they are empty
+ */
+static int reduce_task_lgrp (
+    mr_env_t* env, int first, int num_parts, size_t *lgrp_bytes)
+{
+    keyvals_arr_t *arr;
+    int num_lgrps = loc_get_num_lgrps ();
+    int i, part, lgrp = -1;
+    size_t most = 0;
+
+    mem_memset (lgrp_bytes, 0, num_lgrps * sizeof (size_t));
+    for (part = first; part < first + num_parts; part++)
+    {
+        for (i = 0; i < env->num_map_threads; i++)
+        {
+            arr = part_peek (env, i, part);
+            if (arr != NULL)
+                lgrp_bytes[env->map_lgrps[i] % num_lgrps] += arr->bytes;
+        }
+    }
+
+    for (i = 0; i < num_lgrps; i++)
+    {
+        if (lgrp_bytes[i] > most)
+        {
+            most = lgrp_bytes[i];
+            lgrp = i;
+        }
+    }
+
+    return lgrp;
+}
+
+static void run_combiner (mr_env_t* env, int thread_index)
+{
+    assert (! env->oneOutputQueuePerMapTask);
+
+    int i;
+    iterator_t itr;
+    keyvals_arr_t *arr;
+
+    CHECK_ERROR (iter_init (&itr, 1, env->inline_val_size > 0));
+
+    for (i = 0; i < env->num_reduce_tasks; ++i)
+    {
+        arr = part_peek (env, thread_index, i);
+        if (arr == NULL)
+        {
+            /* On to the next page. */
+            i |= PART_PAGE_SIZE - 1;
+            continue;
+        }
+        combine_partition (env, &itr, arr);
+    }
+
+    iter_finalize (&itr);
+}
+
+/** combine_partition()
+ *  Applies the combiner to every key of my_output, itr is scratch space
+ */
+static void 
+combine_partition (mr_env_t* env, iterator_t *itr, keyvals_arr_t *my_output)
+{
+    int j;
+
+    for (j = 0; j < my_output->len; ++j)
+    {
+        if (my_output->arr[j].len == 0) continue;
+
+        combine_vals (env, itr, &my_output->arr[j]);
+    }
+}
+
+/** combine_vals()
+ *  Replaces the values of a key by the result of the combiner on them,
+ *  itr is scratch space
+ */
+static inline void
+combine_vals (mr_env_t* env, iterator_t *itr, keyvals_t *reduce_pos)
+{
+    void *reduced_val;
+    val_t *val;
+
+    CHECK_ERROR (iter_add (itr, reduce_pos));
+
+    reduced_val = env->combiner (itr);
+    if (env->inline_val_size > 0)
+        reduced_val = inline_slot (reduced_val, env->inline_val_size);
+
+    /* Shed off trailing chunks, the arena reclaims them. */
+    assert (reduce_pos->vals);
+
+    /* Update the entry. */
+    val = reduce_pos->vals;
+    val->next_insert_pos = 0;
+    val->next_val = NULL;
+    val->array[val->next_insert_pos++] = reduced_val;
+    reduce_pos->len = 1;
+
+    iter_reset (itr);
+}
+
+/** combine_after_map()
+ *  Whether the combiner runs on everything once the map tasks are done
+ */
+static inline bool
+combine_after_map (mr_env_t* env)
+{
+    return env->combine == COMBINE_END_OF_MAP || 
+        env->combine == COMBINE_ADAPTIVE;
+}
+
+/** emit_task()
+ *  Intermediate queue the current map thread emits to
+ */
+static inline int
+emit_task (mr_env_t* env, int curr_thread)
+{
+    if (env->oneOutputQueuePerMapTask)
+        return env->tinfo[curr_thread].curr_task;
+
+    return curr_thread;
+}
+
+/** emit_partition()
+ *  Reduce task of the key. Sets *HASH if the keys carry their hash.
+ */
+static inline int
+emit_partition (mr_env_t* env, void *key, int key_size, unsigned int *hash)
+{
+    int reduce_pos;
+
+    /* Hashed once, for the store, the default partition and the key
+       counts. */
+    if (env->key_hashes)
+        *hash = env->hash (key, key_size);
+
+    if (env->key_hashes && env->partition == default_partition && 
+        env->hash == default_hash)
+        reduce_pos = *hash % env->num_reduce_tasks;
+    else
+        reduce_pos = env->partition (env->num_reduce_tasks, key, key_size);
+
+    return reduce_pos % env->num_reduce_tasks;
+}
+
+/** emit_slots()
+ *  Turns inline keys and values into the slots that are stored
+ */
+static inline void
+emit_slots (mr_env_t* env, void **key, void **val)
+{
+    if (env->inline_key_size > 0)
+        *key = inline_slot (*key, env->inline_key_size);
+    if (env->inline_val_size > 0)
+        *val = inline_slot (*val, env->inline_val_size);
+}
+
+/** emit_dense()
+ *  Stores the pair in the flat key array of the map thread
+ */
+static inline void
+emit_dense (mr_env_t* env, int curr_thread, int curr_task, 
+    void *key, void *val, int key_size)
+{
+    keyvals_t   *insert_pos;
+    int         reduce_pos;
+
+    reduce_pos = env->key_index (key);
+    assert (reduce_pos >= 0 && reduce_pos < env->num_dense_keys);
+    emit_slots (env, &key, &val);
+
+    insert_pos = &part_peek (env, curr_task, 0)->arr[reduce_pos];
+    insert_pos->key = key;
+    insert_pos->key_len = key_size;
+    insert_val (env, env->arenas[curr_thread], insert_pos, val);
+}
+
+/** emit_store()
+ *  Stores the pair in partition REDUCE_POS of the intermediate queue,
+ *  inline keys and values already in their slots
+ */
+static inline void
+emit_store (mr_env_t* env, int curr_thread, int curr_task, void *key, 
+    void *val, int key_size, int reduce_pos, unsigned int hash)
+{
+    keyvals_arr_t   *arr;
+    int             num_keys;
+
+    arr = part_touch (env, curr_task, reduce_pos);
+    num_keys = arr->len;
+
+    switch (env->intermediate_store)
+    {
+        case INTERMEDIATE_STORE_HASH:
+            insert_keyval_hashed (env, env->arenas[curr_thread], 
+                arr, key, key_size, val, hash);
+            break;
+
+        case INTERMEDIATE_STORE_APPEND:
+            insert_keyval_appended (env, arr, key, val);
+            break;
+
+        case INTERMEDIATE_STORE_SORTED:
+        default:
+            /* Insert sorted in global queue at pos curr_proc */
+            insert_keyval_merged (env, env->arenas[curr_thread], 
+                arr, key, key_size, val, hash);
+            break;
+    }
+
+    arr->bytes += key_size + sizeof (void *);
+
+    /* Count the keys new to this thread. */
+    if (arr->len > num_keys && env->key_regs != NULL)
+        hll_add (&env->key_regs[curr_thread * HLL_REGS], hash);
+}
+
+/** emit_flush()
+ *  Stores the pairs staged by the map thread, grouped by reduce task
+ *  so that each partition is visited once while it is in cache
+ */
+static void
+emit_flush (mr_env_t* env, int curr_thread)
+{
+    emit_stage_t    *stage = &env->stages[curr_thread];
+    emit_pair_t     *pair;
+    int             counts[(1 << EMIT_STAGE_BITS) + 1];
+    int             curr_task;
+    int             i, group;
+
+    curr_task = emit_task (env, curr_thread);
+
+    /* Counting sort on the top bits of the reduce task, stable so the
+       values of a key keep their emit order. */
+    mem_memset (counts, 0, sizeof (counts));
+    for (i = 0; i < stage->len; i++)
+        counts[(stage->pairs[i].reduce_pos >> env->stage_shift) + 1]++;
+    for (group = 1; group <= (1 << EMIT_STAGE_BITS); group++)
+        counts[group] += counts[group - 1];
+    for (i = 0; i < stage->len; i++)
+    {
+        group = stage->pairs[i].reduce_pos >> env->stage_shift;
+        stage->order[counts[group]++] = i;
+    }
+
+    for (i = 0; i < stage->len; i++)
+    {
+        pair = &stage->pairs[stage->order[i]];
+        emit_store (env, curr_thread, curr_task, pair->key, pair->val, 
+            pair->key_size, pair->reduce_pos, pair->hash);
+    }
+
+    stage->len = 0;
+}
+
+/** emit_intermediate()
+ *  inserts the key, val pair into the intermediate array
+ */
+void 
+emit_intermediate (void *key, void *val, int key_size)
+{
+    struct timeval  begin, end;
+    int             curr_thread;
+    int             curr_task;
+    mr_env_t        *env;
+    unsigned int    hash = 0;
+    int             reduce_pos;
+
+    get_time (&begin);
+    TRACE_COUNT_EMIT ();
+
+    env = get_env();
+    CHECK_ERROR (env->map_only);
+    curr_thread = getCurrThreadIndex ();
+    curr_task = emit_task (env, curr_thread);
+
+    if (env->num_dense_keys > 0)
+        emit_dense (env, curr_thread, curr_task, key, val, key_size);
+    else
+    {
+        reduce_pos = emit_partition (env, key, key_size, &hash);
+        emit_slots (env, &key, &val);
+        emit_store (env, curr_thread, curr_task, key, val, key_size, 
+            reduce_pos, hash);
+    }
+
+    get_time (&end);
+
+#ifdef TIMING
+    uintptr_t total_emit_time = (uintptr_t)pthread_getspecific (emit_time_key);
+    uintptr_t emit_time = time_diff (&end, &begin);
+    total_emit_time += emit_time;
+    CHECK_ERROR (pthread_setspecific (emit_time_key, (void *)total_emit_time));
+#endif
+}
+
+/** emit_intermediate_batch()
+ *  Stages N key, val pairs, storing them once the staging buffer of the
+ *  map thread fills up or its map task ends
+ */
+void
+emit_intermediate_batch (void **keys, void **vals, int *key_sizes, int n)
+{
+    struct timeval  begin, end;
+    int             curr_thread;
+    emit_stage_t    *stage;
+    emit_pair_t     *pair;
+    mr_env_t        *env;
+    int             i;
+
+    get_time (&begin);
+    TRACE_COUNT_EMITS (n);
+
+    env = get_env();
+    CHECK_ERROR (env->map_only);
+    curr_thread = getCurrThreadIndex ();
+
+    if (env->num_dense_keys > 0)
+    {
+        int curr_task = emit_task (env, curr_thread);
+
+        for (i = 0; i < n; i++)
+            emit_dense (env, curr_thread, curr_task, 
+                keys[i], vals[i], key_sizes[i]);
+    }
+    else
+    {
+        stage = &env->stages[curr_thread];
+
+        /* Allocated by the map thread so that it is node local. */
+        if (stage->pairs == NULL)
+        {
+            stage->pairs = (emit_pair_t *)mem_malloc (
+                EMIT_STAGE_LEN * sizeof (emit_pair_t));
+            stage->order = (int *)mem_malloc (EMIT_STAGE_LEN * sizeof (int));
+        }
+
+        for (i = 0; i < n; i++)
+        {
+            if (stage->len == EMIT_STAGE_LEN)
+                emit_flush (env, curr_thread);
+
+            pair = &stage->pairs[stage->len++];
+            pair->key = keys[i];
+            pair->val = vals[i];
+            pair->key_size = key_sizes[i];
+            pair->hash = 0;
+            pair->reduce_pos = emit_partition (
+                env, keys[i], key_sizes[i], &pair->hash);
+            emit_slots (env, &pair->key, &pair->val);
+        }
+    }
+
+    get_time (&end);
+
+#ifdef TIMING
+    uintptr_t total_emit_time = (uintptr_t)pthread_getspecific (emit_time_key);
+    uintptr_t emit_time = time_diff (&end, &begin);
+    total_emit_time += emit_time;
+    CHECK_ERROR (pthread_setspecific (emit_time_key, (void *)total_emit_time));
 #endif
 }
 
@@ -1398,10 +3108,7 @@ emit_inline (mr_env_t* env, void *key, void *val)
 {
     keyval_arr_t    *arr;
     int             curr_red_queue;
-    static __thread int thread_index = -1;
-
-    if (thread_index < 0)
-        thread_index = getCurrThreadIndex (TASK_TYPE_REDUCE);
+    int             thread_index = getCurrThreadIndex ();
 
     if (env->oneOutputQueuePerReduceTask) {
         curr_red_queue = env->tinfo[thread_index].curr_task;
@@ -1412,6 +3119,7 @@ emit_inline (mr_env_t* env, void *key, void *val)
 
     /* Insert sorted in global queue at pos curr_proc */
     arr = &env->final_vals[curr_red_queue];
+    emit_slots (env, &key, &val);
     insert_keyval (env, arr, key, val);
 }
 
@@ -1436,17 +3144,48 @@ emit (void *key, void *val)
 #endif
 }
 
+/** key_compare()
+ *  Compares two intermediate keys, by size if the job has a key_len_cmp
+ */
+static inline int
+key_compare (mr_env_t* env, void *key1, int len1, void *key2, int len2)
+{
+    if (env->inline_key_size > 0)
+    {
+        if (env->key_len_cmp != NULL)
+            return env->key_len_cmp (&key1, len1, &key2, len2);
+        return env->key_cmp (&key1, &key2);
+    }
+
+    if (env->key_len_cmp != NULL)
+        return env->key_len_cmp (key1, len1, key2, len2);
+
+    return env->key_cmp (key1, key2);
+}
+
+/** out_key_compare()
+ *  Compares two keys with key_cmp, as the output is ordered
+ */
+static inline int
+out_key_compare (mr_env_t* env, void *key1, void *key2)
+{
+    if (env->inline_key_size > 0)
+        return env->key_cmp (&key1, &key2);
+
+    return env->key_cmp (key1, key2);
+}
+
 static inline void 
-insert_keyval_merged (mr_env_t* env, keyvals_arr_t *arr, void *key, void *val)
+insert_keyval_merged (mr_env_t* env, mem_arena_t *arena, 
+    keyvals_arr_t *arr, void *key, int key_len, void *val, unsigned int hash)
 {
     int high = arr->len, low = -1, next;
     int cmp = 1;
-    keyvals_t *insert_pos;
-    val_t *new_vals;
 
     assert(arr->len <= arr->alloc_len);
     if (arr->len > 0)
-        cmp = env->key_cmp(arr->arr[arr->len - 1].key, key);
+        cmp = key_compare (env, arr->arr[arr->len - 1].key, 
+            arr->arr[arr->len - 1].key_len, key, key_len);
 
     if (cmp > 0)
     {
@@ -1454,15 +3193,25 @@ insert_keyval_merged (mr_env_t* env, keyvals_arr_t *arr, void *key, void *val)
         while (high - low > 1)
         {
             next = (high + low) / 2;
-            if (env->key_cmp(arr->arr[next].key, key) > 0)
+            if (key_compare (env, arr->arr[next].key, 
+                    arr->arr[next].key_len, key, key_len) > 0)
                 high = next;
             else
                 low = next;
         }
 
+        /* Below the key now, unless it comes first. Equal only if the
+           hashes are. */
+        if (low < 0)
+            cmp = 1;
+        else if (env->key_hashes && arr->arr[low].hash != hash)
+            cmp = -1;
+        else
+            cmp = key_compare (env, arr->arr[low].key, 
+                arr->arr[low].key_len, key, key_len);
+
         if (low < 0) low = 0;
-        if (arr->len > 0 &&
-                (cmp = env->key_cmp(arr->arr[low].key, key)) < 0)
+        if (cmp < 0)
             low++;
     }
     else if (cmp < 0)
@@ -1494,65 +3243,321 @@ insert_keyval_merged (mr_env_t* env, keyvals_arr_t *arr, void *key, void *val)
                         (arr->len - low) * sizeof(keyvals_t));
 
         arr->arr[low].key = key;
+        arr->arr[low].key_len = key_len;
+        arr->arr[low].hash = hash;
         arr->arr[low].len = 0;
         arr->arr[low].vals = NULL;
         arr->len++;
+        env->tinfo[curr_worker].num_entries++;
     }
 
-    insert_pos = &(arr->arr[low]);
+    insert_val (env, arena, &arr->arr[low], val);
+}
+
+/** insert_val()
+ *  appends val to the value chunks of insert_pos, new chunks come 
+ *  from arena
+ */
+static inline void 
+insert_val (
+    mr_env_t* env, mem_arena_t *arena, keyvals_t *insert_pos, void *val)
+{
+    val_t *new_vals;
 
     if (insert_pos->vals == NULL)
     {
         /* Allocate a chunk for the first time. */
-        new_vals = mem_malloc 
-            (sizeof (val_t) + DEFAULT_VALS_ARR_LEN * sizeof (void *));
+        new_vals = mem_arena_alloc (arena, 
+            sizeof (val_t) + DEFAULT_VALS_ARR_LEN * sizeof (void *));
         assert (new_vals);
 
         new_vals->size = DEFAULT_VALS_ARR_LEN;
         new_vals->next_insert_pos = 0;
         new_vals->next_val = NULL;
 
-        insert_pos->vals = new_vals;
+        insert_pos->vals = new_vals;
+    }
+    else if (insert_pos->vals->next_insert_pos >= insert_pos->vals->size)
+    {
+        if (env->combine == COMBINE_CHUNK_FULL) {
+            /* Make room in the chunk instead. */
+            combine_vals (env, 
+                &env->combine_itrs[getCurrThreadIndex ()], insert_pos);
+        } else {
+            /* Need a new chunk. */
+            int alloc_size;
+
+            alloc_size = insert_pos->vals->size * 2;
+            new_vals = mem_arena_alloc (
+                arena, sizeof (val_t) + alloc_size * sizeof (void *));
+            assert (new_vals);
+
+            new_vals->size = alloc_size;
+            new_vals->next_insert_pos = 0;
+            new_vals->next_val = insert_pos->vals;
+
+            insert_pos->vals = new_vals;
+        }
+    }
+
+    insert_pos->vals->array[insert_pos->vals->next_insert_pos++] = val;
+
+    insert_pos->len += 1;
+
+    if ((env->combine == COMBINE_AT_EMIT && insert_pos->len > 1) ||
+        (env->combine == COMBINE_ADAPTIVE && 
+            insert_pos->len >= env->combine_threshold))
+    {
+        combine_vals (env, 
+            &env->combine_itrs[getCurrThreadIndex ()], insert_pos);
+    }
+}
+
+/** insert_keyval_hashed()
+ *  Looks up key in the open addressing table of arr and appends val to
+ *  its value chunks. arr->arr is kept in insertion order and only gets
+ *  sorted by seal_keyvals() at the end of the map phase.
+ */
+static inline void 
+insert_keyval_hashed (mr_env_t* env, mem_arena_t *arena, 
+    keyvals_arr_t *arr, void *key, int key_len, void *val, unsigned int hash)
+{
+    kv_slot_t *slot;
+    unsigned int mask;
+    int i;
+
+    /* Keep the load factor at or below one half. */
+    if (2 * (arr->len + 1) > arr->num_slots)
+    {
+        kv_slot_t *old_slots = arr->slots;
+        int old_num_slots = arr->num_slots;
+
+        arr->num_slots = (old_num_slots == 0) ? 
+            DEFAULT_HASH_SLOTS : old_num_slots * 2;
+        arr->slots = (kv_slot_t *)mem_calloc (
+            arr->num_slots, sizeof (kv_slot_t));
+        mask = arr->num_slots - 1;
+
+        for (i = 0; i < old_num_slots; i++)
+        {
+            unsigned int pos;
+
+            if (old_slots[i].idx == 0)
+                continue;
+
+            pos = old_slots[i].hash & mask;
+            while (arr->slots[pos].idx != 0)
+                pos = (pos + 1) & mask;
+            arr->slots[pos] = old_slots[i];
+        }
+
+        if (old_slots != NULL)
+            mem_free (old_slots);
+    }
+
+    mask = arr->num_slots - 1;
+    slot = &arr->slots[hash & mask];
+    while (slot->idx != 0)
+    {
+        if (slot->hash == hash && key_compare (env, 
+                arr->arr[slot->idx - 1].key, arr->arr[slot->idx - 1].key_len, 
+                key, key_len) == 0)
+        {
+            insert_val (env, arena, &arr->arr[slot->idx - 1], val);
+            return;
+        }
+        slot = &arr->slots[(slot - arr->slots + 1) & mask];
+    }
+
+    /* New key, append to the array. */
+    if (arr->len == arr->alloc_len)
+    {
+        arr->alloc_len = (arr->alloc_len == 0) ? 
+            DEFAULT_KEYVAL_ARR_LEN : arr->alloc_len * 2;
+        arr->arr = (keyvals_t *)
+            mem_realloc (arr->arr, arr->alloc_len * sizeof (keyvals_t));
+    }
+
+    arr->arr[arr->len].key = key;
+    arr->arr[arr->len].key_len = key_len;
+    arr->arr[arr->len].hash = hash;
+    arr->arr[arr->len].len = 0;
+    arr->arr[arr->len].vals = NULL;
+    slot->hash = hash;
+    slot->idx = ++arr->len;
+    env->tinfo[curr_worker].num_entries++;
+
+    insert_val (env, arena, &arr->arr[arr->len - 1], val);
+}
+
+/** insert_keyval_appended()
+ *  Appends the pair to arr without any lookup. Pairs get sorted and 
+ *  grouped by key in seal_keyvals().
+ */
+static inline void 
+insert_keyval_appended (
+    mr_env_t* env, keyvals_arr_t *arr, void *key, void *val)
+{
+    if (arr->pairs_len == arr->pairs_alloc_len)
+    {
+        arr->pairs_alloc_len = (arr->pairs_alloc_len == 0) ?
+            DEFAULT_KEYVAL_ARR_LEN : arr->pairs_alloc_len * 2;
+        arr->pairs = (keyval_t *)mem_realloc (
+            arr->pairs, arr->pairs_alloc_len * sizeof (keyval_t));
+    }
+
+    arr->pairs[arr->pairs_len].key = key;
+    arr->pairs[arr->pairs_len].val = val;
+    arr->pairs_len++;
+    env->tinfo[curr_worker].num_entries++;
+}
+
+/** seal_keyvals()
+ *  Brings the intermediate output of map thread thread_idx into the
+ *  sorted, one-entry-per-key form the rest of the runtime expects.
+ */
+static void
+seal_keyvals (mr_env_t* env, int thread_idx)
+{
+    keyvals_arr_t *arr;
+    int i;
+
+    if (env->intermediate_store == INTERMEDIATE_STORE_SORTED)
+        return;
+
+    for (i = 0; i < env->num_reduce_tasks; i++)
+    {
+        arr = part_peek (env, thread_idx, i);
+        if (arr == NULL)
+        {
+            /* On to the next page. */
+            i |= PART_PAGE_SIZE - 1;
+            continue;
+        }
+        seal_partition (env, env->arenas[thread_idx], arr);
+    }
+}
+
+/** seal_partition()
+ *  Same as seal_keyvals() for a single array, new value chunks come 
+ *  from arena
+ */
+static void
+seal_partition (mr_env_t* env, mem_arena_t *arena, keyvals_arr_t *arr)
+{
+    int j;
+
+    if (env->intermediate_store == INTERMEDIATE_STORE_HASH)
+    {
+        if (arr->slots != NULL)
+            mem_free (arr->slots);
+        arr->slots = NULL;
+        arr->num_slots = 0;
+
+        sort_by_key (env, arr->arr, arr->len, sizeof (keyvals_t), 
+            offsetof (keyvals_t, key), offsetof (keyvals_t, key_len));
+    }
+    else if (env->intermediate_store == INTERMEDIATE_STORE_APPEND)
+    {
+        keyval_t *pairs = arr->pairs;
+        int num_pairs = arr->pairs_len;
+
+        arr->pairs = NULL;
+        arr->pairs_len = 0;
+        arr->pairs_alloc_len = 0;
+
+        if (num_pairs == 0)
+            return;
+
+        /* Stable, so values of a key keep their emit order. */
+        sort_by_key (env, pairs, num_pairs, sizeof (keyval_t), 
+            offsetof (keyval_t, key), -1);
+
+        assert (arr->len == 0);
+        for (j = 0; j < num_pairs; j++)
+        {
+            if (arr->len == 0 || out_key_compare (env, 
+                    arr->arr[arr->len - 1].key, pairs[j].key) != 0)
+            {
+                if (arr->len == arr->alloc_len)
+                {
+                    arr->alloc_len = (arr->alloc_len == 0) ? 
+                        DEFAULT_KEYVAL_ARR_LEN : arr->alloc_len * 2;
+                    arr->arr = (keyvals_t *)mem_realloc (
+                        arr->arr, arr->alloc_len * sizeof (keyvals_t));
+                }
+                arr->arr[arr->len].key = pairs[j].key;
+                arr->arr[arr->len].key_len = 0;
+                arr->arr[arr->len].hash = 0;
+                arr->arr[arr->len].len = 0;
+                arr->arr[arr->len].vals = NULL;
+                arr->len++;
+            }
+            insert_val (env, arena, &arr->arr[arr->len - 1], pairs[j].val);
+        }
+
+        mem_free (pairs);
     }
-    else if (insert_pos->vals->next_insert_pos >= insert_pos->vals->size)
-    {
-#ifdef INCREMENTAL_COMBINER
-        if (env->combiner != NULL) {
-            iterator_t itr;
-            void *reduced_val;
-
-            CHECK_ERROR (iter_init (&itr, 1));
-            CHECK_ERROR (iter_add (&itr, insert_pos));
+}
 
-            reduced_val = env->combiner (&itr);
+/** sort_by_key()
+ *  Stable merge sort of num elements of size width starting at base, 
+ *  ordered by the key pointer found key_offset bytes into each element.
+ *  Keys are compared by size as well if the job has a key_len_cmp and 
+ *  len_offset, the offset of the int size in each element, is not -1.
+ */
+static void
+sort_by_key (mr_env_t* env, void *base, int num, size_t width, 
+    size_t key_offset, int len_offset)
+{
+    char *src, *dst, *tmp, *buf;
+    int run, lo, mid, hi, i, j, k;
+    bool by_len = (env->key_len_cmp != NULL && len_offset >= 0);
 
-            insert_pos->vals->array[0] = reduced_val;
-            insert_pos->vals->next_insert_pos = 1;
-            insert_pos->len = 1;
+    if (num < 2)
+        return;
 
-            iter_finalize (&itr);
-        } else {
-#endif
-            /* Need a new chunk. */
-            int alloc_size;
+    buf = (char *)mem_malloc (num * width);
+    src = (char *)base;
+    dst = buf;
 
-            alloc_size = insert_pos->vals->size * 2;
-            new_vals = mem_malloc (sizeof (val_t) + alloc_size * sizeof (void *));
-            assert (new_vals);
+#define SORT_KEY(p, n) (*(void **)((p) + (size_t)(n) * width + key_offset))
+#define SORT_LEN(p, n) (*(int *)((p) + (size_t)(n) * width + len_offset))
 
-            new_vals->size = alloc_size;
-            new_vals->next_insert_pos = 0;
-            new_vals->next_val = insert_pos->vals;
+    for (run = 1; run < num; run *= 2)
+    {
+        for (lo = 0; lo < num; lo += 2 * run)
+        {
+            mid = (lo + run < num) ? lo + run : num;
+            hi = (lo + 2 * run < num) ? lo + 2 * run : num;
 
-            insert_pos->vals = new_vals;
-#ifdef INCREMENTAL_COMBINER
+            i = lo; j = mid; k = lo;
+            while (i < mid && j < hi)
+            {
+                if ((by_len ? 
+                    key_compare (env, SORT_KEY (src, j), SORT_LEN (src, j), 
+                        SORT_KEY (src, i), SORT_LEN (src, i)) :
+                    out_key_compare (env, 
+                        SORT_KEY (src, j), SORT_KEY (src, i))) < 0)
+                    memcpy (dst + k++ * width, src + j++ * width, width);
+                else
+                    memcpy (dst + k++ * width, src + i++ * width, width);
+            }
+            memcpy (dst + k * width, src + i * width, (mid - i) * width);
+            k += mid - i;
+            memcpy (dst + k * width, src + j * width, (hi - j) * width);
         }
-#endif
+
+        tmp = src; src = dst; dst = tmp;
     }
 
-    insert_pos->vals->array[insert_pos->vals->next_insert_pos++] = val;
+#undef SORT_KEY
+#undef SORT_LEN
 
-    insert_pos->len += 1;
+    if (src != (char *)base)
+        memcpy (base, src, num * width);
+
+    mem_free (buf);
 }
 
 static inline void 
@@ -1578,11 +3583,11 @@ insert_keyval (mr_env_t* env, keyval_arr_t *arr, void *key, void *val)
         }
     }
 
-    if (env->oneOutputQueuePerReduceTask == false)
+    if (env->oneOutputQueuePerReduceTask == false && !env->map_only)
     {
         /* Need to sort. */
         if (arr->len > 0)
-            cmp = env->key_cmp(arr->arr[arr->len - 1].key, key);
+            cmp = out_key_compare (env, arr->arr[arr->len - 1].key, key);
 
         if (cmp > 0)
         {
@@ -1590,14 +3595,15 @@ insert_keyval (mr_env_t* env, keyval_arr_t *arr, void *key, void *val)
             while (high - low > 1)
             {
                 next = (high + low) / 2;
-                if (env->key_cmp(arr->arr[next].key, key) > 0)
+                if (out_key_compare (env, arr->arr[next].key, key) > 0)
                     high = next;
                 else
                     low = next;
             }
 
             if (low < 0) low = 0;
-            if (arr->len > 0 && env->key_cmp(arr->arr[low].key, key) < 0)
+            if (arr->len > 0 && 
+                out_key_compare (env, arr->arr[low].key, key) < 0)
                 low++;
         }
         else
@@ -1622,62 +3628,237 @@ insert_keyval (mr_env_t* env, keyval_arr_t *arr, void *key, void *val)
 }
 
 static inline void 
-merge_results (mr_env_t* env, keyval_arr_t *vals, int length) 
+merge_results (mr_env_t* env, keyval_arr_t *vals, int length, int part) 
 {
-    int data_idx;
-    int total_num_keys = 0;
-    int i;
-    static __thread int curr_thread = -1;
-    
-    if (curr_thread < 0)
-        curr_thread = getCurrThreadIndex (TASK_TYPE_MERGE);
+    loser_tree_t    lt;
+    keyval_t        *out;
+    int             *lo, *hi, *pos;
+    int             out_pos = 0;
+    int             i;
+
+    lo = &env->merge_bounds[part * length];
+    hi = lo + length;
 
     for (i = 0; i < length; i++) {
-        total_num_keys += vals[i].len;
+        out_pos += lo[i];
     }
+    out = &env->merge_vals->arr[out_pos];
 
-    env->merge_vals[curr_thread].len = total_num_keys;
-    env->merge_vals[curr_thread].alloc_len = total_num_keys;
-    env->merge_vals[curr_thread].pos = 0;
-    env->merge_vals[curr_thread].arr = (keyval_t *)
-        mem_malloc(sizeof(keyval_t) * total_num_keys);
+    ltree_init (&lt, length, false, false);
+    pos = (int *)mem_malloc (length * sizeof (int));
 
-    for (data_idx = 0; data_idx < total_num_keys; data_idx++) {
-        /* For each keyval_t. */
-        int         min_idx;
-        keyval_t    *min_keyval;
+    for (i = 0; i < length; i++) {
+        pos[i] = lo[i];
+        lt.done[i] = (pos[i] >= hi[i]);
+        if (!lt.done[i])
+            lt.keys[i] = vals[i].arr[pos[i]].key;
+    }
+    ltree_build (env, &lt);
 
-        for (i = 0; i < length && vals[i].pos >= vals[i].len; i++);
+    while (!lt.done[i = lt.tree[0]]) {
+        *out++ = vals[i].arr[pos[i]++];
 
-        if (i == length) break;
+        lt.done[i] = (pos[i] >= hi[i]);
+        if (!lt.done[i])
+            lt.keys[i] = vals[i].arr[pos[i]].key;
+        ltree_replay (env, &lt);
+    }
 
-        /* Determine the minimum key. */
-        min_idx = i;
-        min_keyval = &vals[i].arr[vals[i].pos];
+    mem_free (pos);
+    ltree_finalize (&lt);
+}
 
-        for (i++; i < length; i++) {
-            if (vals[i].pos < vals[i].len)
-            {
-                int cmp_ret;
-                cmp_ret = env->key_cmp(
-                    min_keyval->key, 
-                    vals[i].arr[vals[i].pos].key);
-
-                if (cmp_ret > 0) {
-                    min_idx = i;
-                    min_keyval = &vals[i].arr[vals[i].pos];
-                }
-            }
+/** merge_lower_bound()
+ *  Returns the position of the first key in vals not less than key
+ */
+static inline int
+merge_lower_bound (mr_env_t* env, keyval_arr_t *vals, void *key)
+{
+    int low = 0, high = vals->len, mid;
+
+    while (low < high)
+    {
+        mid = low + (high - low) / 2;
+        if (out_key_compare (env, vals->arr[mid].key, key) < 0)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    return low;
+}
+
+/** merge_partition()
+ *  Splits the merge of the length sorted runs in vals into num_parts
+ *  slices of about the same size. Splitter keys are picked from a sample
+ *  of every run, then every run is cut at the lower bound of each 
+ *  splitter, so keys equal to a splitter all land in the same slice.
+ *  Returns (num_parts + 1) * length positions, slice t of run i is 
+ *  [bounds[t * length + i], bounds[(t + 1) * length + i]).
+ */
+static int *
+merge_partition (mr_env_t* env, keyval_arr_t *vals, int length, 
+    int num_parts, int total)
+{
+    merge_sample_t  *samples;
+    int             num_samples = 0;
+    int             *bounds;
+    double          acc = 0;
+    int             i, j, n, t;
+
+    bounds = (int *)mem_calloc ((num_parts + 1) * length, sizeof (int));
+    for (i = 0; i < length; i++)
+        bounds[num_parts * length + i] = vals[i].len;
+
+    if (num_parts == 1 || total == 0)
+        return bounds;
+
+    /* Sample every run in proportion to its length. */
+    samples = (merge_sample_t *)mem_malloc (
+        (MERGE_OVERSAMPLE * num_parts + length) * sizeof (merge_sample_t));
+
+    for (i = 0; i < length; i++)
+    {
+        if (vals[i].len == 0)
+            continue;
+
+        n = (int)((int64_t)vals[i].len * MERGE_OVERSAMPLE * num_parts / total);
+        n = MIN (n + 1, vals[i].len);
+
+        for (j = 0; j < n; j++)
+        {
+            samples[num_samples].key = 
+                vals[i].arr[(int)((2 * (int64_t)j + 1) * vals[i].len / (2 * n))].key;
+            samples[num_samples].weight = (double)vals[i].len / n;
+            num_samples++;
+        }
+    }
+
+    sort_by_key (env, samples, num_samples, sizeof (merge_sample_t), 
+        offsetof (merge_sample_t, key), -1);
+
+    t = 1;
+    for (j = 0; j < num_samples && t < num_parts; j++)
+    {
+        acc += samples[j].weight;
+        while (t < num_parts && acc >= (double)total * t / num_parts)
+        {
+            for (i = 0; i < length; i++)
+                bounds[t * length + i] = 
+                    merge_lower_bound (env, &vals[i], samples[j].key);
+            t++;
         }
+    }
 
-        mem_memcpy (&env->merge_vals[curr_thread].arr[data_idx], 
-                        min_keyval, sizeof(keyval_t));
-        vals[min_idx].pos += 1;
+    /* Any slices left over are empty. */
+    for (; t < num_parts; t++)
+    {
+        for (i = 0; i < length; i++)
+            bounds[t * length + i] = vals[i].len;
     }
 
-    for (i = 0; i < length; i++) {
-        mem_free(vals[i].arr);
+    mem_free (samples);
+
+    return bounds;
+}
+
+/** ltree_init()
+ *  Sets up a loser tree over num_runs runs, all marked exhausted
+ */
+static void
+ltree_init (loser_tree_t *lt, int num_runs, bool by_len, bool hashed)
+{
+    assert (num_runs > 0);
+
+    lt->num_runs = num_runs;
+    lt->lens = by_len ? (int *)mem_malloc (num_runs * sizeof (int)) : NULL;
+    lt->hashes = hashed ? 
+        (unsigned int *)mem_malloc (num_runs * sizeof (unsigned int)) : NULL;
+    lt->tree = (int *)mem_malloc (num_runs * sizeof (int));
+    lt->win = (int *)mem_malloc (2 * num_runs * sizeof (int));
+    lt->keys = (void **)mem_malloc (num_runs * sizeof (void *));
+    lt->done = (char *)mem_malloc (num_runs);
+    mem_memset (lt->done, 1, num_runs);
+}
+
+static void
+ltree_finalize (loser_tree_t *lt)
+{
+    mem_free (lt->tree);
+    mem_free (lt->win);
+    mem_free (lt->keys);
+    if (lt->lens != NULL)
+        mem_free (lt->lens);
+    if (lt->hashes != NULL)
+        mem_free (lt->hashes);
+    mem_free (lt->done);
+}
+
+/* Whether run a comes before run b. */
+static inline bool
+ltree_beats (mr_env_t* env, loser_tree_t *lt, int a, int b)
+{
+    int cmp;
+
+    if (lt->done[a]) return false;
+    if (lt->done[b]) return true;
+
+    if (lt->lens != NULL)
+        cmp = key_compare (env, lt->keys[a], lt->lens[a], 
+            lt->keys[b], lt->lens[b]);
+    else
+        cmp = out_key_compare (env, lt->keys[a], lt->keys[b]);
+    return cmp < 0 || (cmp == 0 && a < b);
+}
+
+/** ltree_build()
+ *  Plays the full tournament once the keys and done flags are set.
+ *  Runs are the leaves num_runs ... 2 * num_runs - 1 of an implicit heap.
+ */
+static void
+ltree_build (mr_env_t* env, loser_tree_t *lt)
+{
+    int k = lt->num_runs;
+    int *win = lt->win;
+    int n;
+
+    for (n = 0; n < k; n++)
+        win[k + n] = n;
+
+    for (n = k - 1; n >= 1; n--)
+    {
+        if (ltree_beats (env, lt, win[2 * n], win[2 * n + 1])) {
+            win[n] = win[2 * n];
+            lt->tree[n] = win[2 * n + 1];
+        } else {
+            win[n] = win[2 * n + 1];
+            lt->tree[n] = win[2 * n];
+        }
+    }
+
+    lt->tree[0] = (k > 1) ? win[1] : 0;
+}
+
+/** ltree_replay()
+ *  Finds the new winner after the key or done flag of the current 
+ *  winner changed
+ */
+static inline void
+ltree_replay (mr_env_t* env, loser_tree_t *lt)
+{
+    int w = lt->tree[0];
+    int n, tmp;
+
+    for (n = (lt->num_runs + w) / 2; n >= 1; n /= 2)
+    {
+        if (ltree_beats (env, lt, lt->tree[n], w)) {
+            tmp = lt->tree[n];
+            lt->tree[n] = w;
+            w = tmp;
+        }
     }
+
+    lt->tree[0] = w;
 }
 
 static inline int 
@@ -1709,24 +3890,15 @@ getNumTaskThreads (mr_env_t* env, TASK_TYPE_T task_type)
 }
 
 /** getCurrThreadIndex()
- *  Returns the processor the current thread is running on
+ *  Returns the index of the current thread among the workers of the 
+ *  running phase, as set by the worker entry points
  */
 static inline int 
-getCurrThreadIndex (TASK_TYPE_T task_type)
+getCurrThreadIndex (void)
 {
-    int         i;
-    int         num_threads;
-    mr_env_t    *env;
-    pthread_t   mytid;
-
-    env = get_env();
-    num_threads = getNumTaskThreads (env, task_type);
-    mytid = pthread_self();
-    for (i = 0; i < num_threads && env->tinfo[i].tid != mytid; i++);
+    assert (curr_worker >= 0);
 
-    assert(i != num_threads);
-
-    return i;
+    return curr_worker;
 }
 
 /** array_splitter()
@@ -1780,16 +3952,37 @@ identity_reduce (void *key, iterator_t *itr)
 int 
 default_partition (int num_reduce_tasks, void* key, int key_size)
 {
-    unsigned long hash = 5381;
-    char *str = (char *)key;
-    int i;
+    return default_hash (key, key_size) % num_reduce_tasks;
+}
+
+unsigned int
+default_hash (void* key, int key_size)
+{
+    const char *str = (const char *)key;
+    uint64_t hash = 0x9e3779b97f4a7c15ULL ^ (uint64_t)key_size;
+    uint64_t word;
+
+    /* A word at a time, the multiply spreads each over the hash. */
+    for (; key_size >= 8; key_size -= 8, str += 8)
+    {
+        memcpy (&word, str, 8);
+        hash = (hash ^ word) * 0xff51afd7ed558ccdULL;
+        hash ^= hash >> 32;
+    }
 
-    for (i = 0; i < key_size; i++)
+    /* Never reads past the key. */
+    if (key_size > 0)
     {
-        hash = ((hash << 5) + hash) + ((int)str[i]); /* hash * 33 + c */
+        word = 0;
+        memcpy (&word, str, key_size);
+        hash = (hash ^ word) * 0xff51afd7ed558ccdULL;
     }
 
-    return hash % num_reduce_tasks;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+
+    return (unsigned int)hash;
 }
 
 /**
@@ -1799,13 +3992,43 @@ static void map (mr_env_t* env)
 {
     thread_arg_t   th_arg;
     int            num_map_tasks;
+    uint64_t       data_units, min_units;
 
-    num_map_tasks = gen_map_tasks (env);
+    if (env->lazy_split)
+    {
+        /* The workers split as they go, so only a bound on the number 
+           of tasks is known, and only for the default array. */
+        env->splitter_pos = 0;
+        env->split_units = 0;
+        env->num_splits = 0;
+
+        num_map_tasks = env->num_map_threads;
+        if (env->splitter == array_splitter)
+        {
+            data_units = env->args->data_size / env->args->unit_size;
+            min_units = (env->split == SPLIT_FIXED) ? 
+                env->chunk_size : env->min_chunk_size;
+            min_units = MAX (min_units, 1);
+            num_map_tasks = (int)MIN ((uint64_t)num_map_tasks, 
+                MAX ((data_units + min_units - 1) / min_units, 1));
+        }
+    }
+    else
+        num_map_tasks = gen_map_tasks (env);
     assert (num_map_tasks >= 0);
 
     env->num_map_tasks = num_map_tasks;
     if (num_map_tasks < env->num_map_threads)
         env->num_map_threads = num_map_tasks;
+    if (env->pipeline || env->num_dense_keys > 0)
+        env->num_reduce_threads = env->num_map_threads;
+
+    /* Dense keys take a fixed amount of memory, nothing to spill. 
+       Neither is there anything in a map-only job. */
+    if (env->num_dense_keys == 0 && !env->oneOutputQueuePerMapTask && 
+        !env->map_only)
+        env->spill_budget = env->args->intermediate_budget / 
+            MAX (env->num_map_threads, 1);
 
     //printf (OUT_PREFIX "num_map_tasks = %d\n", env->num_map_tasks);
 
@@ -1813,6 +4036,16 @@ static void map (mr_env_t* env)
     th_arg.task_type = TASK_TYPE_MAP;
 
     start_workers (env, &th_arg);
+
+    if (env->lazy_split)
+    {
+        env->num_map_tasks = env->num_splits;
+        if (env->splitter == array_splitter)
+            env->split_units = env->splitter_pos;
+    }
+
+    if (env->split == SPLIT_GUIDED)
+        split_feedback (env);
 }
 
 /**
@@ -1820,22 +4053,216 @@ static void map (mr_env_t* env)
  */
 static void reduce (mr_env_t* env)
 {
-    int            i;
     thread_arg_t   th_arg;
 
-    CHECK_ERROR (gen_reduce_tasks (env));
+    /* Pipelined or dense, the map workers have reduced everything 
+       already. */
+    if (!env->pipeline && env->num_dense_keys == 0)
+    {
+        CHECK_ERROR (gen_reduce_tasks (env));
 
-    mem_memset (&th_arg, 0, sizeof(thread_arg_t));
-    th_arg.task_type = TASK_TYPE_REDUCE;
+        mem_memset (&th_arg, 0, sizeof(thread_arg_t));
+        th_arg.task_type = TASK_TYPE_REDUCE;
 
-    start_workers (env, &th_arg);
+        start_workers (env, &th_arg);
+
+#ifdef TIMING
+        if (env->map_lgrps != NULL)
+        {
+            uint64_t reduce_bytes = 0, remote_bytes = 0;
+            int i;
+
+            for (i = 0; i < env->num_reduce_threads; i++)
+            {
+                reduce_bytes += env->tinfo[i].reduce_bytes;
+                remote_bytes += env->tinfo[i].remote_bytes;
+            }
+            fprintf (stderr, "reduce remote bytes: %" PRIu64 " of %" 
+                PRIu64 "\n", remote_bytes, reduce_bytes);
+        }
+#endif
+    }
+
+    free_spills (env);
 
     /* Cleanup intermediate results. */
-    for (i = 0; i < env->intermediate_task_alloc_len; ++i)
+    if (env->persistent)
+        reset_intermediate (env);
+    else
+        free_intermediate (env);
+}
+
+/**
+ * Readies the reduced intermediate arrays and the value arenas of a
+ * persistent job for its next run, without giving up their memory.
+ */
+static void reset_intermediate (mr_env_t* env)
+{
+    int i;
+
+    for (i = 0; i < env->num_arenas; ++i)
+    {
+        if (env->arenas[i] != NULL)
+            mem_arena_reset (env->arenas[i]);
+    }
+}
+
+/**
+ * Releases the intermediate arrays and the value arenas.
+ */
+static void free_intermediate (mr_env_t* env)
+{
+    keyvals_arr_t *page;
+    int i, j, k;
+
+    for (i = 0; env->intermediate_vals != NULL && 
+        i < env->intermediate_task_alloc_len; ++i)
     {
+        for (j = 0; j < num_part_pages (env); ++j)
+        {
+            page = env->intermediate_vals[i][j];
+            if (page == NULL)
+                continue;
+
+            /* Whatever reduce did not free already. */
+            for (k = 0; k < PART_PAGE_SIZE; ++k)
+            {
+                if (page[k].alloc_len != 0)
+                    mem_free (page[k].arr);
+            }
+            mem_free (page);
+        }
         mem_free (env->intermediate_vals[i]);
     }
-    mem_free (env->intermediate_vals);
+    if (env->intermediate_vals != NULL)
+        mem_free (env->intermediate_vals);
+
+    for (i = 0; i < env->num_arenas; ++i)
+    {
+        if (env->arenas[i] != NULL)
+            mem_arena_destroy (env->arenas[i]);
+    }
+    mem_free (env->arenas);
+    mem_free (env->spills);
+}
+
+/** intermediate_size()
+ *  Rough # of bytes held by the intermediate pairs of a map thread: its
+ *  value chunks and its entries, without the slack of growing arrays
+ */
+static size_t 
+intermediate_size (mr_env_t* env, int thread_index)
+{
+    size_t entry_size;
+
+    switch (env->intermediate_store)
+    {
+        case INTERMEDIATE_STORE_HASH:
+            entry_size = sizeof (keyvals_t) + 2 * sizeof (kv_slot_t);
+            break;
+        case INTERMEDIATE_STORE_APPEND:
+            entry_size = sizeof (keyval_t);
+            break;
+        case INTERMEDIATE_STORE_SORTED:
+        default:
+            entry_size = sizeof (keyvals_t);
+            break;
+    }
+
+    return mem_arena_size (env->arenas[thread_index]) + 
+        env->tinfo[thread_index].num_entries * entry_size;
+}
+
+/** spill_intermediate()
+ *  Seals and combines every partition of a map thread, writes them out
+ *  as one spill and empties them, keeping their arrays
+ */
+static void 
+spill_intermediate (mr_env_t* env, int thread_index)
+{
+    mem_arena_t     *arena = env->arenas[thread_index];
+    keyvals_arr_t   *arr;
+    spill_t         *spill, **tail;
+    iterator_t      itr;
+    int             i, j;
+
+    CHECK_ERROR (iter_init (&itr, 1, env->inline_val_size > 0));
+    spill = spill_create (env->args->spill_dir, env->num_reduce_tasks);
+
+    for (i = 0; i < env->num_reduce_tasks; i++)
+    {
+        arr = part_peek (env, thread_index, i);
+        if (arr == NULL)
+        {
+            spill_end_run (spill);
+            continue;
+        }
+
+        seal_partition (env, arena, arr);
+        if (combine_after_map (env))
+            combine_partition (env, &itr, arr);
+
+        for (j = 0; j < arr->len; j++)
+        {
+            if (arr->arr[j].len > 0)
+                spill_write (spill, &arr->arr[j]);
+        }
+        spill_end_run (spill);
+
+        arr->len = 0;
+    }
+
+    spill_finish (spill);
+    iter_finalize (&itr);
+
+    mem_arena_reset (arena);
+    env->tinfo[thread_index].num_entries = 0;
+
+    for (tail = &env->spills[thread_index]; *tail != NULL; 
+         tail = &(*tail)->next)
+        ;
+    *tail = spill;
+}
+
+/** count_runs()
+ *  # of sorted runs every reduce task merges, one per map thread and one
+ *  per spill
+ */
+static int 
+count_runs (mr_env_t* env)
+{
+    spill_t *spill;
+    int num_runs = 0;
+    int i;
+
+    for (i = 0; i < env->num_map_threads; i++)
+    {
+        num_runs++;
+        for (spill = env->spills[i]; spill != NULL; spill = spill->next)
+            num_runs++;
+    }
+
+    return num_runs;
+}
+
+/** free_spills()
+ *  Unmaps and removes the spills, once reduced
+ */
+static void 
+free_spills (mr_env_t* env)
+{
+    spill_t *spill, *next;
+    int i;
+
+    for (i = 0; i < env->num_arenas; i++)
+    {
+        for (spill = env->spills[i]; spill != NULL; spill = next)
+        {
+            next = spill->next;
+            spill_destroy (spill);
+        }
+        env->spills[i] = NULL;
+    }
 }
 
 /**
@@ -1844,6 +4271,8 @@ static void reduce (mr_env_t* env)
 static void merge (mr_env_t* env)
 {
     thread_arg_t   th_arg;
+    int            total_num_keys = 0;
+    int            i;
 
     mem_memset (&th_arg, 0, sizeof (thread_arg_t));
     th_arg.task_type = TASK_TYPE_MERGE;
@@ -1855,42 +4284,109 @@ static void merge (mr_env_t* env)
     }
     th_arg.merge_input = env->final_vals;
 
+    if (env->num_dense_keys > 0) {
+        /* Each queue holds a key slice, in order, just concatenate. */
+        merge_concat (env, th_arg.merge_input, th_arg.merge_len);
+        return;
+    }
+
     if (th_arg.merge_len <= 1) {
         /* Already merged, nothing to do here */
         env->args->result->data = env->final_vals->arr;
         env->args->result->length = env->final_vals->len;
 
-        mem_free(env->final_vals);
+        if (env->persistent)
+            mem_memset (env->final_vals, 0, sizeof (keyval_arr_t));
+        else
+            mem_free(env->final_vals);
 
         return;
     }
 
-    /* have work to merge! */
-    while (th_arg.merge_len > 1) {
-        th_arg.merge_round += 1;
+    /* have work to merge! 
+       Single round, every merge thread fills its own slice of the 
+       output, so none of them sits idle. */
+    for (i = 0; i < th_arg.merge_len; i++) {
+        total_num_keys += th_arg.merge_input[i].len;
+    }
+
+    env->merge_vals = (keyval_arr_t *)mem_calloc (1, sizeof (keyval_arr_t));
+    env->merge_vals->len = total_num_keys;
+    env->merge_vals->alloc_len = total_num_keys;
+    env->merge_vals->arr = (keyval_t *)
+        mem_malloc (sizeof (keyval_t) * total_num_keys);
 
-        /* This is the worst case length, 
-           depending on the value of num_merge_threads. */
-        env->merge_vals = (keyval_arr_t*) 
-            mem_malloc (env->num_merge_threads * sizeof(keyval_arr_t));
+    env->merge_bounds = merge_partition (env, th_arg.merge_input, 
+        th_arg.merge_len, env->num_merge_threads, total_num_keys);
 
-        /* Run merge tasks and get merge values. */
-        start_workers (env, &th_arg);
+    /* Run merge tasks and get merge values. */
+    start_workers (env, &th_arg);
 
+    if (env->persistent) {
+        for (i = 0; i < th_arg.merge_len; i++) {
+            th_arg.merge_input[i].len = 0;
+            th_arg.merge_input[i].pos = 0;
+        }
+    } else {
+        for (i = 0; i < th_arg.merge_len; i++) {
+            mem_free (th_arg.merge_input[i].arr);
+        }
         mem_free (th_arg.merge_input);
-        th_arg.merge_len = env->num_merge_threads;
+    }
+    mem_free (env->merge_bounds);
+
+    env->args->result->data = env->merge_vals->arr;
+    env->args->result->length = env->merge_vals->len;
+
+    mem_free(env->merge_vals);
+}
+
+/**
+ * Concatenates the length output queues into the user result
+ */
+static void merge_concat (mr_env_t* env, keyval_arr_t *vals, int length)
+{
+    keyval_t    *data;
+    int         total_num_keys = 0;
+    int         i;
+
+    for (i = 0; i < length; i++) {
+        total_num_keys += vals[i].len;
+    }
 
-        env->num_merge_threads /= 2;
-        if (env->num_merge_threads == 0)
-            env->num_merge_threads = 1;
+    data = (keyval_t *)mem_malloc (sizeof (keyval_t) * total_num_keys);
+
+    total_num_keys = 0;
+    for (i = 0; i < length; i++) {
+        if (vals[i].len > 0) {
+            mem_memcpy (&data[total_num_keys], vals[i].arr, 
+                vals[i].len * sizeof (keyval_t));
+            total_num_keys += vals[i].len;
+        }
 
-        th_arg.merge_input = env->merge_vals;
+        if (env->persistent) {
+            vals[i].len = 0;
+            vals[i].pos = 0;
+        } else if (vals[i].arr != NULL) {
+            mem_free (vals[i].arr);
+        }
     }
 
-    env->args->result->data = env->merge_vals[0].arr;
-    env->args->result->length = env->merge_vals[0].len;
+    if (!env->persistent)
+        mem_free (vals);
 
-    mem_free(env->merge_vals);
+    env->args->result->data = data;
+    env->args->result->length = total_num_keys;
+}
+
+/* Monotonic clock, for timing that feeds back into scheduling. */
+static inline uint64_t get_nsec (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
 static inline mr_env_t* get_env (void)
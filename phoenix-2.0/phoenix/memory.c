@@ -32,13 +32,45 @@
 #include <sys/mman.h>
 #else
 #include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 #define PAGE_SIZE (4 * 1024)
+
+/* Mode of mbind(2), from <numaif.h>. */
+#define MPOL_PREFERRED  1
+#define MEM_MAX_NODES   1024
 #endif
 
 #define ALIGN_PAGE(ptr) (void *)((uintptr_t)(ptr) & (~(PAGE_SIZE - 1)))
 
 #include "memory.h"
 
+/* Allocations of mem_malloc_here() start with this much bookkeeping. */
+#define MEM_HERE_HDR            (2 * sizeof (size_t))
+
+/* Alignment of arena allocations. */
+#define MEM_ARENA_ALIGN         (2 * sizeof (void *))
+#define MEM_ARENA_BLOCK_SIZE    (64 * 1024)
+
+typedef struct mem_block mem_block_t;
+struct mem_block
+{
+    mem_block_t *next;
+    size_t      size;       /* Usable bytes in data. */
+    char        data[];
+};
+
+struct mem_arena
+{
+    char        *pos;       /* Next free byte of the current block. */
+    char        *end;       /* End of the current block. */
+    size_t      block_size;
+    mem_block_t *blocks;    /* In use, the current block first. */
+    mem_block_t *free;      /* Standard blocks kept across resets. */
+    size_t      size;       /* Bytes of the blocks in use. */
+};
+
 void *mem_malloc (size_t size)
 {
     void *temp = malloc (size);
@@ -47,12 +79,48 @@ void *mem_malloc (size_t size)
     return temp;
 }
 
+/* Allocate memory local to the processor of the calling thread.
+   Must be released with mem_free_here(). */
 void *mem_malloc_here (size_t size)
 {
-    void *temp = malloc (size);
-    assert(temp);
+    size_t len = size + MEM_HERE_HDR;
+    char *temp;
 
-    return temp;
+    temp = mmap (NULL, len, PROT_READ | PROT_WRITE, 
+        MAP_PRIVATE | MAP_ANON, -1, 0);
+    assert (temp != MAP_FAILED);
+
+#ifdef _SOLARIS_
+    /* Next thread to touch it gets it, that should be us. */
+    madvise (temp, len, MADV_ACCESS_LWP);
+#else
+    {
+        unsigned long mask[MEM_MAX_NODES / (8 * sizeof (unsigned long))];
+        unsigned int cpu, node;
+
+        /* Best effort, first touch places it locally anyway. */
+        if (syscall (SYS_getcpu, &cpu, &node, NULL) == 0 && 
+            node < MEM_MAX_NODES)
+        {
+            memset (mask, 0, sizeof (mask));
+            mask[node / (8 * sizeof (unsigned long))] |= 
+                1UL << (node % (8 * sizeof (unsigned long)));
+            syscall (SYS_mbind, temp, len, MPOL_PREFERRED, 
+                mask, MEM_MAX_NODES + 1, 0);
+        }
+    }
+#endif
+
+    *(size_t *)temp = len;
+
+    return temp + MEM_HERE_HDR;
+}
+
+void mem_free_here (void *ptr)
+{
+    char *temp = (char *)ptr - MEM_HERE_HDR;
+
+    munmap (temp, *(size_t *)temp);
 }
 
 void *mem_calloc (size_t num, size_t size)
@@ -85,3 +153,113 @@ void mem_free (void *ptr)
 {
     free (ptr);
 }
+
+/* Create an arena that carves allocations out of node local blocks of
+   BLOCK_SIZE bytes, 0 for the default. Arenas are not thread safe, 
+   each thread is meant to use its own. */
+mem_arena_t *mem_arena_create (size_t block_size)
+{
+    mem_arena_t *arena;
+
+    arena = (mem_arena_t *)mem_calloc (1, sizeof (mem_arena_t));
+    arena->block_size = (block_size != 0) ? 
+        block_size : MEM_ARENA_BLOCK_SIZE - MEM_HERE_HDR - sizeof (mem_block_t);
+
+    return arena;
+}
+
+void *mem_arena_alloc (mem_arena_t *arena, size_t size)
+{
+    mem_block_t *block;
+    void *temp;
+
+    size = (size + MEM_ARENA_ALIGN - 1) & ~(MEM_ARENA_ALIGN - 1);
+
+    if (size > arena->end - arena->pos)
+    {
+        if (size > arena->block_size / 4)
+        {
+            /* Large request, give it a block of its own and keep 
+               bumping in the current one. */
+            block = mem_malloc_here (sizeof (mem_block_t) + size);
+            block->size = size;
+            arena->size += size;
+            if (arena->blocks != NULL)
+            {
+                block->next = arena->blocks->next;
+                arena->blocks->next = block;
+            }
+            else
+            {
+                block->next = NULL;
+                arena->blocks = block;
+            }
+            return block->data;
+        }
+
+        if (arena->free != NULL)
+        {
+            block = arena->free;
+            arena->free = block->next;
+        }
+        else
+        {
+            block = mem_malloc_here (sizeof (mem_block_t) + arena->block_size);
+            block->size = arena->block_size;
+        }
+
+        block->next = arena->blocks;
+        arena->blocks = block;
+        arena->size += block->size;
+        arena->pos = block->data;
+        arena->end = block->data + block->size;
+    }
+
+    temp = arena->pos;
+    arena->pos += size;
+
+    return temp;
+}
+
+/* Release everything allocated from ARENA at once. */
+void mem_arena_reset (mem_arena_t *arena)
+{
+    mem_block_t *block, *next;
+
+    for (block = arena->blocks; block != NULL; block = next)
+    {
+        next = block->next;
+        if (block->size == arena->block_size)
+        {
+            block->next = arena->free;
+            arena->free = block;
+        }
+        else
+            mem_free_here (block);
+    }
+
+    arena->blocks = NULL;
+    arena->pos = arena->end = NULL;
+    arena->size = 0;
+}
+
+/* Bytes held by the allocations from ARENA since its last reset. */
+size_t mem_arena_size (mem_arena_t *arena)
+{
+    return arena->size;
+}
+
+void mem_arena_destroy (mem_arena_t *arena)
+{
+    mem_block_t *block, *next;
+
+    mem_arena_reset (arena);
+
+    for (block = arena->free; block != NULL; block = next)
+    {
+        next = block->next;
+        mem_free_here (block);
+    }
+
+    mem_free (arena);
+}
@@ -29,6 +29,8 @@
 
 #include <sys/types.h>
 
+typedef struct mem_arena mem_arena_t;
+
 inline void *mem_malloc (size_t size);
 inline void *mem_malloc_here (size_t size);
 inline void *mem_calloc (size_t num, size_t size);
@@ -36,5 +38,12 @@ inline void *mem_realloc (void *ptr, size_t size);
 inline void *mem_memcpy (void *dest, const void *src, size_t size);
 inline void *mem_memset (void *s, int c, size_t n);
 inline void mem_free (void *ptr);
+inline void mem_free_here (void *ptr);
+
+mem_arena_t *mem_arena_create (size_t block_size);
+void *mem_arena_alloc (mem_arena_t *arena, size_t size);
+void mem_arena_reset (mem_arena_t *arena);
+size_t mem_arena_size (mem_arena_t *arena);
+void mem_arena_destroy (mem_arena_t *arena);
 
 #endif // MEMORY_H_
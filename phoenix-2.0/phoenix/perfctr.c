@@ -0,0 +1,387 @@
+/* Copyright (c) 2007-2009, Stanford University
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*     * Redistributions of source code must retain the above copyright
+*       notice, this list of conditions and the following disclaimer.
+*     * Redistributions in binary form must reproduce the above copyright
+*       notice, this list of conditions and the following disclaimer in the
+*       documentation and/or other materials provided with the distribution.
+*     * Neither the name of Stanford University nor the names of its 
+*       contributors may be used to endorse or promote products derived from 
+*       this software without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY STANFORD UNIVERSITY ``AS IS'' AND ANY
+* EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL STANFORD UNIVERSITY BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/ 
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+#include "perfctr.h"
+#include "memory.h"
+#include "atomic.h"
+
+#ifdef _LINUX_
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#define PERFCTR_MAX_THREADS     1024    /* Workers counted per phase. */
+#define PERFCTR_MAX_FDS         (PERFCTR_MAX_THREADS * PERFCTR_NUM_COUNTERS)
+
+typedef enum {
+    PERFCTR_CYCLES = 0,
+    PERFCTR_INSTRUCTIONS,
+    PERFCTR_LLC_MISSES,
+    PERFCTR_DTLB_MISSES,
+    PERFCTR_NUM_COUNTERS
+} perfctr_counter_t;
+
+static const char *counter_names[PERFCTR_NUM_COUNTERS] = {
+    "cycles", "instructions", "llc_misses", "dtlb_misses"
+};
+
+static const char *phase_names[PERFCTR_NUM_PHASES] = {
+    "map", "reduce", "merge"
+};
+
+/* Sums for one worker in one phase. Each slot is written only by the
+   worker running it, phases are separated by the barrier. */
+typedef struct
+{
+    uint64_t        val[PERFCTR_NUM_COUNTERS];
+    uint64_t        enabled;            /* ns the group was enabled, */
+    uint64_t        running;            /* and actually on the PMU. */
+    uint64_t        runs;
+    unsigned int    have;               /* Mask of counters counted. */
+} perfctr_acc_t;
+
+bool perfctr_on = false;
+
+static perfctr_acc_t *accs[PERFCTR_NUM_PHASES];
+static int fds[PERFCTR_MAX_FDS];        /* All open counters, to close. */
+static unsigned int num_fds;
+static unsigned int perfctr_gen;        /* Bumped by every perfctr_init(). */
+static char *perfctr_path;
+static int open_errno;                  /* From the first failed open. */
+
+/* Group of the calling thread. */
+static __thread unsigned int my_gen;
+static __thread int my_leader = -1;
+static __thread unsigned int my_have;
+static __thread int my_slot[PERFCTR_NUM_COUNTERS];  /* In the group read. */
+static __thread int my_nr;
+static __thread uint64_t my_start[PERFCTR_NUM_COUNTERS + 2];
+
+void perfctr_init (void)
+{
+    const char *path;
+    int i;
+
+    if (perfctr_on)
+        return;
+
+    path = getenv ("MAPRED_PERFCTR");
+    if (path == NULL || *path == '\0')
+        return;
+
+#ifdef _LINUX_
+    perfctr_path = strdup (path);
+    for (i = 0; i < PERFCTR_NUM_PHASES; i++)
+        accs[i] = (perfctr_acc_t *)mem_calloc (
+            PERFCTR_MAX_THREADS, sizeof (perfctr_acc_t));
+    num_fds = 0;
+    open_errno = 0;
+    perfctr_gen++;
+
+    mem_barrier ();
+    perfctr_on = true;
+#else
+    (void)i;
+    fprintf (stderr, "perfctr: not supported on this platform\n");
+#endif
+}
+
+#ifdef _LINUX_
+
+static int perfctr_open (perfctr_counter_t counter, int group_fd)
+{
+    struct perf_event_attr attr;
+
+    mem_memset (&attr, 0, sizeof (attr));
+    attr.size = sizeof (attr);
+
+    switch (counter) {
+    case PERFCTR_CYCLES:
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_CPU_CYCLES;
+        break;
+    case PERFCTR_INSTRUCTIONS:
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+        break;
+    case PERFCTR_LLC_MISSES:
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.config = PERF_COUNT_HW_CACHE_LL | 
+            (PERF_COUNT_HW_CACHE_OP_READ << 8) | 
+            (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        break;
+    case PERFCTR_DTLB_MISSES:
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.config = PERF_COUNT_HW_CACHE_DTLB | 
+            (PERF_COUNT_HW_CACHE_OP_READ << 8) | 
+            (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        break;
+    default:
+        return -1;
+    }
+
+    /* User space only, which is all an unprivileged process may see. */
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP | 
+        PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+    return syscall (__NR_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+
+/** perfctr_group()
+ *  Opens the counters of the calling thread as one group, the first one
+ *  that opens leads it. Counters that do not open are left out.
+ */
+static void perfctr_group (void)
+{
+    int counter, fd;
+    unsigned int idx;
+
+    my_gen = perfctr_gen;
+    my_leader = -1;
+    my_have = 0;
+    my_nr = 0;
+
+    for (counter = 0; counter < PERFCTR_NUM_COUNTERS; counter++)
+    {
+        my_slot[counter] = -1;
+
+        fd = perfctr_open (counter, my_leader);
+        if (fd < 0)
+        {
+            if (open_errno == 0)
+                open_errno = errno;
+            continue;
+        }
+
+        idx = fetch_and_inc (&num_fds);
+        if (idx >= PERFCTR_MAX_FDS)
+        {
+            close (fd);
+            continue;
+        }
+        fds[idx] = fd;
+
+        if (my_leader < 0)
+            my_leader = fd;
+        my_slot[counter] = my_nr++;
+        my_have |= 1 << counter;
+    }
+}
+
+/** perfctr_read()
+ *  Reads the group as nr, time enabled, time running and the values
+ */
+static bool perfctr_read (uint64_t *buf)
+{
+    ssize_t len = (3 + my_nr) * sizeof (uint64_t);
+    uint64_t tmp[3 + PERFCTR_NUM_COUNTERS];
+
+    if (read (my_leader, tmp, len) != len)
+        return false;
+
+    mem_memcpy (buf, &tmp[1], (2 + my_nr) * sizeof (uint64_t));
+
+    return true;
+}
+
+void perfctr_begin (void)
+{
+    if (my_gen != perfctr_gen)
+        perfctr_group ();
+
+    if (my_leader < 0 || !perfctr_read (my_start))
+        my_have = 0;
+}
+
+void perfctr_end (perfctr_phase_t phase, int thread)
+{
+    uint64_t now[PERFCTR_NUM_COUNTERS + 2];
+    perfctr_acc_t *acc;
+    int counter;
+
+    if (my_have == 0 || thread < 0 || thread >= PERFCTR_MAX_THREADS)
+        return;
+
+    if (!perfctr_read (now))
+        return;
+
+    acc = &accs[phase][thread];
+    acc->enabled += now[0] - my_start[0];
+    acc->running += now[1] - my_start[1];
+    for (counter = 0; counter < PERFCTR_NUM_COUNTERS; counter++)
+    {
+        int slot = my_slot[counter];
+
+        if (slot >= 0)
+            acc->val[counter] += now[2 + slot] - my_start[2 + slot];
+    }
+    acc->have |= my_have;
+    acc->runs++;
+}
+
+/** perfctr_print()
+ *  Prints the counts of ACC, scaled up for the time the group was not on
+ *  the PMU. Counters not counted are null.
+ */
+static void perfctr_print (FILE *fp, perfctr_acc_t *acc)
+{
+    double scale;
+    int counter;
+
+    scale = (acc->running > 0) ? (double)acc->enabled / acc->running : 0;
+
+    fprintf (fp, "\"runs\":%" PRIu64, acc->runs);
+    for (counter = 0; counter < PERFCTR_NUM_COUNTERS; counter++)
+    {
+        if (acc->have & (1 << counter))
+            fprintf (fp, ",\"%s\":%.0f", 
+                counter_names[counter], acc->val[counter] * scale);
+        else
+            fprintf (fp, ",\"%s\":null", counter_names[counter]);
+    }
+}
+
+void perfctr_finalize (void)
+{
+    FILE *fp;
+    perfctr_acc_t total;
+    bool available = false;
+    const char *sep;
+    unsigned int i, n;
+    int phase, thread, counter;
+
+    if (!perfctr_on)
+        return;
+
+    perfctr_on = false;
+    mem_barrier ();
+
+    n = num_fds;
+    if (n > PERFCTR_MAX_FDS)
+        n = PERFCTR_MAX_FDS;
+    for (i = 0; i < n; i++)
+        close (fds[i]);
+    num_fds = 0;
+
+    if (strcmp (perfctr_path, "-") == 0)
+        fp = stderr;
+    else
+        fp = fopen (perfctr_path, "w");
+    if (fp == NULL)
+        perror (perfctr_path);
+
+    for (phase = 0; phase < PERFCTR_NUM_PHASES; phase++)
+        for (thread = 0; thread < PERFCTR_MAX_THREADS; thread++)
+            if (accs[phase][thread].have != 0)
+                available = true;
+
+    if (fp != NULL)
+    {
+        fprintf (fp, "{\"available\":%s", available ? "true" : "false");
+        if (!available && open_errno != 0)
+            fprintf (fp, ",\"error\":\"%s\"", strerror (open_errno));
+        fprintf (fp, ",\"phases\":[");
+
+        for (phase = 0; phase < PERFCTR_NUM_PHASES; phase++)
+        {
+            /* Threads are scaled one by one, then summed. */
+            mem_memset (&total, 0, sizeof (total));
+            for (thread = 0; thread < PERFCTR_MAX_THREADS; thread++)
+            {
+                perfctr_acc_t *acc = &accs[phase][thread];
+                double scale;
+
+                if (acc->running == 0)
+                    continue;
+
+                scale = (double)acc->enabled / acc->running;
+                for (counter = 0; counter < PERFCTR_NUM_COUNTERS; counter++)
+                    total.val[counter] += acc->val[counter] * scale;
+                total.have |= acc->have;
+                total.runs += acc->runs;
+            }
+            total.enabled = total.running = 1;
+
+            fprintf (fp, "%s\n{\"phase\":\"%s\",\"total\":{", 
+                phase ? "," : "", phase_names[phase]);
+            perfctr_print (fp, &total);
+            fprintf (fp, "},\"threads\":[");
+
+            sep = "";
+            for (thread = 0; thread < PERFCTR_MAX_THREADS; thread++)
+            {
+                perfctr_acc_t *acc = &accs[phase][thread];
+
+                if (acc->runs == 0)
+                    continue;
+
+                fprintf (fp, "%s\n {\"thread\":%d,", sep, thread);
+                perfctr_print (fp, acc);
+                fprintf (fp, "}");
+                sep = ",";
+            }
+            fprintf (fp, "]}");
+        }
+        fprintf (fp, "\n]}\n");
+
+        if (fp != stderr)
+            fclose (fp);
+    }
+
+    for (phase = 0; phase < PERFCTR_NUM_PHASES; phase++)
+    {
+        mem_free (accs[phase]);
+        accs[phase] = NULL;
+    }
+
+    free (perfctr_path);
+    perfctr_path = NULL;
+}
+
+#else /* !_LINUX_ */
+
+void perfctr_begin (void)
+{
+}
+
+void perfctr_end (perfctr_phase_t phase, int thread)
+{
+}
+
+void perfctr_finalize (void)
+{
+}
+
+#endif /* _LINUX_ */
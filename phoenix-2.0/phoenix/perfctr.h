@@ -0,0 +1,68 @@
+/* Copyright (c) 2007-2009, Stanford University
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*     * Redistributions of source code must retain the above copyright
+*       notice, this list of conditions and the following disclaimer.
+*     * Redistributions in binary form must reproduce the above copyright
+*       notice, this list of conditions and the following disclaimer in the
+*       documentation and/or other materials provided with the distribution.
+*     * Neither the name of Stanford University nor the names of its 
+*       contributors may be used to endorse or promote products derived from 
+*       this software without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY STANFORD UNIVERSITY ``AS IS'' AND ANY
+* EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL STANFORD UNIVERSITY BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/ 
+
+#ifndef PERFCTR_H_
+#define PERFCTR_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Phases counters are kept for, in the order of TASK_TYPE_T. */
+typedef enum {
+    PERFCTR_PHASE_MAP = 0,
+    PERFCTR_PHASE_REDUCE,
+    PERFCTR_PHASE_MERGE,
+    PERFCTR_NUM_PHASES
+} perfctr_phase_t;
+
+/* Set by perfctr_init() if counting is on. Only read through the macros
+   below, so a disabled counter point costs one predictable branch. */
+extern bool perfctr_on;
+
+/* Turns counting on if MAPRED_PERFCTR names an output file, "-" is
+   stderr. */
+void perfctr_init (void);
+
+/* Writes the per-phase and per-thread counts as JSON, closes the
+   counters and turns counting off. Must not race with counter points. */
+void perfctr_finalize (void);
+
+void perfctr_begin (void);
+void perfctr_end (perfctr_phase_t phase, int thread);
+
+/* Counts the calling thread between the two points, adding to the totals
+   of worker THREAD in PHASE. Points must not nest in a thread. */
+#define PERFCTR_BEGIN() do {                            \
+    if (__builtin_expect (perfctr_on, 0))               \
+        perfctr_begin ();                               \
+} while (0)
+
+#define PERFCTR_END(phase, thread) do {                 \
+    if (__builtin_expect (perfctr_on, 0))               \
+        perfctr_end ((phase), (thread));                \
+} while (0)
+
+#endif /* PERFCTR_H_ */
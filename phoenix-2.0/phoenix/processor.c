@@ -40,11 +40,23 @@
 
 #include <stdlib.h>
 #include <unistd.h>
+#include <string.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <assert.h>
 
 #include "processor.h"
 #include "memory.h"
+#ifdef _LINUX_
+#include "sysfs.h"
+#endif
+
+#define MAX_CACHE_LEVEL     3
+#define MAX_CACHE_INDEX     16
+
+static int cache_size[MAX_CACHE_LEVEL + 1];     /* [0] is the last level */
+static __thread int bound_cpu = -1;             /* -1 if not bound */
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
 
 /* Query the number of CPUs online. */
 int proc_get_num_cpus (void)
@@ -94,20 +106,33 @@ static cpu_set_t* proc_get_full_set(void)
    Returns 0 if successful, -1 if failed. */
 int proc_bind_thread (int cpu_id)
 {
+    int ret;
+
+    /* Already there, as pool threads usually are from phase to phase. */
+    if (cpu_id == bound_cpu)
+        return 0;
+
 #ifdef _LINUX_
     cpu_set_t   cpu_set;
 
     CPU_ZERO (&cpu_set);
     CPU_SET (cpu_id, &cpu_set);
 
-    return sched_setaffinity (0, sizeof (cpu_set), &cpu_set);
+    ret = sched_setaffinity (0, sizeof (cpu_set), &cpu_set);
 #elif defined (_SOLARIS_)
-    return processor_bind (P_LWPID, P_MYID, cpu_id, NULL);
+    ret = processor_bind (P_LWPID, P_MYID, cpu_id, NULL);
 #endif
+
+    bound_cpu = (ret == 0) ? cpu_id : -1;
+    return ret;
 }
 
 int proc_unbind_thread ()
 {
+    if (bound_cpu < 0)
+        return 0;
+
+    bound_cpu = -1;
 #ifdef _LINUX_
     return sched_setaffinity (0, sizeof (cpu_set_t), proc_get_full_set());
 #elif defined (_SOLARIS_)
@@ -131,6 +156,77 @@ bool proc_is_available (int cpu_id)
 #endif
 }
 
+#ifdef _LINUX_
+/* Parse a sysfs cache size such as "32K" or "8M" into bytes. */
+static int cache_parse_size (const char *str)
+{
+    char *end;
+    long size;
+
+    size = strtol (str, &end, 10);
+    if (*end == 'K') size <<= 10;
+    else if (*end == 'M') size <<= 20;
+    else if (*end == 'G') size <<= 30;
+
+    return (int)size;
+}
+#endif
+
+/* Fill cache_size[], from sysfs, or from sysconf if that is missing. */
+static void cache_init (void)
+{
+    int level;
+
+#ifdef _LINUX_
+    char buf[32];
+    int i;
+
+    for (i = 0; i < MAX_CACHE_INDEX; i++)
+    {
+        if (sysfs_read_int (&level, 
+                "devices/system/cpu/cpu0/cache/index%d/level", i) < 0)
+            break;
+        if (sysfs_read_str (buf, sizeof (buf), 
+                "devices/system/cpu/cpu0/cache/index%d/type", i) < 0 ||
+            strcmp (buf, "Instruction") == 0)
+            continue;
+        if (level < 1 || level > MAX_CACHE_LEVEL)
+            continue;
+        if (sysfs_read_str (buf, sizeof (buf), 
+                "devices/system/cpu/cpu0/cache/index%d/size", i) < 0)
+            continue;
+
+        cache_size[level] = cache_parse_size (buf);
+    }
+
+#ifdef _SC_LEVEL1_DCACHE_SIZE
+    if (cache_size[1] <= 0)
+        cache_size[1] = sysconf (_SC_LEVEL1_DCACHE_SIZE);
+    if (cache_size[2] <= 0)
+        cache_size[2] = sysconf (_SC_LEVEL2_CACHE_SIZE);
+    if (cache_size[3] <= 0)
+        cache_size[3] = sysconf (_SC_LEVEL3_CACHE_SIZE);
+#endif
+#endif
+
+    for (level = 1; level <= MAX_CACHE_LEVEL; level++)
+    {
+        if (cache_size[level] < 0)
+            cache_size[level] = 0;
+        if (cache_size[level] > 0)
+            cache_size[0] = cache_size[level];
+    }
+}
+
+int proc_get_cache_size (int level)
+{
+    assert (level >= 0 && level <= MAX_CACHE_LEVEL);
+
+    pthread_once (&cache_once, cache_init);
+
+    return cache_size[level];
+}
+
 int proc_get_cpuid (void)
 {
 #ifdef _LINUX_
@@ -35,4 +35,10 @@ extern inline int proc_unbind_thread ();
 extern inline bool proc_is_available (int cpu_id);
 extern inline int proc_get_cpuid (void);
 
+/* Size in bytes of the level LEVEL data cache of the first CPU, 1 to 3,
+   or of the last level cache if LEVEL is PROC_CACHE_LAST.
+   Returns 0 if unknown. */
+#define PROC_CACHE_LAST 0
+int proc_get_cache_size (int level);
+
 #endif /* PROCESSOR_H_ */
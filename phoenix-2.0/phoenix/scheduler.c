@@ -29,6 +29,7 @@
 #include "scheduler.h"
 #include "locality.h"
 #include "processor.h"
+#include "stddefines.h"
 
 /* TODO: Detect this automatically. */
 #ifdef _SOLARIS_
@@ -36,6 +37,31 @@
 #define NUM_STRANDS_PER_CORE    8
 #endif
 
+#ifdef _LINUX_
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "memory.h"
+#include "sysfs.h"
+
+/* Position of a CPU in the machine, read from sysfs. */
+typedef struct
+{
+    int     cpu;
+    int     chip;       /* physical_package_id */
+    int     core;       /* Rank of the core within its chip. */
+    int     strand;     /* Rank of the CPU within its core. */
+} sched_cpu_t;
+
+/* CPU ids in the order each policy hands them out. */
+static int              *sched_order[SCHED_POLICY_LAST + 1];
+static int              sched_num_cpus;
+static pthread_once_t   sched_once = PTHREAD_ONCE_INIT;
+
+static void sched_init_topology (void);
+#endif
+
 static int map_fill_strand(sched_policy* sp, int thr);
 static int map_fill_core(sched_policy* sp, int thr);
 static int map_fill_chip(sched_policy* sp, int thr);
@@ -44,6 +70,7 @@ struct sched_policy
 {
     int     num_cpus;
     int     num_chips_per_sys;
+    int     *order;
     int     (*map)(sched_policy* sp, int thr_idx);
 };
 
@@ -59,6 +86,12 @@ sched_policy* sched_policy_get(unsigned int policy)
     /* XXX make this configurable */
     policies[policy].num_cpus = proc_get_num_cpus();
     policies[policy].num_chips_per_sys = loc_get_num_lgrps ();
+#ifdef _LINUX_
+    CHECK_ERROR (pthread_once (&sched_once, sched_init_topology));
+    policies[policy].order = sched_order[policy];
+    if (policies[policy].num_cpus > sched_num_cpus)
+        policies[policy].num_cpus = sched_num_cpus;
+#endif
     return &policies[policy];
 }
 
@@ -78,7 +111,12 @@ int sched_thr_to_cpu(sched_policy* sp, int thr)
 static int map_fill_strand(sched_policy* sp, int thr)
 {
     int num_cpus = sp->num_cpus;
+
+#ifdef _LINUX_
+    return sp->order[thr % num_cpus];
+#else
     return (thr % num_cpus);
+#endif
 }
 
 static int map_fill_core(sched_policy* sp, int thr)
@@ -94,7 +132,7 @@ static int map_fill_core(sched_policy* sp, int thr)
     strand %= NUM_STRANDS_PER_CORE;
     return (core * NUM_STRANDS_PER_CORE + strand);
 #else
-    return thr % num_cpus;
+    return sp->order[thr % num_cpus];
 #endif
 }
 
@@ -116,6 +154,136 @@ static int map_fill_chip(sched_policy* sp, int thr)
             core * (NUM_STRANDS_PER_CORE) +
             strand);
 #else
-    return thr % num_cpus;
+    return sp->order[thr % num_cpus];
 #endif
 }
+
+#ifdef _LINUX_
+/* strand fill: chip, core, strand */
+static int sched_cmp_strand (const void *a, const void *b)
+{
+    const sched_cpu_t *x = a, *y = b;
+
+    if (x->chip != y->chip) return x->chip - y->chip;
+    if (x->core != y->core) return x->core - y->core;
+    if (x->strand != y->strand) return x->strand - y->strand;
+    return x->cpu - y->cpu;
+}
+
+/* core fill: strand, chip, core */
+static int sched_cmp_core (const void *a, const void *b)
+{
+    const sched_cpu_t *x = a, *y = b;
+
+    if (x->strand != y->strand) return x->strand - y->strand;
+    if (x->chip != y->chip) return x->chip - y->chip;
+    if (x->core != y->core) return x->core - y->core;
+    return x->cpu - y->cpu;
+}
+
+/* chip fill: strand, core, chip */
+static int sched_cmp_chip (const void *a, const void *b)
+{
+    const sched_cpu_t *x = a, *y = b;
+
+    if (x->strand != y->strand) return x->strand - y->strand;
+    if (x->core != y->core) return x->core - y->core;
+    if (x->chip != y->chip) return x->chip - y->chip;
+    return x->cpu - y->cpu;
+}
+
+/* Raw core_id, until sched_init_topology() ranks it. */
+static int sched_cmp_raw (const void *a, const void *b)
+{
+    const sched_cpu_t *x = a, *y = b;
+
+    if (x->chip != y->chip) return x->chip - y->chip;
+    if (x->core != y->core) return x->core - y->core;
+    return x->cpu - y->cpu;
+}
+
+/**
+ * Reads the chip and core of every online CPU from 
+ * devices/system/cpu and sorts them once for every policy.
+ * Without topology information every CPU is its own core.
+ */
+static void sched_init_topology (void)
+{
+    static int (*cmp[SCHED_POLICY_LAST + 1])(const void *, const void *) = {
+        sched_cmp_strand, sched_cmp_core, sched_cmp_chip
+    };
+    char list[4096];
+    const char *p = list;
+    sched_cpu_t *cpus;
+    int first, last, cpu, num_cpus, i, j;
+    int core_id = 0, core_rank = 0, strand_rank = 0;
+
+    num_cpus = 0;
+    cpus = NULL;
+    if (sysfs_read_str (list, sizeof (list), "devices/system/cpu/online") == 0)
+    {
+        while (sysfs_next_range (&p, &first, &last))
+        {
+            cpus = (sched_cpu_t *)mem_realloc (
+                cpus, (num_cpus + last - first + 1) * sizeof (sched_cpu_t));
+            for (cpu = first; cpu <= last; cpu++)
+                cpus[num_cpus++].cpu = cpu;
+        }
+    }
+
+    if (num_cpus == 0)
+    {
+        num_cpus = sysconf (_SC_NPROCESSORS_ONLN);
+        cpus = (sched_cpu_t *)mem_realloc (cpus, num_cpus * sizeof (sched_cpu_t));
+        for (i = 0; i < num_cpus; i++)
+            cpus[i].cpu = i;
+    }
+
+    for (i = 0; i < num_cpus; i++)
+    {
+        cpu = cpus[i].cpu;
+        if (sysfs_read_int (&cpus[i].chip, 
+                "devices/system/cpu/cpu%d/topology/physical_package_id", 
+                cpu) < 0)
+            cpus[i].chip = 0;
+        if (sysfs_read_int (&cpus[i].core, 
+                "devices/system/cpu/cpu%d/topology/core_id", cpu) < 0)
+            cpus[i].core = cpu;
+    }
+
+    /* Rank cores within their chip and CPUs within their core, 
+       core ids are sparse and may repeat across chips. */
+    qsort (cpus, num_cpus, sizeof (sched_cpu_t), sched_cmp_raw);
+    for (i = 0; i < num_cpus; i++)
+    {
+        if (i == 0 || cpus[i].chip != cpus[i - 1].chip)
+        {
+            core_rank = 0;
+            strand_rank = 0;
+        }
+        else if (cpus[i].core != core_id)
+        {
+            core_rank++;
+            strand_rank = 0;
+        }
+        else
+            strand_rank++;
+
+        core_id = cpus[i].core;
+        cpus[i].core = core_rank;
+        cpus[i].strand = strand_rank;
+    }
+
+    for (i = 0; i <= SCHED_POLICY_LAST; i++)
+    {
+        qsort (cpus, num_cpus, sizeof (sched_cpu_t), cmp[i]);
+
+        sched_order[i] = (int *)mem_malloc (num_cpus * sizeof (int));
+        for (j = 0; j < num_cpus; j++)
+            sched_order[i][j] = cpus[j].cpu;
+    }
+
+    sched_num_cpus = num_cpus;
+    mem_free (cpus);
+}
+#endif
@@ -0,0 +1,182 @@
+/* Copyright (c) 2007-2009, Stanford University
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*     * Redistributions of source code must retain the above copyright
+*       notice, this list of conditions and the following disclaimer.
+*     * Redistributions in binary form must reproduce the above copyright
+*       notice, this list of conditions and the following disclaimer in the
+*       documentation and/or other materials provided with the distribution.
+*     * Neither the name of Stanford University nor the names of its 
+*       contributors may be used to endorse or promote products derived from 
+*       this software without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY STANFORD UNIVERSITY ``AS IS'' AND ANY
+* EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL STANFORD UNIVERSITY BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/ 
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+
+#include "spill.h"
+#include "memory.h"
+#include "stddefines.h"
+
+#define SPILL_BUF_SIZE      (1024 * 1024)
+
+#define MIN(X,Y) ((X) < (Y) ? (X) : (Y))
+
+spill_t *spill_create (const char *dir, int num_runs)
+{
+    spill_t *spill;
+    char path[4096];
+
+    if (dir == NULL)
+        dir = getenv ("TMPDIR");
+    if (dir == NULL || *dir == '\0')
+        dir = "/tmp";
+
+    spill = (spill_t *)mem_calloc (1, sizeof (spill_t));
+    spill->num_runs = num_runs;
+    spill->bounds = (off_t *)mem_calloc (num_runs + 1, sizeof (off_t));
+    spill->buf = (char *)mem_malloc (SPILL_BUF_SIZE);
+
+    /* Gone from the directory right away, the space goes with the fd. */
+    snprintf (path, sizeof (path), "%s/phoenix-spill-XXXXXX", dir);
+    spill->fd = mkstemp (path);
+    CHECK_ERROR (spill->fd < 0);
+    unlink (path);
+
+    return spill;
+}
+
+/** spill_flush()
+ *  Writes out the buffer
+ */
+static void spill_flush (spill_t *spill)
+{
+    char *pos = spill->buf;
+    ssize_t ret;
+
+    while (spill->buf_len > 0)
+    {
+        ret = write (spill->fd, pos, spill->buf_len);
+        CHECK_ERROR (ret <= 0);
+        pos += ret;
+        spill->buf_len -= ret;
+    }
+}
+
+/** spill_put()
+ *  Appends LEN bytes at DATA to the file
+ */
+static inline void spill_put (spill_t *spill, const void *data, size_t len)
+{
+    size_t n;
+
+    while (len > 0)
+    {
+        if (spill->buf_len == SPILL_BUF_SIZE)
+            spill_flush (spill);
+
+        n = MIN (len, SPILL_BUF_SIZE - spill->buf_len);
+        mem_memcpy (spill->buf + spill->buf_len, data, n);
+        spill->buf_len += n;
+        spill->len += n;
+        data = (const char *)data + n;
+        len -= n;
+    }
+}
+
+void spill_write (spill_t *spill, keyvals_t *kv)
+{
+    spill_rec_t rec;
+    val_t hdr, *chunk;
+    int num_vals = 0;
+
+    assert (spill->curr_run < spill->num_runs);
+
+    /* One chunk with every value, in the order reduce would see them. */
+    mem_memset (&rec, 0, sizeof (rec));
+    rec.key = kv->key;
+    rec.key_len = kv->key_len;
+    rec.hash = kv->hash;
+    hdr.size = hdr.next_insert_pos = kv->len;
+    hdr.next_val = NULL;
+
+    spill_put (spill, &rec, sizeof (spill_rec_t));
+    spill_put (spill, &hdr, sizeof (val_t));
+    for (chunk = kv->vals; chunk != NULL; chunk = chunk->next_val)
+    {
+        spill_put (spill, chunk->array, 
+            chunk->next_insert_pos * sizeof (void *));
+        num_vals += chunk->next_insert_pos;
+    }
+
+    assert (num_vals == kv->len);
+}
+
+void spill_end_run (spill_t *spill)
+{
+    assert (spill->curr_run < spill->num_runs);
+
+    spill->bounds[++spill->curr_run] = spill->len;
+}
+
+void spill_finish (spill_t *spill)
+{
+    assert (spill->curr_run == spill->num_runs);
+
+    spill_flush (spill);
+    mem_free (spill->buf);
+    spill->buf = NULL;
+
+    if (spill->len > 0)
+    {
+        spill->base = mmap (NULL, spill->len, PROT_READ, MAP_PRIVATE, 
+            spill->fd, 0);
+        CHECK_ERROR (spill->base == MAP_FAILED);
+    }
+}
+
+void spill_drop_run (spill_t *spill, int i)
+{
+    uintptr_t begin, end;
+    long page_size = sysconf (_SC_PAGESIZE);
+
+    /* Only whole pages, the ones at the ends are shared with the 
+       neighbouring runs. */
+    begin = ((uintptr_t)spill->base + spill->bounds[i] + page_size - 1) & 
+        ~(uintptr_t)(page_size - 1);
+    end = ((uintptr_t)spill->base + spill->bounds[i + 1]) & 
+        ~(uintptr_t)(page_size - 1);
+
+    if (end > begin)
+        madvise ((void *)begin, end - begin, MADV_DONTNEED);
+}
+
+void spill_destroy (spill_t *spill)
+{
+    if (spill->base != NULL)
+        munmap (spill->base, spill->len);
+    if (spill->buf != NULL)
+        mem_free (spill->buf);
+    close (spill->fd);
+    mem_free (spill->bounds);
+    mem_free (spill);
+}
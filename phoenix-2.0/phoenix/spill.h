@@ -0,0 +1,119 @@
+/* Copyright (c) 2007-2009, Stanford University
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*     * Redistributions of source code must retain the above copyright
+*       notice, this list of conditions and the following disclaimer.
+*     * Redistributions in binary form must reproduce the above copyright
+*       notice, this list of conditions and the following disclaimer in the
+*       documentation and/or other materials provided with the distribution.
+*     * Neither the name of Stanford University nor the names of its 
+*       contributors may be used to endorse or promote products derived from 
+*       this software without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY STANFORD UNIVERSITY ``AS IS'' AND ANY
+* EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL STANFORD UNIVERSITY BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/ 
+
+#ifndef SPILL_H_
+#define SPILL_H_
+
+#include <sys/types.h>
+
+#include "struct.h"
+
+/* Sorted runs of the intermediate pairs of a map thread, one run per 
+   partition, written out to an unlinked temp file when the thread is over
+   its memory budget. A run is a sequence of records, each being a 
+   spill_rec_t followed by a val_t holding all the values of the key. Once 
+   written the file is mapped, so reduce iterates over the values in place.
+   Keys and values are the pointers the map function emitted; what they
+   point to stays in the application's memory. */
+typedef struct
+{
+    void        *key;
+    int         key_len;
+    unsigned int hash;
+} spill_rec_t;
+
+typedef struct spill spill_t;
+struct spill
+{
+    int         fd;
+    int         num_runs;
+    int         curr_run;           /* Run being written. */
+    off_t       *bounds;            /* Run i is [bounds[i], bounds[i+1]). */
+    char        *buf;               /* Write buffer, */
+    size_t      buf_len;            /* and the bytes in it. */
+    off_t       len;                /* Bytes written so far. */
+    char        *base;              /* Mapped file once written. */
+    spill_t     *next;              /* Next spill of the same thread. */
+};
+
+/* Creates an empty spill of num_runs runs in DIR, NULL for $TMPDIR or 
+   /tmp. */
+spill_t *spill_create (const char *dir, int num_runs);
+
+/* Appends the key and values of KV to the current run. */
+void spill_write (spill_t *spill, keyvals_t *kv);
+
+/* Ends the current run, the next write goes to the next one. */
+void spill_end_run (spill_t *spill);
+
+/* Flushes the last run and maps the file for reading. */
+void spill_finish (spill_t *spill);
+
+/* Gives back the pages of run I, once it has been read. */
+void spill_drop_run (spill_t *spill, int i);
+
+void spill_destroy (spill_t *spill);
+
+/* Sets POS and END to the records of run I. */
+static inline void 
+spill_run (spill_t *spill, int i, char **pos, char **end)
+{
+    *pos = spill->base + spill->bounds[i];
+    *end = spill->base + spill->bounds[i + 1];
+}
+
+/* Key of the record at POS. */
+static inline void *spill_key (char *pos)
+{
+    return ((spill_rec_t *)pos)->key;
+}
+
+/* Size of the key of the record at POS. */
+static inline int spill_key_len (char *pos)
+{
+    return ((spill_rec_t *)pos)->key_len;
+}
+
+/* Hash of the key of the record at POS. */
+static inline unsigned int spill_key_hash (char *pos)
+{
+    return ((spill_rec_t *)pos)->hash;
+}
+
+/* Points KV at the record at POS and returns the next record. */
+static inline char *spill_read (char *pos, keyvals_t *kv)
+{
+    kv->key = ((spill_rec_t *)pos)->key;
+    kv->key_len = ((spill_rec_t *)pos)->key_len;
+    kv->hash = ((spill_rec_t *)pos)->hash;
+    kv->vals = (val_t *)(pos + sizeof (spill_rec_t));
+    kv->len = kv->vals->size;
+
+    return pos + sizeof (spill_rec_t) + sizeof (val_t) + 
+        kv->len * sizeof (void *);
+}
+
+#endif /* SPILL_H_ */
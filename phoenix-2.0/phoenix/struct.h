@@ -39,6 +39,9 @@ typedef struct _val_t
 typedef struct
 {
     int len;
+    int key_len;            /* key_size as given to emit_intermediate(). */
+    unsigned int hash;      /* Of the key, if the job has a hash, see 
+                               key_hashes in map_reduce.c. */
     void *key;
     val_t *vals;
 } keyvals_t;
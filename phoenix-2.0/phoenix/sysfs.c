@@ -0,0 +1,152 @@
+/* Copyright (c) 2007-2009, Stanford University
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*     * Redistributions of source code must retain the above copyright
+*       notice, this list of conditions and the following disclaimer.
+*     * Redistributions in binary form must reproduce the above copyright
+*       notice, this list of conditions and the following disclaimer in the
+*       documentation and/or other materials provided with the distribution.
+*     * Neither the name of Stanford University nor the names of its 
+*       contributors may be used to endorse or promote products derived from 
+*       this software without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY STANFORD UNIVERSITY ``AS IS'' AND ANY
+* EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL STANFORD UNIVERSITY BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/ 
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <ctype.h>
+
+#include "sysfs.h"
+
+#define SYSFS_PATH_LEN  512
+
+static int sysfs_vpath (
+    char *buf, size_t len, const char *fmt, va_list ap)
+{
+    int root_len, ret;
+
+    root_len = snprintf (buf, len, "%s/", sysfs_root ());
+    if (root_len < 0 || root_len >= len)
+        return -1;
+
+    ret = vsnprintf (buf + root_len, len - root_len, fmt, ap);
+    if (ret < 0 || ret >= len - root_len)
+        return -1;
+
+    return 0;
+}
+
+static int sysfs_vread_str (
+    char *buf, size_t len, const char *fmt, va_list ap)
+{
+    char path[SYSFS_PATH_LEN];
+    FILE *fp;
+    char *nl;
+
+    if (sysfs_vpath (path, sizeof (path), fmt, ap) < 0)
+        return -1;
+
+    if ((fp = fopen (path, "r")) == NULL)
+        return -1;
+
+    if (fgets (buf, len, fp) == NULL)
+    {
+        fclose (fp);
+        return -1;
+    }
+    fclose (fp);
+
+    if ((nl = strchr (buf, '\n')) != NULL)
+        *nl = '\0';
+
+    return 0;
+}
+
+const char *sysfs_root (void)
+{
+    const char *root = getenv ("MAPRED_SYSFS_ROOT");
+
+    return (root != NULL && *root != '\0') ? root : "/sys";
+}
+
+int sysfs_path (char *buf, size_t len, const char *fmt, ...)
+{
+    va_list ap;
+    int ret;
+
+    va_start (ap, fmt);
+    ret = sysfs_vpath (buf, len, fmt, ap);
+    va_end (ap);
+
+    return ret;
+}
+
+int sysfs_read_str (char *buf, size_t len, const char *fmt, ...)
+{
+    va_list ap;
+    int ret;
+
+    va_start (ap, fmt);
+    ret = sysfs_vread_str (buf, len, fmt, ap);
+    va_end (ap);
+
+    return ret;
+}
+
+int sysfs_read_int (int *val, const char *fmt, ...)
+{
+    char buf[64];
+    char *end;
+    va_list ap;
+    int ret;
+
+    va_start (ap, fmt);
+    ret = sysfs_vread_str (buf, sizeof (buf), fmt, ap);
+    va_end (ap);
+
+    if (ret < 0)
+        return -1;
+
+    *val = (int)strtol (buf, &end, 0);
+    if (end == buf)
+        return -1;
+
+    return 0;
+}
+
+int sysfs_next_range (const char **list, int *first, int *last)
+{
+    const char *p = *list;
+    char *end;
+
+    while (*p == ',' || isspace ((unsigned char)*p))
+        p++;
+
+    if (!isdigit ((unsigned char)*p))
+        return 0;
+
+    *first = *last = (int)strtol (p, &end, 10);
+    p = end;
+    if (*p == '-')
+    {
+        *last = (int)strtol (p + 1, &end, 10);
+        p = end;
+    }
+
+    *list = p;
+    return 1;
+}
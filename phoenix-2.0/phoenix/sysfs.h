@@ -0,0 +1,52 @@
+/* Copyright (c) 2007-2009, Stanford University
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*     * Redistributions of source code must retain the above copyright
+*       notice, this list of conditions and the following disclaimer.
+*     * Redistributions in binary form must reproduce the above copyright
+*       notice, this list of conditions and the following disclaimer in the
+*       documentation and/or other materials provided with the distribution.
+*     * Neither the name of Stanford University nor the names of its 
+*       contributors may be used to endorse or promote products derived from 
+*       this software without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY STANFORD UNIVERSITY ``AS IS'' AND ANY
+* EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL STANFORD UNIVERSITY BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/ 
+
+#ifndef SYSFS_H_
+#define SYSFS_H_
+
+#include <stddef.h>
+
+/* Root of the sysfs tree, MAPRED_SYSFS_ROOT or /sys. */
+const char *sysfs_root (void);
+
+/* Format a path below the sysfs root into BUF.
+   Returns 0 if successful, -1 if it does not fit. */
+int sysfs_path (char *buf, size_t len, const char *fmt, ...);
+
+/* Read the first line of a sysfs file, without the newline.
+   Returns 0 if successful, -1 if the file cannot be read. */
+int sysfs_read_str (char *buf, size_t len, const char *fmt, ...);
+
+/* Read a sysfs file holding a single integer.
+   Returns 0 if successful, -1 otherwise. */
+int sysfs_read_int (int *val, const char *fmt, ...);
+
+/* Walk a cpu list such as "0-3,8,10-11". Each call stores the next 
+   range in FIRST and LAST and advances LIST past it.
+   Returns 1 if a range was found, 0 at the end of the list. */
+int sysfs_next_range (const char **list, int *first, int *last);
+
+#endif /* SYSFS_H_ */
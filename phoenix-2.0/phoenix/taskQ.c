@@ -30,419 +30,450 @@
 #include <inttypes.h>
 #include <string.h>
 
+#include "atomic.h"
+#include "trace.h"
 #include "memory.h"
 #include "taskQ.h"
-#include "queue.h"
-#include "synch.h"
 #include "locality.h"
+#include "stddefines.h"
 
-static int num_strands_per_chip = 0;
+#define TQ_INITIAL_RING_LEN     64
+#define TQ_CACHE_LINE_SIZE      64
 
-typedef struct {
-    task_t              task; 
-    queue_elem_t        queue_elem;
-} tq_entry_t;
+/* Circular array of tasks backing a deque. LEN is a power of two. */
+typedef struct tq_ring_t {
+    intptr_t            len;
+    struct tq_ring_t    *retired;   /* Smaller rings this one replaced. */
+    task_t              buf[];
+} tq_ring_t;
 
+/* Chase-Lev work-stealing deque, one per worker thread.
+   The owner pushes and takes at BOTTOM, thieves steal at TOP. */
 typedef struct {
-    mr_lock_t  parent;
-    uintptr_t  chksum;
-    mr_lock_t  *per_thread;
-} tq_lock_t;
+    union {
+        struct {
+            volatile intptr_t   top;
+        };
+        char pad_top[TQ_CACHE_LINE_SIZE];
+    };
+    union {
+        struct {
+            volatile intptr_t   bottom;
+            tq_ring_t * volatile ring;
+            int                 lgrp;
+        };
+        char pad_bottom[TQ_CACHE_LINE_SIZE];
+    };
+} tq_deque_t;
 
 struct taskQ_t {
-    int             num_queues;
-    int             num_threads;
-    queue_t         **queues;
-    queue_t         **free_queues;
-    tq_lock_t       *locks;
-    /* putting all seeds together may lead to extra coherence traffic among cpus
-     * if it's a problem we can pad it by l1 line size */
-    /* per-thread random seed */
-    unsigned int    *seeds;
+    int             num_threads;    /* # of deques in use this phase. */
+    int             alloc_threads;  /* # of deques allocated. */
+    int             num_lgrps;
+    unsigned int    enqueue_pos;    /* Round-robin position for _seq. */
+    tq_deque_t      *deques;
+    int             *lgrp_deques;   /* Deque indices by locality group, */
+    int             *lgrp_first;    /* those of group G from [G] to [G+1]. */
  };
 
-typedef int (*dequeue_fn)(taskQ_t *, int, int, queue_elem_t**);
-
-static inline taskQ_t* tq_init_normal(int numThreads);
-static inline void tq_finalize_normal(taskQ_t* tq);
-static inline int tq_dequeue_normal(
-    taskQ_t* tq, task_t* task, int lgrp, int tid);
-static inline int tq_dequeue_normal_seq (
-    taskQ_t* tq, task_t* task, int lgrp, int tid);
-static inline int tq_dequeue_normal_internal (
-    taskQ_t* tq, task_t* task, int lgrp, int tid, dequeue_fn dequeue_fn);
-
-static queue_t* tq_alloc_queue(void);
-static void tq_free_queue(queue_t* q);
-static int tq_queue_init(taskQ_t* tq, unsigned int idx);
-static void tq_queue_destroy(taskQ_t* tq, unsigned int idx);
-static void tq_empty_queue(queue_t* q);
+/* Outcome of a steal attempt. */
+enum {
+    TQ_EMPTY = 0,
+    TQ_SUCCESS,
+    TQ_ABORT
+};
+
+static tq_ring_t* tq_ring_alloc (intptr_t len);
+static void tq_ring_free (tq_ring_t* ring);
+static tq_ring_t* tq_ring_grow (tq_deque_t* dq, intptr_t bottom, intptr_t top);
+static int tq_deques_init (taskQ_t* tq, int first, int last);
+static void tq_assign_lgrps (taskQ_t* tq, const int *lgrps);
+static void tq_push (tq_deque_t* dq, task_t* task);
+static int tq_take (tq_deque_t* dq, task_t* task);
+static int tq_steal (tq_deque_t* dq, task_t* task);
 
 taskQ_t* tq_init (int num_threads)
 {
-    return tq_init_normal(num_threads);
-}
-
-void tq_reset (taskQ_t* tq, int num_threads)
-{
-}
-
-/**
- * Initialize task queue for a normal machine
- */
-static inline taskQ_t* tq_init_normal(int numThreads)
-{
-    int             i;
     taskQ_t         *tq = NULL;
 
-    tq = mem_calloc(1, sizeof(taskQ_t));
+    assert (num_threads > 0);
+
+    tq = mem_calloc (1, sizeof (taskQ_t));
     if (tq == NULL) {
         return NULL;
     }
 
-    /* XXX should this be local? */
-    num_strands_per_chip = loc_get_lgrp_size ();
-    tq->num_threads = numThreads;
-    tq->num_queues = tq->num_threads / num_strands_per_chip;
-
-    if (tq->num_queues == 0)
-        tq->num_queues = 1;
+    tq->deques = (tq_deque_t *)mem_calloc (num_threads, sizeof (tq_deque_t));
+    if (tq->deques == NULL) goto fail_deques;
 
-    tq->queues = (queue_t **)mem_calloc (tq->num_queues, sizeof (queue_t *));
-    if (tq->queues == NULL) goto fail_queues;
+    tq->alloc_threads = num_threads;
+    tq->num_threads = num_threads;
 
-    tq->free_queues = (queue_t **)mem_calloc (
-        tq->num_queues, sizeof (queue_t *));
-    if (tq->free_queues == NULL) goto fail_free_queues;
+    tq->num_lgrps = loc_get_num_lgrps ();
+    if (tq->num_lgrps <= 0)
+        tq->num_lgrps = 1;
+    tq->lgrp_deques = (int *)mem_malloc (num_threads * sizeof (int));
+    tq->lgrp_first = (int *)mem_malloc ((tq->num_lgrps + 1) * sizeof (int));
 
-    tq->locks = (tq_lock_t *)mem_calloc (tq->num_queues, sizeof (tq_lock_t));
-    if (tq->locks == NULL) goto fail_locks;
+    if (!tq_deques_init (tq, 0, num_threads))
+        goto fail_rings;
 
-    tq->seeds = (unsigned int*)mem_calloc(
-        tq->num_threads, sizeof(unsigned int));
-    if (tq->seeds == NULL) goto fail_seeds;
-    mem_memset(tq->seeds, 0, sizeof(unsigned int) * tq->num_threads);
-
-    for (i = 0; i < tq->num_queues; ++i)
-        if (!tq_queue_init(tq, i))
-            goto fail_tq_init;
+    tq_assign_lgrps (tq, NULL);
 
     return tq;
 
-fail_tq_init:
-    /* destroy all queues that have been allocated */
-    i--;
-    while (i >= 0) {
-        tq_queue_destroy(tq, i);
-        --i;
-    }
-    mem_free(tq->seeds);
-fail_seeds:
-    mem_free(tq->locks);
-fail_locks:
-    mem_free(tq->free_queues);
-fail_free_queues:
-    mem_free(tq->queues);
-fail_queues:
-    mem_free(tq);
+fail_rings:
+    mem_free (tq->lgrp_first);
+    mem_free (tq->lgrp_deques);
+    mem_free (tq->deques);
+fail_deques:
+    mem_free (tq);
     return NULL;
 }
 
 /**
- * Destroys an initialized queue (i.e. free queue and alloc queue) in task queue
- * @param tq    tq to index
- * @param idx   index of queue to destroy in tq
+ * Prepare the queue for a new phase run by NUM_THREADS workers, worker I
+ * running on locality group LGRPS[I], or all on group 0 if LGRPS is NULL.
+ * All deques must have been drained. Rings keep the size they grew to.
  */
-static void tq_queue_destroy(taskQ_t* tq, unsigned int idx)
+void tq_reset (taskQ_t* tq, int num_threads, const int *lgrps)
 {
-    int             j;
-    uintptr_t       chksum;
+    int             i;
 
-    assert (idx < tq->num_queues);
+    assert (tq != NULL);
+    assert (num_threads > 0);
+
+    if (num_threads > tq->alloc_threads) {
+        tq->deques = (tq_deque_t *)mem_realloc (
+            tq->deques, num_threads * sizeof (tq_deque_t));
+        CHECK_ERROR (!tq_deques_init (tq, tq->alloc_threads, num_threads));
+        tq->lgrp_deques = (int *)mem_realloc (
+            tq->lgrp_deques, num_threads * sizeof (int));
+        tq->alloc_threads = num_threads;
+    }
 
-    tq_empty_queue(tq->queues[idx]);
-    tq_free_queue(tq->queues[idx]);
+    for (i = 0; i < tq->alloc_threads; ++i) {
+        tq_deque_t  *dq = &tq->deques[i];
 
-    tq_empty_queue(tq->free_queues[idx]);
-    tq_free_queue(tq->free_queues[idx]);
+        assert (dq->top >= dq->bottom);
 
-    /* free all lock data associated with queue */
-    chksum = 0;
-    for (j = 0; j < tq->num_threads; j++) {
-        chksum += (uintptr_t)tq->locks[idx].per_thread[j];
-        lock_free_per_thread(tq->locks[idx].per_thread[j]);
+        tq_ring_free (dq->ring->retired);
+        dq->ring->retired = NULL;
+        dq->top = 0;
+        dq->bottom = 0;
     }
 
-    lock_free (tq->locks[idx].parent);
-
-    mem_free (tq->locks[idx].per_thread);
-    tq->locks[idx].per_thread = NULL;
+    tq->num_threads = num_threads;
+    tq->enqueue_pos = 0;
+    tq_assign_lgrps (tq, lgrps);
 }
 
-/**
- * Initialize a queue for a given index in the task queue
- * @return zero on failure, nonzero on success
- */
-static int tq_queue_init(taskQ_t* tq, unsigned int idx)
+void tq_finalize (taskQ_t* tq)
 {
-    int     j;
-
-    assert (idx < tq->num_queues);
-
-    tq->queues[idx] = tq_alloc_queue();
-    if (tq->queues[idx] == NULL) return 0;
-
-    tq->free_queues[idx] = tq_alloc_queue();
-    if (tq->free_queues[idx] == NULL) goto fail_free_queue;
-
-    tq->locks[idx].parent = lock_alloc();
+    int i;
 
-    tq->locks[idx].per_thread = (mr_lock_t *)mem_calloc(
-        tq->num_threads, sizeof(mr_lock_t));
-    if (tq->locks[idx].per_thread == NULL) goto fail_priv_alloc;
+    assert (tq != NULL);
+    assert (tq->deques != NULL);
 
-    tq->locks[idx].chksum = 0;
-    for (j = 0; j < tq->num_threads; ++j) {
-        mr_lock_t   per_thread;
-        per_thread = lock_alloc_per_thread(tq->locks[idx].parent);
-        tq->locks[idx].per_thread[j] = per_thread;
-        tq->locks[idx].chksum += (uintptr_t)per_thread;
+    for (i = 0; i < tq->alloc_threads; ++i) {
+        tq_ring_free (tq->deques[i].ring);
     }
 
-    return 1;
+    mem_free (tq->lgrp_first);
+    mem_free (tq->lgrp_deques);
+    mem_free (tq->deques);
+    mem_free (tq);
+}
 
-fail_priv_alloc:
-    lock_free(&tq->locks[idx].parent);
-    tq_free_queue(tq->free_queues[idx]);
-    tq->free_queues[idx] = NULL;
-fail_free_queue:
-    tq_free_queue(tq->queues[idx]);
-    tq->queues[idx] = NULL;
+/* Queue TASK on the deque of worker TID. Must be called by TID itself,
+   since only the owner may push onto a deque once workers are running.
+   LGRP is accepted for compatibility and ignored. */
+int tq_enqueue (taskQ_t* tq, task_t *task, int lgrp, int tid)
+{
+    assert (tq != NULL);
+    assert (task != NULL);
+    assert (tid >= 0 && tid < tq->num_threads);
+
+    tq_push (&tq->deques[tid], task);
 
     return 0;
 }
 
-/**
- * Allocates an initialized queue
- * @return NULL on failure, initialized queue pointer on success
- */
-static queue_t* tq_alloc_queue(void)
+/* Queue TASK on a deque of locality group LGRP without synchronization.
+   Only valid while no worker is running. Tasks of the same locality group
+   are dealt round-robin over the deques of the workers running there. If
+   LGRP is less than 0, or no worker runs there, all deques are used. */
+int tq_enqueue_seq (taskQ_t* tq, task_t *task, int lgrp)
 {
-    queue_t *q;
+    int             first, count;
 
-    q = (queue_t*) mem_malloc (sizeof(queue_t));
-    if (q == NULL) {
-        return NULL;
+    assert (tq != NULL);
+    assert (task != NULL);
+
+    count = 0;
+    if (lgrp >= 0) {
+        lgrp %= tq->num_lgrps;
+        first = tq->lgrp_first[lgrp];
+        count = tq->lgrp_first[lgrp + 1] - first;
     }
 
-    queue_init(q);
+    if (count == 0) {
+        tq_push (&tq->deques[tq->enqueue_pos++ % tq->num_threads], task);
+    } else {
+        tq_push (&tq->deques[tq->lgrp_deques[
+            first + tq->enqueue_pos++ % count]], task);
+    }
 
-    return q;
+    return 0;
 }
 
-/**
- * Frees an initialized queue that was allocated on the heap.
- */
-static void tq_free_queue(queue_t* q)
+/* Get a task for worker TID, running on locality group LGRP.
+   Takes from the worker's own deque first, then steals from the other
+   deques of LGRP, then from everybody else.
+   Returns 1 if TASK was filled in, 0 if every deque is empty. */
+int tq_dequeue (taskQ_t* tq, task_t *task, int lgrp, int tid)
 {
-    mem_free(q);
-}
+    int             i, victim, ret, aborted;
+    int             num_threads;
 
-/**
- * Empties out a queue in the task queue by dequeuing and freeing
- * every task.
- */
-static void tq_empty_queue(queue_t* q)
-{
+    assert (tq != NULL);
+    assert (task != NULL);
+    assert (tid >= 0 && tid < tq->num_threads);
+
+    if (tq_take (&tq->deques[tid], task))
+        return 1;
+
+    num_threads = tq->num_threads;
+    if (lgrp < 0)
+        lgrp = tq->deques[tid].lgrp;
+    else
+        lgrp %= tq->num_lgrps;
+
+    /* Keep sweeping while some steal lost a race, there may be work left. */
     do {
-        tq_entry_t      *entry;
-        queue_elem_t    *queue_elem;
+        aborted = 0;
+
+        /* Local locality group first. */
+        for (i = 1; i < num_threads; ++i) {
+            victim = (tid + i) % num_threads;
+            if (tq->deques[victim].lgrp != lgrp)
+                continue;
+
+            ret = tq_steal (&tq->deques[victim], task);
+            if (ret == TQ_SUCCESS) {
+                TRACE_INSTANT (TRACE_STEAL, victim);
+                return 1;
+            }
+            if (ret == TQ_ABORT) aborted = 1;
+        }
+
+        for (i = 1; i < num_threads; ++i) {
+            victim = (tid + i) % num_threads;
+            if (tq->deques[victim].lgrp == lgrp)
+                continue;
+
+            ret = tq_steal (&tq->deques[victim], task);
+            if (ret == TQ_SUCCESS) {
+                TRACE_INSTANT (TRACE_STEAL, victim);
+                return 1;
+            }
+            if (ret == TQ_ABORT) aborted = 1;
+        }
+    } while (aborted);
 
-        if (queue_pop_front (q, &queue_elem) == 0)
-            break;
+    mem_memset (task, 0, sizeof (task_t));
 
-        entry = queue_entry (queue_elem, tq_entry_t, queue_elem);
-        assert (entry != NULL);
-        mem_free (entry);
-    } while (1);
+    return 0;
 }
 
-static inline void tq_finalize_normal(taskQ_t* tq)
+/**
+ * Allocate deque rings for deque indices [FIRST, LAST)
+ * @return zero on failure, nonzero on success
+ */
+static int tq_deques_init (taskQ_t* tq, int first, int last)
 {
-    int i;
+    int             i;
 
-    assert (tq->queues != NULL);
-    assert (tq->free_queues != NULL);
-    assert (tq->locks != NULL);
+    for (i = first; i < last; ++i) {
+        tq_deque_t  *dq = &tq->deques[i];
 
-    /* destroy all queues */
-    for (i = 0; i < tq->num_queues; ++i) {
-        tq_queue_destroy(tq, i);
+        mem_memset (dq, 0, sizeof (tq_deque_t));
+        dq->ring = tq_ring_alloc (TQ_INITIAL_RING_LEN);
+        if (dq->ring == NULL)
+            goto fail_ring;
     }
 
-    /* destroy all first level pointers in tq */
-    mem_free (tq->queues);
-    mem_free (tq->free_queues);
-    mem_free (tq->locks);
-    mem_free (tq->seeds);
-
-    /* finally kill tq */
-    mem_free (tq);
-}
+    return 1;
 
-void tq_finalize (taskQ_t* tq)
-{
-    tq_finalize_normal(tq);
+fail_ring:
+    while (--i >= first) {
+        tq_ring_free (tq->deques[i].ring);
+    }
+    return 0;
 }
 
-/* Queue TASK at LGRP task queue with locking.
-   LGRP is a locality hint denoting to which locality group this task 
-   should be queued at. If LGRP is less than 0, the locality group is 
-   randomly selected. TID is required for MCS locking. */
-int tq_enqueue (taskQ_t* tq, task_t *task, int lgrp, int tid)
+/**
+ * Give each deque the locality group of its worker, as bound by the 
+ * scheduler, and list the deques of each group for tq_enqueue_seq().
+ */
+static void tq_assign_lgrps (taskQ_t* tq, const int *lgrps)
 {
-    tq_entry_t      *entry;
-    int             index;
-
-    assert (tq != NULL);
-    assert (task != NULL);
+    int             i, lgrp;
 
-    entry = (tq_entry_t *)mem_malloc (sizeof (tq_entry_t));
-    if (entry == NULL) {
-        return -1;
+    for (lgrp = 0; lgrp < tq->num_lgrps; ++lgrp) {
+        tq->lgrp_first[lgrp] = 0;
     }
 
-    mem_memcpy (&entry->task, task, sizeof (task_t));
-
-    index = (lgrp < 0) ? rand_r(&tq->seeds[tid]) : lgrp;
-    index %= tq->num_queues;
+    for (i = 0; i < tq->num_threads; ++i) {
+        lgrp = (lgrps != NULL) ? lgrps[i] : 0;
+        if (lgrp < 0 || lgrp >= tq->num_lgrps)
+            lgrp = 0;
+        tq->deques[i].lgrp = lgrp;
+        tq->lgrp_first[lgrp]++;
+    }
 
-    lock_acquire (tq->locks[index].per_thread[tid]);
-    queue_push_back (tq->queues[index], &entry->queue_elem);
-    lock_release (tq->locks[index].per_thread[tid]);
+    for (lgrp = 1; lgrp < tq->num_lgrps; ++lgrp) {
+        tq->lgrp_first[lgrp] += tq->lgrp_first[lgrp - 1];
+    }
+    tq->lgrp_first[tq->num_lgrps] = tq->num_threads;
 
-    return 0;
+    /* Counting sort, workers of a group keep their order. */
+    for (i = tq->num_threads - 1; i >= 0; --i) {
+        tq->lgrp_deques[--tq->lgrp_first[tq->deques[i].lgrp]] = i;
+    }
 }
 
-/* Queue TASK at LGRP task queue without locking.
-   LGRP is a locality hint denoting to which locality group this task
-   should be queued at. If LGRP is less than 0, the locality group is
-   randomly selected. */
-int tq_enqueue_seq (taskQ_t* tq, task_t *task, int lgrp)
+static tq_ring_t* tq_ring_alloc (intptr_t len)
 {
-    tq_entry_t      *entry;
-    int             index;
+    tq_ring_t       *ring;
 
-    assert (task != NULL);
+    assert ((len & (len - 1)) == 0);
 
-    entry = (tq_entry_t *)mem_malloc (sizeof (tq_entry_t));
-    if (entry == NULL) {
-        return -1;
+    ring = (tq_ring_t *)mem_malloc (sizeof (tq_ring_t) + len * sizeof (task_t));
+    if (ring == NULL) {
+        return NULL;
     }
 
-    mem_memcpy (&entry->task, task, sizeof (task_t));
-
-    index = (lgrp < 0) ? rand() % tq->num_queues : lgrp % tq->num_queues;
-    queue_push_back (tq->queues[index], &entry->queue_elem);
+    ring->len = len;
+    ring->retired = NULL;
 
-    return 0;
+    return ring;
 }
 
 /**
- * Safely dequeues an element from the normal queue and queues onto free queue
- * @param tq        taskQ to operate on
- * @param idx       index of queue to use
- * @param tid       task id
- * @param qe        queue element of element we operated on
- * @return nonzero if normal queue was empty
+ * Free RING along with all the rings it replaced.
  */
-static inline int tq_elem_into_free_seq (
-    taskQ_t* tq, int idx, int tid, queue_elem_t** qe)
+static void tq_ring_free (tq_ring_t* ring)
 {
-    queue_elem_t    *queue_elem = NULL;
-    int             ret;
-
-    ret = queue_pop_front (tq->queues[idx], &queue_elem);
-    if (ret != 0)
-        queue_push_back (tq->free_queues[idx], queue_elem);
+    tq_ring_t       *next;
 
-    *qe = queue_elem;
-
-    return ret;
+    while (ring != NULL) {
+        next = ring->retired;
+        mem_free (ring);
+        ring = next;
+    }
 }
 
 /**
- * Safely dequeues an element from the normal queue and queues onto free queue
- * @param tq        taskQ to operate on
- * @param idx       index of queue to use
- * @param tid       task id
- * @param qe        queue element of element we operated on
- * @return nonzero if normal queue was empty
+ * Double the ring of DQ, copying over tasks in [TOP, BOTTOM).
+ * The old ring is kept around since thieves may still be reading it.
  */
-static inline int tq_elem_into_free (
-    taskQ_t* tq, int idx, int tid, queue_elem_t** qe)
+static tq_ring_t* tq_ring_grow (tq_deque_t* dq, intptr_t bottom, intptr_t top)
 {
-    int             ret;
+    tq_ring_t       *old_ring = dq->ring;
+    tq_ring_t       *new_ring;
+    intptr_t        i;
 
-    lock_acquire (tq->locks[idx].per_thread[tid]);
-    ret = tq_elem_into_free_seq (tq, idx, tid, qe);
-    lock_release (tq->locks[idx].per_thread[tid]);
+    new_ring = tq_ring_alloc (old_ring->len * 2);
+    CHECK_ERROR (new_ring == NULL);
 
-    return ret;
-}
+    for (i = top; i < bottom; ++i) {
+        new_ring->buf[i & (new_ring->len - 1)] = 
+            old_ring->buf[i & (old_ring->len - 1)];
+    }
+    new_ring->retired = old_ring;
 
-static inline int tq_dequeue_normal_seq (
-    taskQ_t* tq, task_t* task, int lgrp, int tid)
-{
-    return tq_dequeue_normal_internal (
-        tq, task, lgrp, tid, tq_elem_into_free_seq);
+    mem_barrier ();
+    dq->ring = new_ring;
+
+    return new_ring;
 }
 
-static inline int tq_dequeue_normal(
-    taskQ_t* tq, task_t* task, int lgrp, int tid)
+/* Owner only. */
+static void tq_push (tq_deque_t* dq, task_t* task)
 {
-    return tq_dequeue_normal_internal (
-        tq, task, lgrp, tid, tq_elem_into_free);
+    intptr_t        bottom, top;
+    tq_ring_t       *ring;
+
+    bottom = dq->bottom;
+    top = dq->top;
+    ring = dq->ring;
+
+    if (bottom - top >= ring->len) {
+        ring = tq_ring_grow (dq, bottom, top);
+    }
+
+    ring->buf[bottom & (ring->len - 1)] = *task;
+
+    /* Publish the task before the new bottom. */
+    mem_barrier ();
+    dq->bottom = bottom + 1;
 }
 
-static inline int tq_dequeue_normal_internal (
-    taskQ_t* tq, task_t* task, int lgrp, int tid, dequeue_fn dequeue_fn)
+/* Owner only.
+   Returns 1 if TASK was filled in, 0 if the deque is empty. */
+static int tq_take (tq_deque_t* dq, task_t* task)
 {
-    int             i, ret, index;
-    queue_elem_t    *queue_elem;
-    tq_entry_t      *entry;
-
-    assert (task != NULL);
+    intptr_t        bottom, top;
+    tq_ring_t       *ring;
+    int             ret = 1;
 
-    mem_memset (task, 0, sizeof (task_t));
+    bottom = dq->bottom - 1;
+    ring = dq->ring;
+    dq->bottom = bottom;
 
-    index = (lgrp < 0) ? rand_r(&tq->seeds[tid]) : lgrp;
-    index %= tq->num_queues;
-    ret = (*dequeue_fn)(tq, index, tid, &queue_elem);
-
-   /* Do task stealing if nothing on our queue.
-      Cycle through all indexes until success or exhaustion */
-    for (i = (index + 1) % tq->num_queues;
-        (ret == 0) && (i != index);
-        i = (i + 1) % tq->num_queues)
-    {
-        ret = (*dequeue_fn)(tq, i, tid, &queue_elem);
-    }
+    /* The new bottom must be visible before we look at top. */
+    mem_barrier ();
+    top = dq->top;
 
-    if (ret == 0) {
-        /* There really is no more work. */
+    if (top > bottom) {
+        /* Empty. */
+        dq->bottom = bottom + 1;
         return 0;
     }
 
-    entry = queue_entry (queue_elem, tq_entry_t, queue_elem);
-    assert (entry != NULL);
+    *task = ring->buf[bottom & (ring->len - 1)];
 
-    mem_memcpy (task, &entry->task, sizeof (task_t));
+    if (top == bottom) {
+        /* Last task, race against thieves for it. */
+        if (!cmp_and_swp (top + 1, (uintptr_t *)&dq->top, top))
+            ret = 0;
+        dq->bottom = bottom + 1;
+    }
 
-    return 1;
+    return ret;
 }
 
-int tq_dequeue (taskQ_t* tq, task_t *task, int lgrp, int tid)
+/* Any thread.
+   Returns TQ_SUCCESS if TASK was filled in, TQ_EMPTY if the deque is empty
+   and TQ_ABORT if another thread took the task first. */
+static int tq_steal (tq_deque_t* dq, task_t* task)
 {
-    return tq_dequeue_normal(tq, task, lgrp, tid);
+    intptr_t        bottom, top;
+    tq_ring_t       *ring;
+
+    top = dq->top;
+    mem_barrier ();
+    bottom = dq->bottom;
+
+    if (top >= bottom)
+        return TQ_EMPTY;
+
+    ring = dq->ring;
+    *task = ring->buf[top & (ring->len - 1)];
+
+    if (!cmp_and_swp (top + 1, (uintptr_t *)&dq->top, top))
+        return TQ_ABORT;
+
+    return TQ_SUCCESS;
 }
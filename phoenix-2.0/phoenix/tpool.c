@@ -24,45 +24,130 @@
 * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */ 
 
+#ifdef _LINUX_
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
 #include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
 #include <assert.h>
-#include <semaphore.h>
 
 #include "atomic.h"
 #include "memory.h"
 #include "tpool.h"
 #include "stddefines.h"
 
+#define TP_CACHE_LINE_SIZE      64
+
+/* Polls of a wait word before the waiter parks in the kernel. */
+#define TP_SPIN_POLLS           (1 << 14)
+
+/* Pool threads wake each other in a tree of this fan-out, so that no
+   single thread pays for all the wakeups. */
+#define TP_FANOUT               2
+
+/* Wait word a thread can spin on, then park on. */
 typedef struct {
-    sem_t           sem_run;
-    unsigned int    *num_workers_done;
-    sem_t           *sem_all_workers_done;
-    thread_func     *thread_func;
-    void            **thread_func_arg;
-    void            **ret;
-    int             *num_workers;
-    int             *die;
+    volatile unsigned int   val;
+    volatile unsigned int   parked;     /* Is the waiter in the kernel? */
+} tp_word_t;
+
+typedef struct {
+    union {
+        struct {
+            tp_word_t       run;        /* Bumped to start a phase. */
+            void            *arg;
+            tpool_t         *tpool;
+            int             index;
+        };
+        char pad[TP_CACHE_LINE_SIZE];
+    };
 } thread_arg_t;
 
 struct tpool_t {
     int             num_threads;
     int             num_workers;
     int             die;
+    int             spin_polls;
+    unsigned int    done_seen;          /* done.val when the phase began. */
     thread_func     thread_func;
-    sem_t           sem_all_workers_done;
-    unsigned int    num_workers_done;
-    void            **args;
+    void            **rets;             /* Result of each thread. */
     pthread_t       *threads;
     thread_arg_t    *thread_args;
+    union {
+        struct {
+            unsigned int    num_workers_done;
+            tp_word_t       done;       /* Bumped when a phase is over. */
+        };
+        char pad[TP_CACHE_LINE_SIZE];
+    };
 };
 
 static void* thread_loop (void *);
 
+/** tp_park()
+ *  Blocks the caller while WORD still holds VAL, or may return early
+ */
+static inline void tp_park (tp_word_t *word, unsigned int val)
+{
+#ifdef _LINUX_
+    syscall (SYS_futex, &word->val, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+#else
+    sched_yield ();
+#endif
+}
+
+/** tp_unpark()
+ *  Wakes the waiter of WORD
+ */
+static inline void tp_unpark (tp_word_t *word)
+{
+#ifdef _LINUX_
+    syscall (SYS_futex, &word->val, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+#endif
+}
+
+/** tp_wait()
+ *  Waits until WORD no longer holds VAL, spinning for a while before
+ *  parking
+ */
+static void tp_wait (tp_word_t *word, unsigned int val, int spin_polls)
+{
+    int i;
+
+    for (i = 0; i < spin_polls && word->val == val; ++i)
+        cpu_relax ();
+
+    while (word->val == val)
+    {
+        word->parked = 1;
+        mem_barrier ();
+        if (word->val == val)
+            tp_park (word, val);
+        word->parked = 0;
+    }
+
+    /* Whatever the signaller wrote before is visible from here on. */
+    mem_barrier ();
+}
+
+/** tp_signal()
+ *  Bumps WORD and wakes its waiter if it went to sleep
+ */
+static void tp_signal (tp_word_t *word)
+{
+    mem_barrier ();
+    word->val = word->val + 1;
+    mem_barrier ();
+    if (word->parked)
+        tp_unpark (word);
+}
+
 tpool_t* tpool_create (int num_threads)
 {
     int             i, ret;
     tpool_t         *tpool;
-    pthread_attr_t  attr;
 
     tpool = mem_calloc (1, sizeof (tpool_t));
     if (tpool == NULL) 
@@ -71,44 +156,31 @@ tpool_t* tpool_create (int num_threads)
     tpool->num_threads = num_threads;
     tpool->num_workers = num_threads;
 
-    tpool->args = (void **)mem_malloc (sizeof (void *) * num_threads);
-    if (tpool->args == NULL) 
-        goto fail_args;
+    /* Spinning only helps if the waker can run meanwhile. */
+    tpool->spin_polls = 
+        (sysconf (_SC_NPROCESSORS_ONLN) > 1) ? TP_SPIN_POLLS : 0;
+
+    tpool->rets = (void **)mem_calloc (num_threads, sizeof (void *));
+    if (tpool->rets == NULL) 
+        goto fail_rets;
 
     tpool->threads = (pthread_t *)mem_malloc (sizeof (pthread_t) * num_threads);
     if (tpool->threads == NULL) 
         goto fail_threads;
 
-    tpool->thread_args = (thread_arg_t *)mem_malloc (
-        sizeof (thread_arg_t) * num_threads);
+    tpool->thread_args = (thread_arg_t *)mem_calloc (
+        num_threads, sizeof (thread_arg_t));
     if (tpool->thread_args == NULL) 
         goto fail_thread_args;
 
-    ret = sem_init (&tpool->sem_all_workers_done, 0, 0);
-    if (ret != 0) 
-        goto fail_all_workers_done;
-
-    CHECK_ERROR (pthread_attr_init (&attr));
-    CHECK_ERROR (pthread_attr_setscope (&attr, PTHREAD_SCOPE_SYSTEM));
-    CHECK_ERROR (pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED));
-
     tpool->die = 0;
     for (i = 0; i < num_threads; ++i) {
         /* Initialize thread argument. */
-        CHECK_ERROR (sem_init (&(tpool->thread_args[i].sem_run), 0, 0));
-        tpool->thread_args[i].sem_all_workers_done = 
-            &tpool->sem_all_workers_done;
-        tpool->thread_args[i].num_workers_done = 
-            &tpool->num_workers_done;
-        tpool->thread_args[i].die = &tpool->die;
-        tpool->thread_args[i].thread_func = &tpool->thread_func;
-        tpool->thread_args[i].thread_func_arg = &tpool->args[i];
-        tpool->thread_args[i].ret = (void **)mem_malloc (sizeof (void *));
-        CHECK_ERROR (tpool->thread_args[i].ret == NULL);
-        tpool->thread_args[i].num_workers = &tpool->num_workers;
-        
+        tpool->thread_args[i].tpool = tpool;
+        tpool->thread_args[i].index = i;
+
         ret = pthread_create (
-            &tpool->threads[i], &attr, thread_loop, &tpool->thread_args[i]);
+            &tpool->threads[i], NULL, thread_loop, &tpool->thread_args[i]);
         if (ret) 
             goto fail_thread_create;
     }
@@ -122,13 +194,13 @@ fail_thread_create:
         pthread_cancel (tpool->threads[i]);
         --i;
     }
-fail_all_workers_done:
     mem_free (tpool->thread_args);
 fail_thread_args:
     mem_free (tpool->threads);
 fail_threads:
-    mem_free (tpool->args);
-fail_args:
+    mem_free (tpool->rets);
+fail_rets:
+    mem_free (tpool);
 
     return NULL;
 }
@@ -147,7 +219,7 @@ int tpool_set (
 
     for (i = 0; i < num_workers; ++i)
     {
-        tpool->args[i] = args[i];
+        tpool->thread_args[i].arg = args[i];
     }
     
 
@@ -156,55 +228,37 @@ int tpool_set (
 
 int tpool_begin (tpool_t *tpool)
 {
-    int             i, ret;
-
     assert (tpool != NULL);
 
     if (tpool->num_workers == 0)
         return 0;
 
     tpool->num_workers_done = 0;
+    tpool->done_seen = tpool->done.val;
 
-    for (i = 0; i < tpool->num_workers; ++i) {
-        ret = sem_post (&(tpool->thread_args[i].sem_run));
-        if (ret != 0) 
-            return -1;
-    }
+    /* The first thread wakes the others. */
+    tp_signal (&tpool->thread_args[0].run);
 
     return 0;
 }
 
 int tpool_wait (tpool_t *tpool)
 {
-    int             ret;
-
     assert (tpool != NULL);
 
     if (tpool->num_workers == 0)
         return 0;
 
-    ret = sem_wait (&tpool->sem_all_workers_done);
-    if (ret != 0) 
-        return -1;
+    tp_wait (&tpool->done, tpool->done_seen, tpool->spin_polls);
 
     return 0;
 }
 
 void** tpool_get_results (tpool_t *tpool)
 {
-    int             i;
-    void            **rets;
-
     assert (tpool != NULL);
 
-    rets = (void **)mem_malloc (sizeof (void *) * tpool->num_threads);
-    CHECK_ERROR (rets == NULL);
-
-    for (i = 0; i < tpool->num_threads; ++i) {
-        rets[i] = *(tpool->thread_args[i].ret);   
-    }
-
-    return rets;
+    return tpool->rets;
 }
 
 int tpool_destroy (tpool_t *tpool)
@@ -217,19 +271,15 @@ int tpool_destroy (tpool_t *tpool)
 
     result = 0;
     tpool->num_workers = tpool->num_threads;
-    tpool->num_workers_done = 0;
-    
-    for (i = 0; i < tpool->num_threads; ++i) {
-        mem_free (tpool->thread_args[i].ret);
+    tpool->die = 1;
+    tpool_begin (tpool);
 
-        tpool->die = 1;
-        sem_post(&tpool->thread_args[i].sem_run);
+    for (i = 0; i < tpool->num_threads; ++i) {
+        if (pthread_join (tpool->threads[i], NULL) != 0)
+            result = -1;
     }
 
-    sem_wait(&tpool->sem_all_workers_done);
-
-    sem_destroy(&tpool->sem_all_workers_done);
-    mem_free (tpool->args);
+    mem_free (tpool->rets);
     mem_free (tpool->threads);
     mem_free (tpool->thread_args);
 
@@ -238,44 +288,51 @@ int tpool_destroy (tpool_t *tpool)
     return result;
 }
 
+int tpool_get_num_threads (tpool_t *tpool)
+{
+    assert (tpool);
+
+    return tpool->num_threads;
+}
+
 static void* thread_loop (void *arg)
 {
     thread_arg_t    *thread_arg = arg;
-    thread_func     thread_func;
-    void            *thread_func_arg;
-    void            **ret;
-    int             num_workers_done;
+    tpool_t         *tpool;
+    unsigned int    seen = 0;
+    int             i, child;
 
     assert (thread_arg);
+    tpool = thread_arg->tpool;
 
     while (1)
     {
-        CHECK_ERROR (sem_wait (&thread_arg->sem_run));
-        if (*thread_arg->die)
-            break;
+        tp_wait (&thread_arg->run, seen, tpool->spin_polls);
+        seen = thread_arg->run.val;
 
-        thread_func = *(thread_arg->thread_func);
-        thread_func_arg = *(thread_arg->thread_func_arg);
-        ret = thread_arg->ret;
+        /* Pass the wakeup on before doing any work. */
+        for (i = 1; i <= TP_FANOUT; ++i)
+        {
+            child = thread_arg->index * TP_FANOUT + i;
+            if (child >= tpool->num_workers)
+                break;
+            tp_signal (&tpool->thread_args[child].run);
+        }
+
+        if (tpool->die)
+            break;
 
         /* Run thread function. */
-        *ret = (*thread_func)(thread_func_arg);
+        tpool->rets[thread_arg->index] = 
+            (*tpool->thread_func)(thread_arg->arg);
 
-        num_workers_done = fetch_and_inc(thread_arg->num_workers_done) + 1;
-        if (num_workers_done == *thread_arg->num_workers)
+        if (fetch_and_inc (&tpool->num_workers_done) + 1 == 
+            tpool->num_workers)
         {
             /* Everybody's done. */
-            CHECK_ERROR (sem_post (thread_arg->sem_all_workers_done));
+            tp_signal (&tpool->done);
         }
     }
 
-    sem_destroy (&thread_arg->sem_run);
-    num_workers_done = fetch_and_inc(thread_arg->num_workers_done) + 1;
-    if (num_workers_done == *thread_arg->num_workers)
-    {
-        /* Everybody's done. */
-        CHECK_ERROR (sem_post (thread_arg->sem_all_workers_done));
-    }
-
     return NULL;
 }
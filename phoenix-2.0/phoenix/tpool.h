@@ -36,7 +36,10 @@ tpool_t* tpool_create (int num_threads);
 int tpool_set (tpool_t *tpool, thread_func thread_func, void **args, int num_workers);
 int tpool_begin (tpool_t *tpool);
 int tpool_wait (tpool_t *tpool);
+/* Results of the last run, indexed like the arguments. The array belongs
+   to the pool and is only valid until the next tpool_begin(). */
 void** tpool_get_results (tpool_t *tpool);
 int tpool_destroy (tpool_t *tpool);
+int tpool_get_num_threads (tpool_t *tpool);
 
 #endif /* TPOOL_H_ */
@@ -0,0 +1,262 @@
+/* Copyright (c) 2007-2009, Stanford University
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*     * Redistributions of source code must retain the above copyright
+*       notice, this list of conditions and the following disclaimer.
+*     * Redistributions in binary form must reproduce the above copyright
+*       notice, this list of conditions and the following disclaimer in the
+*       documentation and/or other materials provided with the distribution.
+*     * Neither the name of Stanford University nor the names of its 
+*       contributors may be used to endorse or promote products derived from 
+*       this software without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY STANFORD UNIVERSITY ``AS IS'' AND ANY
+* EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL STANFORD UNIVERSITY BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/ 
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <inttypes.h>
+
+#include "trace.h"
+#include "memory.h"
+#include "atomic.h"
+
+#define TRACE_RING_LEN      (1 << 16)   /* Events kept per thread, the
+                                           oldest get overwritten. */
+#define TRACE_MAX_THREADS   1024
+
+typedef struct
+{
+    uint64_t        ticks;
+    uint64_t        arg;
+    uint16_t        event;
+    char            phase;
+} trace_rec_t;
+
+/* Written only by its own thread, read once tracing is over. */
+typedef struct
+{
+    uint64_t        head;               /* # of events recorded. */
+    int             tid;
+    trace_rec_t     recs[TRACE_RING_LEN];
+} trace_ring_t;
+
+typedef struct
+{
+    const char      *name;
+    const char      *cat;
+    const char      *arg_name;          /* Of the begin or instant event. */
+    const char      *end_arg_name;      /* Of the end event, or NULL. */
+} trace_desc_t;
+
+static const trace_desc_t trace_descs[TRACE_NUM_EVENTS] = {
+    {"map",             "phase",    NULL,       NULL},
+    {"reduce",          "phase",    NULL,       NULL},
+    {"merge",           "phase",    NULL,       NULL},
+    {"map task",        "map",      "task",     "emits"},
+    {"reduce task",     "reduce",   "task",     NULL},
+    {"merge slice",     "merge",    "worker",   NULL},
+    {"steal",           "sched",    "victim",   NULL},
+    {"dispatch",        "sched",    "workers",  NULL},
+    {"barrier",         "sched",    NULL,       NULL},
+};
+
+bool trace_on = false;
+__thread uint64_t trace_emits;
+
+static __thread trace_ring_t *my_ring;
+static __thread unsigned int my_gen;
+static trace_ring_t *rings[TRACE_MAX_THREADS];
+static unsigned int num_rings;
+static unsigned int trace_gen;          /* Bumped by every trace_init(). */
+static char *trace_path;
+static uint64_t start_ticks;
+static uint64_t start_nsec;
+
+static inline uint64_t trace_nsec (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Time stamp counter where there is one, it is cheaper to read. */
+static inline uint64_t trace_ticks (void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc ();
+#else
+    return trace_nsec ();
+#endif
+}
+
+void trace_init (void)
+{
+    const char *path;
+
+    if (trace_on)
+        return;
+
+    path = getenv ("MAPRED_TRACE");
+    if (path == NULL || *path == '\0')
+        return;
+
+    trace_path = strdup (path);
+    num_rings = 0;
+    trace_gen++;
+    start_nsec = trace_nsec ();
+    start_ticks = trace_ticks ();
+
+    mem_barrier ();
+    trace_on = true;
+}
+
+/** trace_ring()
+ *  Ring of the calling thread, set up on its first event
+ */
+static trace_ring_t *trace_ring (void)
+{
+    trace_ring_t *ring;
+    unsigned int idx;
+
+    if (my_ring != NULL && my_gen == trace_gen)
+        return my_ring;
+
+    idx = fetch_and_inc (&num_rings);
+    if (idx >= TRACE_MAX_THREADS)
+        return NULL;
+
+    ring = (trace_ring_t *)mem_calloc (1, sizeof (trace_ring_t));
+    ring->tid = idx;
+    rings[idx] = ring;
+
+    my_ring = ring;
+    my_gen = trace_gen;
+
+    return ring;
+}
+
+void trace_record (trace_event_t event, char phase, uint64_t arg)
+{
+    trace_ring_t *ring;
+    trace_rec_t *rec;
+
+    ring = trace_ring ();
+    if (ring == NULL)
+        return;
+
+    /* Emits are counted per map task. */
+    if (event == TRACE_MAP_TASK)
+    {
+        if (phase == 'B')
+            trace_emits = 0;
+        else
+            arg = trace_emits;
+    }
+
+    rec = &ring->recs[ring->head & (TRACE_RING_LEN - 1)];
+    rec->ticks = trace_ticks ();
+    rec->arg = arg;
+    rec->event = event;
+    rec->phase = phase;
+
+    ring->head++;
+}
+
+void trace_finalize (void)
+{
+    FILE *fp;
+    double usec_per_tick;
+    uint64_t end_ticks, end_nsec;
+    uint64_t first, i;
+    unsigned int r, nr;
+    const char *sep = "";
+
+    if (!trace_on)
+        return;
+
+    trace_on = false;
+    mem_barrier ();
+
+    end_nsec = trace_nsec ();
+    end_ticks = trace_ticks ();
+    usec_per_tick = (end_ticks > start_ticks) ? 
+        (end_nsec - start_nsec) / 1000.0 / (end_ticks - start_ticks) : 0;
+
+    nr = num_rings;
+    if (nr > TRACE_MAX_THREADS)
+        nr = TRACE_MAX_THREADS;
+
+    fp = fopen (trace_path, "w");
+    if (fp == NULL)
+        perror (trace_path);
+
+    if (fp != NULL)
+        fprintf (fp, "{\"traceEvents\":[\n");
+
+    for (r = 0; r < nr; r++)
+    {
+        trace_ring_t *ring = rings[r];
+
+        if (ring == NULL)
+            continue;
+
+        if (fp != NULL)
+        {
+            fprintf (fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\","
+                "\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"thread %d\"}}",
+                sep, ring->tid, ring->tid);
+            sep = ",\n";
+
+            first = (ring->head > TRACE_RING_LEN) ? 
+                ring->head - TRACE_RING_LEN : 0;
+            for (i = first; i < ring->head; i++)
+            {
+                trace_rec_t *rec = &ring->recs[i & (TRACE_RING_LEN - 1)];
+                const trace_desc_t *desc = &trace_descs[rec->event];
+                const char *arg_name;
+
+                arg_name = (rec->phase == 'E') ? 
+                    desc->end_arg_name : desc->arg_name;
+
+                fprintf (fp, "%s{\"name\":\"%s\",\"cat\":\"%s\","
+                    "\"ph\":\"%c\",\"ts\":%.3f,\"pid\":1,\"tid\":%d", 
+                    sep, desc->name, desc->cat, rec->phase,
+                    (rec->ticks - start_ticks) * usec_per_tick, ring->tid);
+                if (rec->phase == 'i')
+                    fprintf (fp, ",\"s\":\"t\"");
+                if (arg_name != NULL)
+                    fprintf (fp, ",\"args\":{\"%s\":%" PRIu64 "}", 
+                        arg_name, rec->arg);
+                fprintf (fp, "}");
+            }
+        }
+
+        mem_free (ring);
+        rings[r] = NULL;
+    }
+
+    if (fp != NULL)
+    {
+        fprintf (fp, "\n],\"displayTimeUnit\":\"ns\"}\n");
+        fclose (fp);
+    }
+
+    free (trace_path);
+    trace_path = NULL;
+}
@@ -0,0 +1,85 @@
+/* Copyright (c) 2007-2009, Stanford University
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*     * Redistributions of source code must retain the above copyright
+*       notice, this list of conditions and the following disclaimer.
+*     * Redistributions in binary form must reproduce the above copyright
+*       notice, this list of conditions and the following disclaimer in the
+*       documentation and/or other materials provided with the distribution.
+*     * Neither the name of Stanford University nor the names of its 
+*       contributors may be used to endorse or promote products derived from 
+*       this software without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY STANFORD UNIVERSITY ``AS IS'' AND ANY
+* EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL STANFORD UNIVERSITY BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/ 
+
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Events recorded by the runtime. Names and categories in trace.c. */
+typedef enum {
+    TRACE_PHASE_MAP = 0,
+    TRACE_PHASE_REDUCE,
+    TRACE_PHASE_MERGE,
+    TRACE_MAP_TASK,         /* arg: task, end arg: # of emits */
+    TRACE_REDUCE_TASK,      /* arg: task */
+    TRACE_MERGE_TASK,       /* arg: worker */
+    TRACE_STEAL,            /* arg: victim queue */
+    TRACE_DISPATCH,         /* arg: # of workers */
+    TRACE_BARRIER,
+    TRACE_NUM_EVENTS
+} trace_event_t;
+
+/* Set by trace_init() if tracing is on. Only read through the macros 
+   below, so a disabled trace point costs one predictable branch. */
+extern bool trace_on;
+
+/* Number of emits by the current thread, kept while tracing. */
+extern __thread uint64_t trace_emits;
+
+/* Turns tracing on if MAPRED_TRACE names an output file. */
+void trace_init (void);
+
+/* Writes the events recorded so far as Chrome trace JSON and turns
+   tracing off. Must not race with trace points. */
+void trace_finalize (void);
+
+void trace_record (trace_event_t event, char phase, uint64_t arg);
+
+#define TRACE_BEGIN(event, arg) do {                    \
+    if (__builtin_expect (trace_on, 0))                 \
+        trace_record ((event), 'B', (uint64_t)(arg));   \
+} while (0)
+
+#define TRACE_END(event, arg) do {                      \
+    if (__builtin_expect (trace_on, 0))                 \
+        trace_record ((event), 'E', (uint64_t)(arg));   \
+} while (0)
+
+#define TRACE_INSTANT(event, arg) do {                  \
+    if (__builtin_expect (trace_on, 0))                 \
+        trace_record ((event), 'i', (uint64_t)(arg));   \
+} while (0)
+
+#define TRACE_COUNT_EMITS(n) do {                       \
+    if (__builtin_expect (trace_on, 0))                 \
+        trace_emits += (n);                             \
+} while (0)
+
+#define TRACE_COUNT_EMIT() TRACE_COUNT_EMITS (1)
+
+#endif /* TRACE_H_ */
@@ -296,6 +296,7 @@ int main(int argc, char *argv[]) {
     map_reduce_args.num_merge_threads = atoi(GETENV("MR_NUMTHREADS"));//8;
     map_reduce_args.num_procs = atoi(GETENV("MR_NUMPROCS"));//16;
     map_reduce_args.key_match_factor = (float)atof(GETENV("MR_KEYMATCHFACTOR"));//2;
+    map_reduce_args.map_only = true;
 
     printf("String Match: Calling String Match\n");
 
@@ -335,6 +336,7 @@ int main(int argc, char *argv[]) {
     free(key2_final);
     free(key3_final);
     free(key4_final);
+    free(str_vals.data);
 
     printf("String Match: Completed %ld\n",(endtime.tv_sec - starttime.tv_sec));
 
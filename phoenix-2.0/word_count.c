@@ -218,12 +218,80 @@ enum {
     unsigned int library_time = 0;
 #endif
 
+/** inword()
+ *  Whether c is part of a word, once upper cased. Words start with a 
+ *  letter and may go on with apostrophes.
+ */
+static inline int inword(char c)
+{
+    c = toupper(c);
+    return (c >= 'A' && c <= 'Z') || c == '\'';
+}
+
+/** wordlen()
+ *  Length of the word at s, which is not terminated in the input
+ */
+static int wordlen(const char *s)
+{
+    int len = 0;
+
+    while (inword(s[len]))
+        len++;
+
+    return len;
+}
+
+/** mywordlencmp()
+ *  Comparison function to compare 2 words of known length, ignoring case
+ */
+int mywordlencmp(const void *s1, int len1, const void *s2, int len2)
+{
+    const char *w1 = (const char *)s1;
+    const char *w2 = (const char *)s2;
+    int i, diff;
+
+    for (i = 0; i < len1 && i < len2; i++)
+    {
+        diff = toupper(w1[i]) - toupper(w2[i]);
+        if (diff != 0)
+            return diff;
+    }
+
+    return len1 - len2;
+}
+
 /** mystrcmp()
- *  Comparison function to compare 2 words
+ *  Comparison function to compare 2 words, ignoring case
  */
 int mystrcmp(const void *s1, const void *s2)
 {
-    return strcmp((const char *)s1, (const char *) s2);
+    return mywordlencmp(s1, wordlen((const char *)s1), 
+        s2, wordlen((const char *)s2));
+}
+
+/** myhash()
+ *  Hashes a word of key_size bytes, ignoring case
+ */
+unsigned int myhash(void *key, int key_size)
+{
+    unsigned int hash = 5381;
+    char *str = (char *)key;
+    int i;
+
+    for (i = 0; i < key_size; i++)
+    {
+        hash = ((hash << 5) + hash) + toupper(str[i]); /* hash * 33 + c */
+    }
+
+    return hash;
+}
+
+/** mypartition()
+ *  Keeps the words that differ only in case together
+ */
+int mypartition(int reduce_tasks, void *key, int key_size)
+{
+    return myhash(key, key_size) % reduce_tasks;
 }
 
 /** mykeyvalcmp()
@@ -248,7 +316,7 @@ int mykeyvalcmp(const void *v1, const void *v2)
     equal produces results where the same word is repeated for all the instances
     which share the same frequency. Instead, we check the word as well, and only 
     return 0 if both the value and the word match ****/
-        return strcmp((char *)kv1->key, (char *)kv2->key);
+        return mystrcmp(kv1->key, kv2->key);
         //return 0;
     }
 }
@@ -300,14 +368,22 @@ void *wordcount_locator (map_args_t *task)
     return task->data;
 }
 
+#define WORD_BATCH 64
+
 /** wordcount_map()
- * Go through the allocated portion of the file and count the words
+ * Go through the allocated portion of the file and count the words.
+ * The input is read only, words are emitted as they are along with their
+ * length, WORD_BATCH at a time.
  */
 void wordcount_map(map_args_t *args) 
 {
     char *curr_start, curr_ltr;
     int state = NOT_IN_WORD;
     int i;
+    void *keys[WORD_BATCH];
+    void *vals[WORD_BATCH];
+    int key_sizes[WORD_BATCH];
+    int num_words = 0;
   
     assert(args);
 
@@ -315,6 +391,9 @@ void wordcount_map(map_args_t *args)
 
     assert(data);
     curr_start = data;
+
+    for (i = 0; i < WORD_BATCH; i++)
+        vals[i] = (void *)1;
     
     for (i = 0; i < args->length; i++)
     {
@@ -322,11 +401,15 @@ void wordcount_map(map_args_t *args)
         switch (state)
         {
         case IN_WORD:
-            data[i] = curr_ltr;
             if ((curr_ltr < 'A' || curr_ltr > 'Z') && curr_ltr != '\'')
             {
-                data[i] = 0;
-                emit_intermediate(curr_start, (void *)1, &data[i] - curr_start + 1);
+                keys[num_words] = curr_start;
+                key_sizes[num_words++] = &data[i] - curr_start;
+                if (num_words == WORD_BATCH)
+                {
+                    emit_intermediate_batch(keys, vals, key_sizes, num_words);
+                    num_words = 0;
+                }
                 state = NOT_IN_WORD;
             }
             break;
@@ -336,7 +419,6 @@ void wordcount_map(map_args_t *args)
             if (curr_ltr >= 'A' && curr_ltr <= 'Z')
             {
                 curr_start = &data[i];
-                data[i] = curr_ltr;
                 state = IN_WORD;
             }
             break;
@@ -346,9 +428,12 @@ void wordcount_map(map_args_t *args)
     // Add the last word
     if (state == IN_WORD)
     {
-        data[args->length] = 0;
-        emit_intermediate(curr_start, (void *)1, &data[i] - curr_start + 1);
+        keys[num_words] = curr_start;
+        key_sizes[num_words++] = &data[i] - curr_start;
     }
+
+    if (num_words > 0)
+        emit_intermediate_batch(keys, vals, key_sizes, num_words);
 }
 
 /** wordcount_reduce()
@@ -417,13 +502,17 @@ int main(int argc, char *argv[])
     // Get the file info (for file length)
     CHECK_ERROR(fstat(fd, &finfo) < 0);
 #ifndef NO_MMAP
-    // Memory map the file
+    // Memory map the file read only, over zeroed memory so that at least
+    // one zero byte follows it and ends a word at the very end.
     CHECK_ERROR((fdata = mmap(0, finfo.st_size + 1, 
-      PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0)) == NULL);
+      PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED);
+    if (finfo.st_size > 0)
+      CHECK_ERROR(mmap(fdata, finfo.st_size, 
+        PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED);
 #else
     int ret;
 
-    fdata = (char *)malloc (finfo.st_size);
+    fdata = (char *)calloc (finfo.st_size + 1, 1);
     CHECK_ERROR (fdata == NULL);
 
     ret = read (fd, fdata, finfo.st_size);
@@ -453,8 +542,10 @@ int main(int argc, char *argv[])
     map_reduce_args.splitter = wordcount_splitter;
     map_reduce_args.locator = wordcount_locator;
     map_reduce_args.key_cmp = mystrcmp;
+    map_reduce_args.key_len_cmp = mywordlencmp;
+    map_reduce_args.hash = myhash;
     map_reduce_args.unit_size = wc_data.unit_size;
-    map_reduce_args.partition = NULL; // use default
+    map_reduce_args.partition = mypartition;
     map_reduce_args.result = &wc_vals;
     map_reduce_args.data_size = finfo.st_size;
     map_reduce_args.L1_cache_size = atoi(GETENV("MR_L1CACHESIZE"));//1024 * 1024 * 2;
@@ -463,6 +554,15 @@ int main(int argc, char *argv[])
     map_reduce_args.num_merge_threads = atoi(GETENV("MR_NUMTHREADS"));//8;
     map_reduce_args.num_procs = atoi(GETENV("MR_NUMPROCS"));//16;
     map_reduce_args.key_match_factor = (float)atof(GETENV("MR_KEYMATCHFACTOR"));//2;
+    map_reduce_args.intermediate_store = atoi(GETENV("MR_STORE"));
+    map_reduce_args.map_placement = atoi(GETENV("MR_MAP_PLACEMENT"));
+    map_reduce_args.reduce_placement = atoi(GETENV("MR_REDUCE_PLACEMENT"));
+    map_reduce_args.merge_placement = atoi(GETENV("MR_MERGE_PLACEMENT"));
+    map_reduce_args.pipeline = atoi(GETENV("MR_PIPELINE")) ? true : false;
+    map_reduce_args.combine = atoi(GETENV("MR_COMBINE"));
+    map_reduce_args.combine_threshold = atoi(GETENV("MR_COMBINE_THRESHOLD"));
+    map_reduce_args.split = atoi(GETENV("MR_SPLIT"));
+    map_reduce_args.intermediate_budget = atol(GETENV("MR_BUDGET"));
 
     printf("Wordcount: Calling MapReduce Scheduler Wordcount\n");
 
@@ -502,7 +602,16 @@ int main(int argc, char *argv[])
     for (i = 0; i < disp_num && i < wc_vals.length; i++)
     {
       keyval_t * curr = &((keyval_t *)wc_vals.data)[i];
-      dprintf("%15s - %" PRIdPTR "\n", (char *)curr->key, (intptr_t)curr->val);
+      char * word = (char *)curr->key;
+      int j, len = wordlen(word);
+      char * upper = (char *)malloc(len + 1);
+
+      CHECK_ERROR (upper == NULL);
+      for (j = 0; j < len; j++)
+        upper[j] = toupper(word[j]);
+      upper[len] = 0;
+      dprintf("%15s - %" PRIdPTR "\n", upper, (intptr_t)curr->val);
+      free(upper);
     }
 
     free(wc_vals.data);